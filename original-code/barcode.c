@@ -13,7 +13,8 @@
 /*
  * This program generates XBM format images of UPC-style barcodes. It
  * can be used directly from the commandline, but it has explicit support
- * for being called from a CGI-type script. Call it like this:
+ * for being called from a CGI-type script. Build it with something like
+ * "cc -O2 -pthread -o barcode barcode.c", and call it like this:
  *
  *     barcode [options] value
  *
@@ -23,26 +24,197 @@
  *       containing settings (see below).
  *     --http-header: Generate an HTTP response header before the image.
  *     --print-password: Just print out the current password (see below).
+ *     --sign=SECONDS: Just print out the "exp" and "sig" keys that sign the
+ *       request (see below) for at least the given number of seconds.
  *     --require-password: A password must be set in the form data for
  *       the program to operate properly (see below).
  *     --mode=VALUE: Change the default mode from normal UPC/EAN (see below
  *       for the possible values).
+ *     --output=VALUE: Change what is output (see "output" below).
+ *     --json-data: The value argument is a JSON object containing settings
+ *       (the same keys as for --form-data, with string values, except that
+ *       "values" is an array), and errors are reported as JSON.
+ *     --cgi: Act as a CGI program: the form data is taken from the request
+ *       (either the QUERY_STRING or a form-encoded or JSON POST body on
+ *       stdin, up to 64k), and an HTTP response header is generated. For
+ *       a HEAD request, only the header is generated (see --head).
+ *     --serve=PORT: Act as an HTTP/1.1 server on the given port (see
+ *       below), instead of handling a single request.
+ *     --font=FILE: Draw text with the 5x8 font in the given XBM file
+ *       (laid out like assets/font-5x8.xbm, as one 8-pixel-wide column of
+ *       128 characters) instead of the built-in one.
+ *     --rate-limit=N: In server mode, allow each client address N requests
+ *       per second (with bursts of up to two seconds' worth), refusing
+ *       any more with a 429 status.
+ *     --load=PORT: Instead of making an image, generate load against a
+ *       server (see --serve) on the given port of this host, replaying
+ *       the requests in the file named by the value argument (or stdin),
+ *       and print a JSON report of the latencies (see below).
+ *     --rate=N: With --load, send N requests per second (1000 by
+ *       default).
+ *     --connections=N: With --load, send the requests over N keep-alive
+ *       connections (64 by default).
+ *     --duration=SECONDS: With --load, send requests for the given number
+ *       of seconds (10 by default).
+ *     --metrics=FILE: Record metrics of the time spent in each stage of
+ *       making images, and of the requests, errors, and bytes of output,
+ *       and write them to the given file (or to stderr, if it is "-") at
+ *       exit, in the same form as the server's /metrics (see below).
+ *     --trace=MICROS: Keep a trace of each request that takes at least
+ *       the given number of microseconds, giving the time spent in each
+ *       stage of it (see "/traces" below); outside of server mode, the
+ *       traces are written to stderr at exit, as JSON.
+ *     --trace-sample=N: With --trace, also keep a trace of one in every
+ *       N of the other requests, chosen at random.
+ *     --verify: Decode each UPC/EAN barcode after rendering it (from a
+ *       row of its image, as a scanner would) and check that it gives
+ *       back the digits it was rendered from, reporting the error
+ *       "verify-failed" (see below) in place of any image that doesn't.
+ *       The check digit isn't enforced: a number given with a wrong one
+ *       verifies if it reads back as given. Text images, and barcodes
+ *       drawn over by the magic picture, aren't checked.
+ *     --head: Generate just the HTTP response header for an image,
+ *       including its Content-Length and the size of the image (in
+ *       X-Image-Width and X-Image-Height), without rendering it.
+ *     --bench: Run the benchmark named by the value argument ("form",
+ *       "check", "upce", "password", "xbm", "verify", or "stages") and
+ *       print out timings, instead of making an image. The "stages"
+ *       benchmark times each stage of making an image (parsing the form,
+ *       parsing the value, drawing the bars, banner, supplement, and
+ *       text, rendering as a whole, writing XBM, and a whole request)
+ *       over a range of modes and inputs, and prints a JSON array with
+ *       one object per stage and input: its "stage", "mode", and
+ *       "input", and the "ns_per_op", "allocs_per_op", and
+ *       "bytes_per_op" (the size of the image or output made, or 0) of
+ *       one run of it.
+ *     --check: Instead of making an image, check the integrity of an XBM
+ *       file read from stdin, with the mask given as the value argument;
+ *       if file names follow the value, then each of those files is
+ *       checked instead (in parallel), with a line of output per file;
+ *       the exit status is 1 if any of them couldn't be read.
+ *     --validate: Instead of making an image, read GTINs (UPC/EAN numbers
+ *       of 8, 12, 13, or 14 digits, including the check digit) from stdin,
+ *       one per line, and print the line numbers of the invalid ones; the
+ *       exit status is 1 if there were any.
+ *     --complete: Like --validate, but the numbers lack their check
+ *       digits, and each one is printed with its check digit appended (or
+ *       as an empty line, if it isn't a number of the right length).
+ *     --convert: Like --validate, but each number is converted between
+ *       UPC-A (12 digits) and UPC-E (7 or 8 digits), whichever it isn't,
+ *       and printed (or printed as an empty line, if it can't be).
+ *     --catalog: Instead of making an image, read a catalog of book
+ *       numbers (as for the "isbn" mode) from stdin, one per line, and
+ *       render them all (in parallel) as one multipart stream, as for a
+ *       batch (see below), with a JSON error part for each line that
+ *       can't be rendered; the exit status is 1 if there were any.
+ *
+ * The values of the options that take a number (N, SECONDS, or MICROS)
+ * must be positive whole numbers; an option with any other value is
+ * reported as unrecognized (and ignored).
  *
  * If the --form-data option is given, then the value argument is parsed
  * as form data, and the following keys are recognized:
  *
  *     password: the password for the invocation (see below)
+ *     sig, exp: the signature of the request, and when it expires, in
+ *       place of the password (see below)
  *     value: the value to encode (e.g., the UPC number)
+ *     values: a JSON array of values to encode (e.g., ["123","456"])
  *     mode: the mode, one of "upcean", "upcean-short", "upce", "upce-short",
- *       "ean8", "ean8-short", or "text"
+ *       "ean8", "ean8-short", "isbn", "isbn-short", or "text"
+ *     layout: how to lay out a batch (see below), either "multipart" (the
+ *       default) or "sprite"
+ *     format: how to report errors, either "xbm" (the default; an image of
+ *       the explanation) or "json" (an object of the form
+ *       {"error":{"code":"...","message":"..."}}, with an HTTP status
+ *       to match, if there is a header)
+ *     output: what to output, either "image" (the default), "modules", or
+ *       "size" (see below)
+ *
+ * If more than one value is given (with "values" and/or repeated "value"
+ * keys, up to 64 in all), then they are all rendered as a batch (in
+ * parallel, where possible), and the result is a multipart/mixed response.
+ * With the "multipart" layout, there is one XBM part per value. With the
+ * "sprite" layout, there is a single XBM part containing all the images,
+ * followed by a JSON part giving the position and size of each. When
+ * errors are reported as JSON, a value that can't be rendered gets a JSON
+ * error part (or an "error" member in the sprite map) instead of an image.
+ *
+ * With the "modules" output, no image is made. Instead, the result is a
+ * JSON object describing how the barcode is encoded: its symbology, its
+ * human-readable digits (with the check digit filled in), its canonical
+ * 14-digit GTIN and whether its check digit is correct, its bar/space
+ * pattern as a string of modules ("1" for bar and "0" for space), the
+ * ranges of modules whose bars are drawn long, and its banner and
+ * supplement, if any (the supplement's offset is in modules from the
+ * start of the main pattern). A batch results in an array of these, with
+ * error objects in place of values that couldn't be encoded.
+ *
+ * With the "size" output, no image is made either. Instead, the result is
+ * a JSON object giving the width and height of the image that would be
+ * made, whether it is a barcode (as opposed to a text image, e.g. of an
+ * error), and the length of its XBM text. As with "modules", a batch
+ * results in an array of these.
+ *
+ * In server mode, requests to "/" are handled just like CGI requests
+ * (with the form data in the query string or a POST body), starting out
+ * with the settings given on the commandline. Connections are kept alive
+ * (and may pipeline requests), successful responses carry an ETag (and
+ * If-None-Match is honored), and requests are served by a fixed pool of
+ * threads, each of which only gets a connection once a whole request
+ * header has come in on it (until then, and while it is idle, the
+ * connection is watched by a single thread). A client has 10 seconds to
+ * send the whole of a request once it has started one, an idle
+ * connection is closed after 30 seconds, and each client address may
+ * have at most 256 connections open at once. Responses are cached in
+ * memory by the canonical form of the request, in which each UPC/EAN
+ * number is normalized (so that, e.g., a number with its check digit
+ * given as "?" shares an entry with the same number written out in full,
+ * except in a sprite sheet, whose map gives each number as written),
+ * and the X-Cache header says whether a response came from the cache.
+ * Requests to "/rate-limit" get a JSON report of the requests allowed and
+ * refused by the rate limiter, and requests to "/metrics" get the
+ * server's metrics, in the Prometheus text format: counts of requests by
+ * mode, of errors by code, of cache hits and misses, and of response
+ * bytes, and histograms of the time spent in each stage of handling
+ * requests (parsing, cache lookup, encoding, rendering, verifying,
+ * writing out XBM, sending the response, and the request as a whole).
+ * With --trace, requests to "/traces" get the last 256 traces kept, as
+ * a JSON array; each gives the request as a query string that replays
+ * it (e.g. "mode=upcean&value=012345678905%3Awww.milk.com", with each
+ * UPC/EAN number normalized, and without any password or signature), its
+ * mode, status, and length, how long it took, and the start and length
+ * of each stage (as above) done by its own thread, in microseconds. The
+ * traces are also written to stderr whenever the server gets SIGUSR1.
+ *
+ * The load generator (--load) reads a request mix of one request target
+ * per line (e.g. "/?value=0123456789%3F&mode=upcean"), ignoring blank
+ * lines and lines starting with "#", and sends the requests in turn,
+ * over and over, at a steady rate that doesn't depend on how fast the
+ * server responds. Each request's latency is measured from when it was
+ * due to be sent, and is recorded in a histogram precise to within 1%.
+ * The report gives the median, 90th, 99th, and 99.9th percentiles and
+ * the maximum, in microseconds, for all responses and separately for
+ * cache hits and misses (by their X-Cache headers), along with counts of
+ * requests sent, completed, failed, and dropped (for lack of a free
+ * connection, after a backlog of 65536).
  *
  * The password mechanism is provided to prevent some casual abuses of the
  * system in case it is deployed as a relatively open server. The passwords
  * printed by --print-password change hourly and are valid for a duration
- * of three hours. If a password is required and is either missing or
- * invalid, then the program will generate some words to ponder instead of
- * a barcode. Refer to the scripts that came with this distribution for an
- * example of how to fit it all together.
+ * of three hours. (They are 16 hex digits of a keyed hash of the hour, so
+ * they can't be worked out without the base password.) If a password is
+ * required and is either missing or invalid, then the program will
+ * generate some words to ponder instead of a barcode. Refer to the
+ * scripts that came with this distribution for an example of how to fit
+ * it all together.
+ *
+ * Instead of a password, a request may carry a signature, made with
+ * --sign, which is a keyed hash of the canonical form of the request (as
+ * used by the server's cache) and of its expiry time. Expiry times are
+ * rounded up to the hour, so that a given image signed within the same
+ * hour has the same URL, which (unlike one with a password) can be cached
+ * by browsers and proxies for as long as it is valid.
  *
  * There is a default banner that is placed above resulting barcode images.
  * This default string is defined about half a page down from here. The
@@ -68,25 +240,651 @@
  * appears to the right of the main code. To add a supplemental code, place
  * a comma and then the supplemental number after the main code, e.g.,
  * "5553221?,76".
+ *
+ * The "isbn*" modes take book numbers instead: ISBNs of 10 or 13 digits,
+ * 8-digit ISSNs, and ISMNs (either "M" and 9 digits, or 13 digits), which
+ * may be preceded by their name and contain hyphens and spaces, e.g.
+ * "ISBN 0-306-40615-2". They are converted to the EAN-13 numbers that
+ * encode them (under the 978/979, 977, and 979-0 prefixes), with the check
+ * digit recomputed; the check digit that is given is verified (or may be
+ * a question mark). The supplement may be given as a price in dollars
+ * instead, e.g. "0-306-40615-2,$12.95", and the default banner is the
+ * number, as converted.
+ *
+ * If <sys/sdt.h> is around when this is built (on Linux, it comes with
+ * SystemTap's development files), then the program has static tracepoints
+ * (USDT probes, of the provider "barcode") that tracers such as bpftrace
+ * and SystemTap can attach to, which cost nothing when none is attached
+ * (build with -DBARCODE_NO_PROBES to leave them out anyway). They are as
+ * follows, with their arguments; modes and errors are given as numbers,
+ * in the order of the Mode and ErrorCode enums below:
+ *
+ *     request__start: a request is about to be handled (in server mode,
+ *       once its header has been read).
+ *     request__done(mode, bytes, header): a response of the given count
+ *       of body bytes, with the given header block (HeaderId), has been
+ *       written; the mode is -1 for requests that aren't for images
+ *       (e.g. for "/metrics", or rejected ones).
+ *     parse__start(isJson), parse__done(mode, valueCount, error): around
+ *       parsing the form or JSON data of a request.
+ *     cache__start(hash), cache__done(hit, keyLength): around looking a
+ *       request up in the server's cache.
+ *     encode__start(mode, value), encode__done(mode, ok, error): around
+ *       parsing a value (a string) into the number that gets encoded.
+ *     encode__digits(digits, supDigits, explicitDigits): within the
+ *       parsing of a UPC/EAN number, the count of its digits, of its
+ *       supplement's digits, and of the digits the mode asks for (or 0).
+ *     render__start(mode), render__done(mode, width, height): around
+ *       rendering an image (the size is 0x0 if there was an error).
+ *     output__done(bytes): an image has been written out as XBM text of
+ *       the given length.
+ *     alloc__bitmap(width, height): a bitmap has been allocated.
+ *     alloc__buffer(capacity, length): a buffer has been (re)allocated,
+ *       to the given capacity, while holding the given length.
+ *
+ * For example, "bpftrace -e 'usdt:./barcode:render__done
+ * { @[arg0] = hist(arg1); }'" shows the widths of images by mode. To
+ * check that a build has the probes, look for their "stapsdt" notes with
+ * "readelf -n barcode", or list them with "bpftrace -l 'usdt:./barcode:*'";
+ * a build without <sys/sdt.h> has neither.
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#endif
+
+/* static tracepoints (see above); each one is a single no-op instruction
+ * (and a note in the executable saying where it is and where its
+ * arguments are) until a tracer attaches to it, and without <sys/sdt.h>
+ * they are nothing at all */
+#if defined (__has_include) && ! defined (BARCODE_NO_PROBES)
+#if __has_include (<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BARCODE_PROBES 1
+#endif
+#endif
+
+#ifdef BARCODE_PROBES
+#define PROBE(name) DTRACE_PROBE (barcode, name)
+#define PROBE1(name, a) DTRACE_PROBE1 (barcode, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2 (barcode, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3 (barcode, name, a, b, c)
+#else
+#define PROBE(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
 
 /* change this to whatever you want to; it shows up just above the barcode */
 static char *defaultBannerMsg = "www.milk.com";
 
-/* change this to set the base password; this is used in a pseudocrypto way
- * to generate a time-based value that is checked before generating an
+/* change this to set the base password; this is used as the key of an
+ * HMAC to generate a time-based value that is checked before generating an
  * image, when the --require-password option is used; if you don't need
  * password checking, then don't bother passing that option in */
 static char *password = "zorchSplat";
 
 
 
+/* ----------------------------------------------------------------------------
+ * output buffers
+ */
+
+/* the count of allocations (and reallocations) made by the calling
+ * thread in makeBitmap() and bufferReserve(), which are where the memory
+ * for rendering and output comes from; read by the benchmarks */
+static __thread unsigned long long allocCount = 0;
+
+/* simple growable byte buffer, used to build up output in memory */
+typedef struct
+{
+    char *buf;
+    int length;
+    int capacity;
+}
+Buffer;
+
+/* initialize an (empty) buffer */
+void bufferInit (Buffer *b)
+{
+    b->buf = NULL;
+    b->length = 0;
+    b->capacity = 0;
+}
+
+/* free the contents of a buffer, leaving it empty */
+void bufferFree (Buffer *b)
+{
+    free (b->buf);
+    bufferInit (b);
+}
+
+/* make sure the given buffer has room for at least the given number of
+ * additional bytes */
+void bufferReserve (Buffer *b, int amount)
+{
+    int need = b->length + amount;
+
+    if (need > b->capacity)
+    {
+        int newCapacity = (b->capacity < 256) ? 256 : b->capacity;
+        while (newCapacity < need)
+        {
+            newCapacity *= 2;
+        }
+        b->buf = realloc (b->buf, newCapacity);
+        b->capacity = newCapacity;
+        allocCount++;
+        PROBE2 (alloc__buffer, newCapacity, b->length);
+    }
+}
+
+/* append the given bytes to the given buffer */
+void bufferAppend (Buffer *b, const char *data, int length)
+{
+    bufferReserve (b, length);
+    memcpy (b->buf + b->length, data, length);
+    b->length += length;
+}
+
+/* append the given null-terminated string to the given buffer */
+void bufferAppendString (Buffer *b, const char *str)
+{
+    bufferAppend (b, str, strlen (str));
+}
+
+/* append printf-style formatted text to the given buffer */
+void bufferPrintf (Buffer *b, const char *format, ...)
+{
+    va_list args;
+    int amt;
+
+    va_start (args, format);
+    amt = vsnprintf (NULL, 0, format, args);
+    va_end (args);
+
+    bufferReserve (b, amt + 1);
+
+    va_start (args, format);
+    vsnprintf (b->buf + b->length, amt + 1, format, args);
+    va_end (args);
+
+    b->length += amt;
+}
+
+/* append the given string to the given buffer, form-encoded (so that it
+ * can be a key or value in a query string) */
+void bufferAppendFormString (Buffer *b, const char *str)
+{
+    for (; *str != '\0'; str++)
+    {
+        if (isalnum ((unsigned char) *str) || (*str == '.') || (*str == '-'))
+        {
+            bufferAppend (b, str, 1);
+        }
+        else if (*str == ' ')
+        {
+            bufferAppend (b, "+", 1);
+        }
+        else
+        {
+            bufferPrintf (b, "%%%02X", (unsigned char) *str);
+        }
+    }
+}
+
+/* append the given string to the given buffer as a JSON string literal */
+void bufferAppendJsonString (Buffer *b, const char *str)
+{
+    bufferAppend (b, "\"", 1);
+
+    for (;;)
+    {
+        /* append the run of characters that need no escaping at once */
+        const char *run = str;
+        while (((unsigned char) *str >= 0x20) && (*str != '"')
+               && (*str != '\\'))
+        {
+            str++;
+        }
+        bufferAppend (b, run, str - run);
+
+        if (*str == '\0')
+        {
+            break;
+        }
+        else if (*str == '\n')
+        {
+            bufferAppend (b, "\\n", 2);
+        }
+        else if ((*str == '"') || (*str == '\\'))
+        {
+            bufferAppend (b, "\\", 1);
+            bufferAppend (b, str, 1);
+        }
+        else
+        {
+            bufferPrintf (b, "\\u%04x", (unsigned char) *str);
+        }
+        str++;
+    }
+
+    bufferAppend (b, "\"", 1);
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * responses
+ */
+
+/* the boundary string used between the parts of a multipart response */
+#define BATCH_BOUNDARY "milk-barcode-batch"
+
+/* the precomputed response header blocks; each one covers a status,
+ * content type, and caching policy (only the identity content encoding is
+ * ever used, so that doesn't need to vary) */
+typedef enum
+{
+    HEADER_XBM, HEADER_JSON, HEADER_MULTIPART, HEADER_JSON_LIVE,
+    HEADER_METRICS,
+    HEADER_JSON_400, HEADER_JSON_403, HEADER_JSON_500,
+    HEADER_TEXT_400, HEADER_TEXT_404, HEADER_TEXT_405, HEADER_TEXT_411,
+    HEADER_TEXT_413, HEADER_TEXT_414, HEADER_TEXT_415, HEADER_TEXT_429,
+    HEADER_TEXT_431, HEADER_NOT_MODIFIED
+}
+HeaderId;
+
+/* a precomputed response header block, in both CGI and HTTP/1.1 form,
+ * lacking only the length-dependent lines and the terminating blank line */
+typedef struct
+{
+    const char *cgi;
+    int cgiLength;
+    const char *http;
+    int httpLength;
+    int cacheable;       /* boolean whether the response gets an ETag */
+}
+HeaderBlock;
+
+/* the header lines common to all blocks, with the given line ending */
+#define HEADER_LINES(eol, type, cache) \
+    "Content-Type: " type eol "Cache-Control: " cache eol
+
+/* a block for a successful, cacheable response (which, as a CGI response,
+ * has no explicit status line) */
+#define HEADER_BLOCK_OK(type)                                           \
+    {                                                                   \
+        HEADER_LINES ("\n", type, "max-age=3600"),                      \
+        sizeof (HEADER_LINES ("\n", type, "max-age=3600")) - 1,         \
+        "HTTP/1.1 200 OK\r\n" HEADER_LINES ("\r\n", type, "max-age=3600"), \
+        sizeof ("HTTP/1.1 200 OK\r\n"                                   \
+                HEADER_LINES ("\r\n", type, "max-age=3600")) - 1,       \
+        1                                                               \
+    }
+
+/* a block for an error response (or any other response that must not be
+ * cached) */
+#define HEADER_BLOCK_ERROR(status, type)                                \
+    {                                                                   \
+        "Status: " status "\n" HEADER_LINES ("\n", type, "no-cache"),   \
+        sizeof ("Status: " status "\n"                                  \
+                HEADER_LINES ("\n", type, "no-cache")) - 1,             \
+        "HTTP/1.1 " status "\r\n" HEADER_LINES ("\r\n", type, "no-cache"), \
+        sizeof ("HTTP/1.1 " status "\r\n"                               \
+                HEADER_LINES ("\r\n", type, "no-cache")) - 1,           \
+        0                                                               \
+    }
+
+/* all the header blocks, indexed by HeaderId */
+static const HeaderBlock headerBlocks[] =
+{
+    [HEADER_XBM]       = HEADER_BLOCK_OK ("image/x-xbitmap"),
+    [HEADER_JSON]      = HEADER_BLOCK_OK ("application/json"),
+    [HEADER_MULTIPART] =
+        HEADER_BLOCK_OK ("multipart/mixed; boundary=" BATCH_BOUNDARY),
+    [HEADER_JSON_LIVE] =
+        HEADER_BLOCK_ERROR ("200 OK", "application/json"),
+    [HEADER_METRICS]   =
+        HEADER_BLOCK_ERROR ("200 OK", "text/plain; version=0.0.4"),
+    [HEADER_JSON_400]  =
+        HEADER_BLOCK_ERROR ("400 Bad Request", "application/json"),
+    [HEADER_JSON_403]  =
+        HEADER_BLOCK_ERROR ("403 Forbidden", "application/json"),
+    [HEADER_JSON_500]  =
+        HEADER_BLOCK_ERROR ("500 Internal Server Error", "application/json"),
+    [HEADER_TEXT_400]  =
+        HEADER_BLOCK_ERROR ("400 Bad Request", "text/plain"),
+    [HEADER_TEXT_404]  =
+        HEADER_BLOCK_ERROR ("404 Not Found", "text/plain"),
+    [HEADER_TEXT_405]  =
+        HEADER_BLOCK_ERROR ("405 Method Not Allowed", "text/plain"),
+    [HEADER_TEXT_411]  =
+        HEADER_BLOCK_ERROR ("411 Length Required", "text/plain"),
+    [HEADER_TEXT_413]  =
+        HEADER_BLOCK_ERROR ("413 Payload Too Large", "text/plain"),
+    [HEADER_TEXT_414]  =
+        HEADER_BLOCK_ERROR ("414 URI Too Long", "text/plain"),
+    [HEADER_TEXT_415]  =
+        HEADER_BLOCK_ERROR ("415 Unsupported Media Type", "text/plain"),
+    [HEADER_TEXT_429]  =
+        HEADER_BLOCK_ERROR ("429 Too Many Requests", "text/plain"),
+    [HEADER_TEXT_431]  =
+        HEADER_BLOCK_ERROR ("431 Request Header Fields Too Large",
+                            "text/plain"),
+    [HEADER_NOT_MODIFIED] =
+    {
+        "Status: 304 Not Modified\n",
+        sizeof ("Status: 304 Not Modified\n") - 1,
+        "HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=3600\r\n",
+        sizeof ("HTTP/1.1 304 Not Modified\r\n"
+                "Cache-Control: max-age=3600\r\n") - 1,
+        1
+    }
+};
+
+/* a response, ready to be written out */
+typedef struct
+{
+    HeaderId header;     /* which header block to use */
+    Buffer body;         /* the body */
+    int head;            /* boolean whether to leave out the body */
+    int length;          /* length of the body, if it was measured instead
+                          * of being made; -1 if the body is present */
+    int imageWidth;      /* size of the image in the body, if it is an */
+    int imageHeight;     /* image and is known; 0 otherwise */
+    const char *cacheStatus; /* value of an X-Cache header, or NULL */
+    char etag[19];       /* the entity tag (see responseETag()), or empty
+                          * if it hasn't been needed yet */
+    int *sharedBody;     /* if the body is borrowed from an allocation
+                          * shared between threads (e.g. a cache entry),
+                          * the reference count at its start, which is
+                          * released instead of freeing the body; NULL
+                          * otherwise */
+}
+Response;
+
+/* the ways a response may be written out */
+typedef enum
+{
+    RESPONSE_BODY,       /* just the body, for commandline use */
+    RESPONSE_CGI,        /* with a CGI header */
+    RESPONSE_HTTP        /* as a complete HTTP/1.1 response */
+}
+ResponseStyle;
+
+/* initialize an (empty) response */
+void responseInit (Response *r)
+{
+    r->header = HEADER_XBM;
+    bufferInit (&r->body);
+    r->head = 0;
+    r->length = -1;
+    r->imageWidth = 0;
+    r->imageHeight = 0;
+    r->cacheStatus = NULL;
+    r->etag[0] = '\0';
+    r->sharedBody = NULL;
+}
+
+/* free the contents of a response, leaving it empty */
+void responseFree (Response *r)
+{
+    if (r->sharedBody == NULL)
+    {
+        bufferFree (&r->body);
+    }
+    else if (__atomic_sub_fetch (r->sharedBody, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free (r->sharedBody);
+    }
+    responseInit (r);
+}
+
+/* write the given literal string to the given position, returning the
+ * position just after it */
+char *fragmentString (char *out, const char *str)
+{
+    while (*str != '\0')
+    {
+        *out = *str;
+        out++;
+        str++;
+    }
+
+    return out;
+}
+
+/* write the given non-negative number in decimal to the given position,
+ * returning the position just after it */
+char *fragmentNumber (char *out, unsigned long long value)
+{
+    char digits[20];
+    int count = 0;
+
+    do
+    {
+        digits[count] = '0' + (value % 10);
+        value /= 10;
+        count++;
+    }
+    while (value != 0);
+
+    while (count > 0)
+    {
+        count--;
+        *out = digits[count];
+        out++;
+    }
+
+    return out;
+}
+
+/* return a 64-bit hash of the given bytes, taken 8 at a time */
+unsigned long long hashBytes (const char *p, int length)
+{
+    unsigned long long hash = 0x9e3779b97f4a7c15ULL ^ length;
+    int left = length;
+
+    while (left >= 8)
+    {
+        unsigned long long word;
+        memcpy (&word, p, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+        p += 8;
+        left -= 8;
+    }
+
+    while (left > 0)
+    {
+        hash = (hash ^ (unsigned char) *p) * 0x100000001b3ULL;
+        p++;
+        left--;
+    }
+
+    hash ^= hash >> 29;
+    return hash;
+}
+
+/* get the entity tag for the given response, which must have a body;
+ * this is a hash of the body, which is only computed the first time it
+ * is needed */
+const char *responseETag (Response *r)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    char *etag = r->etag;
+    unsigned long long hash;
+    int i;
+
+    if (etag[0] != '\0')
+    {
+        return etag;
+    }
+
+    hash = hashBytes (r->body.buf, r->body.length);
+    etag[0] = '"';
+    for (i = 0; i < 16; i++)
+    {
+        etag[i + 1] = hexDigits[(hash >> (60 - i * 4)) & 0xf];
+    }
+    etag[17] = '"';
+    etag[18] = '\0';
+
+    return etag;
+}
+
+/* write all of the given vector of buffers to the given file descriptor;
+ * returns 0 if that could not be done */
+int writevFully (int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t amt = writev (fd, iov, count);
+
+        if (amt < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+
+        while ((count > 0) && ((size_t) amt >= iov->iov_len))
+        {
+            amt -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + amt;
+            iov->iov_len -= amt;
+        }
+    }
+
+    return 1;
+}
+
+/* write out the given response in the given style, as a single writev()
+ * of the precomputed header block, the length-dependent header lines
+ * (built without any formatting calls), and the body; for HTTP, the
+ * connection is marked as kept alive or not, as indicated; returns 0 if
+ * the response could not be written */
+int responseWrite (Response *r, int fd, ResponseStyle style, int keepAlive)
+{
+    const HeaderBlock *block = &headerBlocks[r->header];
+    struct iovec iov[3];
+    char fragment[200];
+    char *eol = (style == RESPONSE_HTTP) ? "\r\n" : "\n";
+    char *f = fragment;
+    int count = 0;
+    int length = (r->length < 0) ? r->body.length : r->length;
+
+    if (style != RESPONSE_BODY)
+    {
+        int cgi = (style == RESPONSE_CGI);
+
+        iov[0].iov_base = (void *) (cgi ? block->cgi : block->http);
+        iov[0].iov_len = cgi ? block->cgiLength : block->httpLength;
+
+        /* CGI responses leave the length to the server, unless the body
+         * was only measured */
+        if ((! cgi || (r->length >= 0)) && (r->header != HEADER_NOT_MODIFIED))
+        {
+            f = fragmentString (f, "Content-Length: ");
+            f = fragmentNumber (f, length);
+            f = fragmentString (f, eol);
+
+            if (r->imageWidth != 0)
+            {
+                f = fragmentString (f, "X-Image-Width: ");
+                f = fragmentNumber (f, r->imageWidth);
+                f = fragmentString (f, eol);
+                f = fragmentString (f, "X-Image-Height: ");
+                f = fragmentNumber (f, r->imageHeight);
+                f = fragmentString (f, eol);
+            }
+        }
+
+        if (! cgi)
+        {
+            if (block->cacheable && (r->length < 0))
+            {
+                f = fragmentString (f, "ETag: ");
+                f = fragmentString (f, responseETag (r));
+                f = fragmentString (f, eol);
+            }
+
+            if (r->cacheStatus != NULL)
+            {
+                f = fragmentString (f, "X-Cache: ");
+                f = fragmentString (f, r->cacheStatus);
+                f = fragmentString (f, eol);
+            }
+
+            f = fragmentString (f, keepAlive
+                                ? "Connection: keep-alive\r\n"
+                                : "Connection: close\r\n");
+        }
+
+        f = fragmentString (f, eol);
+        iov[1].iov_base = fragment;
+        iov[1].iov_len = f - fragment;
+        count = 2;
+    }
+
+    if (! r->head && (r->body.length != 0))
+    {
+        iov[count].iov_base = r->body.buf;
+        iov[count].iov_len = r->body.length;
+        count++;
+    }
+
+    return writevFully (fd, iov, count);
+}
+
+/* set up the given response to reject a request with the given error
+ * header (one of the text ones) and plain-text explanation */
+void rejectResponse (Response *r, HeaderId header, const char *reason)
+{
+    r->header = header;
+    bufferAppendString (&r->body, reason);
+    bufferAppendString (&r->body, "\n");
+}
+
+
+
 /* ----------------------------------------------------------------------------
  * bitmap manipulation
  */
@@ -101,14 +899,16 @@ typedef struct
 }
 Bitmap;
 
-/* construct a new bitmap */
+/* construct a new (all clear) bitmap */
 Bitmap *makeBitmap (int width, int height)
 {
     Bitmap *result = malloc (sizeof (Bitmap));
     result->width = width;
     result->height = height;
     result->widthBytes = (width + 7) / 8;
-    result->buf = malloc (height * result->widthBytes);
+    result->buf = calloc (height, result->widthBytes);
+    allocCount += 2;
+    PROBE2 (alloc__bitmap, width, height);
     return result;
 }
 
@@ -170,17 +970,81 @@ void bitmapSet (Bitmap *b, int x, int y, int value)
     }
 }
 
-/* copy the given rectangle to the given destination from the given source. */
+/* get the 8 bits starting at the given bit offset (which may be negative
+ * or past the end) of the given row of the given bitmap; bits that are
+ * out of range read as 0 */
+static inline int bitmapGetRowBits (Bitmap *b, int y, int bitOffset)
+{
+    int xbyte = bitOffset >> 3;
+    int shift = bitOffset & 0x7;
+    int bits;
+
+    if ((y < 0) || (y >= b->height))
+    {
+        return 0;
+    }
+
+    bits = (bitmapGetByte (b, xbyte, y) >> shift)
+        | (bitmapGetByte (b, xbyte + 1, y) << (8 - shift));
+
+    return bits & 0xff;
+}
+
+/* copy the given rectangle to the given destination from the given source;
+ * this works a byte at a time rather than a bit at a time; source pixels
+ * that are out of range copy as 0, and destination pixels that are out of
+ * range are ignored */
 void bitmapCopyRect (Bitmap *dest, int dx, int dy,
                      Bitmap *src, int sx, int sy, int width, int height)
 {
-    int x, y;
+    int x1, x2, y, xbyte;
+
+    /* clip to the destination */
+    if (dx < 0)
+    {
+        width += dx;
+        sx -= dx;
+        dx = 0;
+    }
+
+    if (dy < 0)
+    {
+        height += dy;
+        sy -= dy;
+        dy = 0;
+    }
+
+    if ((dx + width) > dest->width)
+    {
+        width = dest->width - dx;
+    }
+
+    if ((dy + height) > dest->height)
+    {
+        height = dest->height - dy;
+    }
+
+    if ((width <= 0) || (height <= 0))
+    {
+        return;
+    }
+
+    x1 = dx;
+    x2 = dx + width; /* exclusive */
 
     for (y = 0; y < height; y++)
     {
-        for (x = 0; x < width; x++)
+        unsigned char *row = dest->buf + dest->widthBytes * (y + dy);
+
+        for (xbyte = x1 >> 3; xbyte <= ((x2 - 1) >> 3); xbyte++)
         {
-            bitmapSet (dest, x + dx, y + dy, bitmapGet (src, x + sx, y + sy));
+            /* the destination bits of this byte that are in the rect */
+            int lo = (xbyte == (x1 >> 3)) ? (x1 & 0x7) : 0;
+            int hi = (xbyte == ((x2 - 1) >> 3)) ? (((x2 - 1) & 0x7) + 1) : 8;
+            int mask = (0xff >> (8 - (hi - lo))) << lo;
+            int bits = bitmapGetRowBits (src, y + sy, xbyte * 8 - dx + sx);
+
+            row[xbyte] = (row[xbyte] & ~mask) | (bits & mask);
         }
     }
 }
@@ -195,11 +1059,13 @@ void bitmapVlin (Bitmap *b, int x, int y1, int y2)
     }
 }
 
-/* print out the given bitmap as an XBM format image */
-void bitmapPrintXBM (Bitmap *b, const char *comment, const char *name,
-                     int httpHeader)
+/* write the given bitmap as an XBM format image to the given buffer */
+void bitmapWriteXbm (Buffer *out, Bitmap *b, const char *comment,
+                     const char *name)
 {
+    static const char hexDigits[] = "0123456789abcdef";
     int xbyte, y, col, spac;
+    char *o;
 
     /* do not edit; some XBM renderers are picky about this */
     static char spacingTable[] = {
@@ -208,32 +1074,45 @@ void bitmapPrintXBM (Bitmap *b, const char *comment, const char *name,
     };
     static int spacingLen = sizeof (spacingTable) / sizeof (char) * 4;
 
-    if (httpHeader)
-    {
-        printf ("Content-Type: image/x-xbitmap\n"
-                "Cache-Control: max-age=3600\n"
-                "\n");
-    }
+    bufferPrintf (out,
+                  "#define %s_width %d\n"
+                  "#define %s_height %d\n"
+                  "static char %s_bits[] = {\n",
+                  name, b->width, name, b->height, name);
 
-    printf ("#define %s_width %d\n"
-            "#define %s_height %d\n"
-            "static char %s_bits[] = {\n",
-            name, b->width, name, b->height, name);
+    /* each byte is 6 characters, plus an indent and a newline per 10 */
+    bufferReserve (out, b->widthBytes * b->height * 7 + 5);
+    o = out->buf + out->length;
 
     col = 10;
     spac = 0;
     for (y = 0; y < b->height; y++)
     {
+        unsigned char *row = b->buf + y * b->widthBytes;
+
         for (xbyte = 0; xbyte < b->widthBytes; xbyte++)
         {
             if (col == 10)
             {
-                printf ("   ");
+                memcpy (o, "   ", 3);
+                o += 3;
                 col = 0;
             }
-            printf ("0x%02x%s", bitmapGetByte (b, xbyte, y),
-                    (spacingTable[spac >> 2] & (1 << (spac & 0x3))) ?
-                    " ," : ", ");
+            o[0] = '0';
+            o[1] = 'x';
+            o[2] = hexDigits[row[xbyte] >> 4];
+            o[3] = hexDigits[row[xbyte] & 0xf];
+            if (spacingTable[spac >> 2] & (1 << (spac & 0x3)))
+            {
+                o[4] = ' ';
+                o[5] = ',';
+            }
+            else
+            {
+                o[4] = ',';
+                o[5] = ' ';
+            }
+            o += 6;
             spac++;
             if (spac == spacingLen)
             {
@@ -242,22 +1121,189 @@ void bitmapPrintXBM (Bitmap *b, const char *comment, const char *name,
             col++;
             if (col == 10)
             {
-                printf ("\n");
+                *o = '\n';
+                o++;
             }
         }
     }
-    printf ("};\n"
-            "/* %s */\n",
-            comment);
+
+    out->length = o - out->buf;
+    bufferPrintf (out,
+                  "};\n"
+                  "/* %s */\n",
+                  comment);
+}
+
+/* return the length of the text that bitmapWriteXbm() writes for a bitmap
+ * of the given size, without needing the bitmap */
+int xbmLength (int width, int height, const char *comment, const char *name)
+{
+    int bytes = ((width + 7) >> 3) * height;
+
+    return snprintf (NULL, 0,
+                     "#define %s_width %d\n"
+                     "#define %s_height %d\n"
+                     "static char %s_bits[] = {\n",
+                     name, width, name, height, name)
+        + bytes * 6 + (bytes + 9) / 10 * 3 + bytes / 10
+        + snprintf (NULL, 0,
+                    "};\n"
+                    "/* %s */\n",
+                    comment);
+}
+
+/* set up the given response to be the given bitmap as an XBM format
+ * image */
+void bitmapXbmResponse (Response *r, Bitmap *b, const char *comment,
+                        const char *name)
+{
+    r->header = HEADER_XBM;
+    r->imageWidth = b->width;
+    r->imageHeight = b->height;
+    bitmapWriteXbm (&r->body, b, comment, name);
 }
 
 
 
 /* ----------------------------------------------------------------------------
- * character generation
+ * compositing
  */
 
-static unsigned char font5x8Buf[] =
+/* a rectangle within a bitmap */
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+}
+Rect;
+
+/* an entry used when sorting bitmaps for packing */
+typedef struct
+{
+    int height;
+    int index;
+}
+PackEntry;
+
+/* qsort() comparator which orders pack entries tallest first, keeping the
+ * original order among equal heights */
+int comparePackEntries (const void *a, const void *b)
+{
+    const PackEntry *pa = a;
+    const PackEntry *pb = b;
+
+    if (pa->height != pb->height)
+    {
+        return pb->height - pa->height;
+    }
+
+    return pa->index - pb->index;
+}
+
+/* pack the given bitmaps into a new bitmap (a sprite sheet), storing the
+ * rectangle each one ended up at in the corresponding element of rects;
+ * this uses a simple shelf packer: bitmaps are placed tallest first, left
+ * to right along horizontal shelves, starting a new shelf whenever one
+ * would get wider than maxWidth; passing maxWidth as 0 picks a width that
+ * makes the sheet roughly square; there are padding pixels between the
+ * bitmaps */
+Bitmap *bitmapComposite (Bitmap **bitmaps, int count, int maxWidth,
+                         int padding, Rect *rects)
+{
+    PackEntry *order = malloc (count * sizeof (PackEntry));
+    Bitmap *result;
+    int shelfX = 0;
+    int shelfY = 0;
+    int shelfHeight = 0;
+    int width = 0;
+    int height = 0;
+    int widest = 0;
+    long area = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        int w = bitmaps[i]->width + padding;
+        order[i].height = bitmaps[i]->height;
+        order[i].index = i;
+        area += (long) w * (bitmaps[i]->height + padding);
+        if (w > widest)
+        {
+            widest = w;
+        }
+    }
+
+    if (maxWidth <= 0)
+    {
+        /* a square of the total area, but no narrower than the widest */
+        maxWidth = 1;
+        while (((long) maxWidth * maxWidth) < area)
+        {
+            maxWidth++;
+        }
+    }
+
+    if (maxWidth < widest)
+    {
+        maxWidth = widest;
+    }
+
+    qsort (order, count, sizeof (PackEntry), comparePackEntries);
+
+    for (i = 0; i < count; i++)
+    {
+        Bitmap *b = bitmaps[order[i].index];
+        Rect *r = &rects[order[i].index];
+
+        if ((shelfX + b->width) > maxWidth)
+        {
+            /* start a new shelf */
+            shelfY += shelfHeight + padding;
+            shelfX = 0;
+            shelfHeight = 0;
+        }
+
+        r->x = shelfX;
+        r->y = shelfY;
+        r->width = b->width;
+        r->height = b->height;
+
+        shelfX += b->width + padding;
+        if (b->height > shelfHeight)
+        {
+            shelfHeight = b->height;
+        }
+        if ((r->x + r->width) > width)
+        {
+            width = r->x + r->width;
+        }
+        if ((r->y + r->height) > height)
+        {
+            height = r->y + r->height;
+        }
+    }
+
+    free (order);
+
+    result = makeBitmap (width, height);
+    for (i = 0; i < count; i++)
+    {
+        bitmapCopyRect (result, rects[i].x, rects[i].y,
+                        bitmaps[i], 0, 0, rects[i].width, rects[i].height);
+    }
+
+    return result;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * character generation
+ */
+
+static unsigned char font5x8Buf[] =
 {
    0x1e, 0x01, 0x06, 0x01, 0x1e, 0x00, 0x1e, 0x01, 0x06, 0x01, 0x1e, 0x00,
    0x1e, 0x01, 0x1e, 0x01, 0x1e, 0x00, 0x01, 0x00, 0x1f, 0x08, 0x04, 0x08,
@@ -388,10 +1434,16 @@ void bitmapDrawString5x8 (Bitmap *b, int x, int y, char *str)
  * simple text renderer
  */
 
-/* create and print an XBM image containing the given text string */
-void textToXbm (char *str, int httpHeader)
+/* the comments placed in the two kinds of generated images */
+static char *textComment =
+    "milk.com text image; http://www.milk.com/barcode/";
+static char *barcodeComment =
+    "the milk.com barcode generator; http://www.milk.com/barcode/";
+
+/* compute the size of the bitmap that textToBitmap() would make for the
+ * given text string */
+void textMeasure (char *str, int *width, int *height)
 {
-    Bitmap *b;
     int maxWidth = 0;
     int oneWidth = 0;
     int lineCount = 1;
@@ -420,10 +1472,30 @@ void textToXbm (char *str, int httpHeader)
         maxWidth = oneWidth;
     }
 
-    b = makeBitmap (maxWidth * 5 + 4, lineCount * 8 + 4);
+    *width = maxWidth * 5 + 4;
+    *height = lineCount * 8 + 4;
+}
+
+/* create and return a bitmap containing the given text string */
+Bitmap *textToBitmap (char *str)
+{
+    Bitmap *b;
+    int width;
+    int height;
+
+    textMeasure (str, &width, &height);
+    b = makeBitmap (width, height);
     bitmapDrawString5x8 (b, 2, 2, str);
-    bitmapPrintXBM (b, "milk.com text image; http://www.milk.com/barcode/",
-                    "milk_text", httpHeader);
+    return b;
+}
+
+/* set up the given response to be an XBM image containing the given text
+ * string */
+void textResponse (Response *r, char *str)
+{
+    Bitmap *b = textToBitmap (str);
+
+    bitmapXbmResponse (r, b, textComment, "milk_text");
     bitmapFree (b);
 }
 
@@ -510,7 +1582,7 @@ char *wordsToPonder[] =
 
 /* generate an image of some words to ponder; this is used instead of
  * generating a barcode when a required password is missing or incorrect */
-void wordsToPonderXbm (int httpHeader)
+void wordsToPonderResponse (Response *r)
 {
     int choice = time (NULL) % (sizeof (wordsToPonder) / sizeof (char *));
     char buf[1000];
@@ -525,7 +1597,174 @@ void wordsToPonderXbm (int httpHeader)
     strcat (buf,
             "\nBrought to you by:\nwww.milk.com");
 
-    textToXbm (buf, httpHeader);
+    textResponse (r, buf);
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * errors
+ */
+
+/* the kinds of errors that can be reported instead of an image */
+typedef enum
+{
+    ERROR_NONE,
+    ERROR_SUPPLEMENT_LENGTH, ERROR_SEVEN_DIGITS, ERROR_UPCE_FIRST_DIGIT,
+    ERROR_EIGHT_DIGITS, ERROR_UPCE_UNCOMPRESSIBLE, ERROR_TWELVE_DIGITS,
+    ERROR_THIRTEEN_DIGITS, ERROR_DIGIT_COUNT,
+    ERROR_BOOK_NUMBER, ERROR_BOOK_CHECK, ERROR_BOOK_PRICE,
+    ERROR_NOT_BARCODE, ERROR_BAD_REQUEST, ERROR_PASSWORD, ERROR_VERIFY
+}
+ErrorCode;
+
+/* information about one kind of error */
+typedef struct
+{
+    const char *code;    /* short machine-readable name */
+    HeaderId header;     /* header block of a JSON response */
+    char *message;       /* human-readable explanation */
+}
+ErrorInfo;
+
+/* information about all the kinds of errors, indexed by ErrorCode */
+static ErrorInfo errorTable[] =
+{
+    [ERROR_NONE] =
+    {
+        "none", HEADER_JSON, ""
+    },
+    [ERROR_SUPPLEMENT_LENGTH] =
+    {
+        "supplement-length", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "supplements may only be 2 or 5 digits."
+    },
+    [ERROR_SEVEN_DIGITS] =
+    {
+        "seven-digits", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "Passing 7 digits is only possible for\n"
+        "UPC-E barcodes."
+    },
+    [ERROR_UPCE_FIRST_DIGIT] =
+    {
+        "upce-first-digit", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "UPC-E barcodes must start with the\n"
+        "digit 0 or 1."
+    },
+    [ERROR_EIGHT_DIGITS] =
+    {
+        "eight-digits", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "Passing 8 digits is only possible for\n"
+        "EAN-8 and UPC-E barcodes."
+    },
+    [ERROR_UPCE_UNCOMPRESSIBLE] =
+    {
+        "upce-uncompressible", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "In order to fit into a UPC-E barcode,\n"
+        "the original number must meet several\n"
+        "restrictions."
+    },
+    [ERROR_TWELVE_DIGITS] =
+    {
+        "twelve-digits", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "Passing 12 digits is only possible for\n"
+        "UPC-A and UPC-E barcodes."
+    },
+    [ERROR_THIRTEEN_DIGITS] =
+    {
+        "thirteen-digits", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "Passing 13 digits is only possible for\n"
+        "EAN-13 barcodes."
+    },
+    [ERROR_DIGIT_COUNT] =
+    {
+        "digit-count", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "You must supply 7, 8, 12, or 13 digits\n"
+        "for the primary UPC/EAN number to encode."
+    },
+    [ERROR_BOOK_NUMBER] =
+    {
+        "book-number", HEADER_JSON_400,
+        "The entered number is not supported;\n"
+        "book numbers must be an ISBN of 10 or\n"
+        "13 digits, an 8-digit ISSN, or an ISMN."
+    },
+    [ERROR_BOOK_CHECK] =
+    {
+        "book-check", HEADER_JSON_400,
+        "The entered number is not valid;\n"
+        "its check digit is wrong."
+    },
+    [ERROR_BOOK_PRICE] =
+    {
+        "book-price", HEADER_JSON_400,
+        "The entered price is not supported;\n"
+        "prices must be written like $12.95."
+    },
+    [ERROR_NOT_BARCODE] =
+    {
+        "not-barcode", HEADER_JSON_400,
+        "Only barcodes can be output\n"
+        "as modules."
+    },
+    [ERROR_BAD_REQUEST] =
+    {
+        "bad-request", HEADER_JSON_400,
+        "The request is malformed;\n"
+        "it has a bad escape or bad JSON, or\n"
+        "too many fields or values."
+    },
+    [ERROR_PASSWORD] =
+    {
+        "bad-password", HEADER_JSON_403,
+        "Password incorrect\n"
+        "or too old."
+    },
+    [ERROR_VERIFY] =
+    {
+        "verify-failed", HEADER_JSON_500,
+        "The rendered barcode didn't\n"
+        "decode back to its number."
+    }
+};
+
+/* append a JSON object describing the given error to the given buffer; the
+ * message is put on one line */
+void bufferAppendJsonError (Buffer *out, ErrorCode error)
+{
+    char message[200];
+    char *p;
+
+    strcpy (message, errorTable[error].message);
+    for (p = message; *p != '\0'; p++)
+    {
+        if (*p == '\n')
+        {
+            *p = ' ';
+        }
+    }
+
+    bufferAppendString (out, "{\"error\":{\"code\":");
+    bufferAppendJsonString (out, errorTable[error].code);
+    bufferAppendString (out, ",\"message\":");
+    bufferAppendJsonString (out, message);
+    bufferAppendString (out, "}}");
+}
+
+/* set up the given response to report the given error as JSON */
+void jsonErrorResponse (Response *r, ErrorCode error)
+{
+    r->header = errorTable[error].header;
+    bufferAppendJsonError (&r->body, error);
+    bufferAppendString (&r->body, "\n");
 }
 
 
@@ -669,6 +1908,33 @@ void wordsToPonderXbm (int httpHeader)
  * UPC-E final digit 0 table for the corresponding digit.
  */
 
+/* the supported UPC/EAN symbologies */
+typedef enum
+{
+    SYMBOL_UPCA, SYMBOL_UPCE, SYMBOL_EAN13, SYMBOL_EAN8
+}
+Symbology;
+
+/* the size of the image of each symbology, in its full-height and short
+ * forms, before adding room for a banner or supplement; the full-height
+ * UPC-A and UPC-E forms have a right-hand margin (holding the check digit)
+ * that a supplement may overlap */
+typedef struct
+{
+    int width;
+    int height;
+    int margin;
+}
+UpcEanSize;
+
+static UpcEanSize upcEanSizes[][2] =
+{
+    [SYMBOL_UPCA]  = { { 107, 60, 6 }, { 95, 40, 0 } },
+    [SYMBOL_UPCE]  = { { 63,  60, 6 }, { 51, 40, 0 } },
+    [SYMBOL_EAN13] = { { 101, 60, 0 }, { 95, 40, 0 } },
+    [SYMBOL_EAN8]  = { { 67,  60, 0 }, { 67, 40, 0 } }
+};
+
 /* enum to indicate which pattern set to use */
 typedef enum
 {
@@ -716,6 +1982,78 @@ int charToDigit (char c)
     }
 }
 
+/* return the 7-module pattern for the given digit character in the given
+ * pattern set, with the leftmost module in bit 6 */
+unsigned int upcEanDigitBits (char n, UpcSet set)
+{
+    unsigned char digit = (unsigned char) charToDigit (n);
+
+    switch (set)
+    {
+        case UPC_LEFT_A: return upcLeftA[digit];
+        case UPC_LEFT_B: return upcLeftB[digit];
+        default:         return upcRight[digit];
+    }
+}
+
+/* calculate and return the check digit character for the given count of
+ * digits; once aligned on the right, all the UPC/EAN symbologies weight
+ * the digits the same way, with the one just before the check digit (and
+ * every other one to the left of it) multiplied by 3 */
+char upcEanCheckDigit (char *digits, int count)
+{
+    unsigned int mul = (count & 1) ? 3 : 1;
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        sum += charToDigit (digits[i]) * mul;
+        mul ^= 2;
+    }
+
+    return ((10 - (sum % 10)) % 10) + '0';
+}
+
+/* return the parity pattern for the given 2- or 5-digit supplemental code,
+ * with the first digit in the highest bit; a set bit means Left-B */
+int upcEanSupplementParity (char *digits)
+{
+    switch (strlen (digits))
+    {
+        case 2:
+        {
+            return (charToDigit (digits[0]) * 10 +
+                    charToDigit (digits[1])) & 0x3;
+        }
+        case 5:
+        {
+            int parity =
+                ((charToDigit (digits[0]) + charToDigit (digits[2]) +
+                  charToDigit (digits[4])) * 3
+                 + (charToDigit (digits[1]) + charToDigit (digits[3])) * 9)
+                % 10;
+            return upcELastDigit[parity];
+        }
+        default:
+        {
+            return 0;
+        }
+    }
+}
+
+/* compute the size of the image of the given symbology and form, given
+ * the height of the banner (y) and the width of the supplement */
+void upcEanMeasure (Symbology symbology, int shortForm, int y,
+                    int extraWidth, int *width, int *height)
+{
+    UpcEanSize *size = &upcEanSizes[symbology][shortForm != 0];
+
+    *width = size->width +
+        ((extraWidth <= size->margin) ? 0 : (extraWidth - size->margin));
+    *height = size->height + y;
+}
+
 /* draw the given digit character at the given coordinates; a '0' is
  * used in place of any non-digit character */
 void drawDigitChar (Bitmap *b, int x, int y, char c)
@@ -732,17 +2070,9 @@ void drawDigitChar (Bitmap *b, int x, int y, char c)
 void drawUpcEanDigit (Bitmap *upcBitmap, int x, int y1, int y2, char n,
                       UpcSet set)
 {
-    unsigned int bits;
+    unsigned int bits = upcEanDigitBits (n, set);
     int i;
 
-    n = charToDigit (n);
-    switch (set)
-    {
-        case UPC_LEFT_A: bits = upcLeftA[n]; break;
-        case UPC_LEFT_B: bits = upcLeftB[n]; break;
-        case UPC_RIGHT:  bits = upcRight[n]; break;
-    }
-
     for (i = 6; i >=0; i--)
     {
         if (bits & (1 << i))
@@ -770,10 +2100,10 @@ void drawUpcEanSupplementalBars (Bitmap *upcBitmap, char *digits,
                                  int x, int y, int y2, int textAbove)
 {
     int len = strlen (digits);
+    int parity = upcEanSupplementParity (digits);
     int i;
-    int parity;
     int textY;
-    int textX;
+    int textX = x;
 
     if (textAbove)
     {
@@ -790,29 +2120,8 @@ void drawUpcEanSupplementalBars (Bitmap *upcBitmap, char *digits,
 
     switch (len)
     {
-        case 2:
-        {
-            textX = x + 5;
-            parity = (charToDigit (digits[0]) * 10 +
-                      charToDigit (digits[1])) & 0x3;
-            break;
-        }
-        case 5:
-        {
-            textX = x + 10;
-            parity =
-                ((charToDigit (digits[0]) + charToDigit (digits[2]) +
-                  charToDigit (digits[4])) * 3
-                 + (charToDigit (digits[1]) + charToDigit (digits[3])) * 9)
-                % 10;
-            parity = upcELastDigit[parity];
-            break;
-        }
-        default:
-        {
-            parity = 0;
-            break;
-        }
+        case 2: textX = x + 5;  break;
+        case 5: textX = x + 10; break;
     }
 
     /* header */
@@ -882,15 +2191,14 @@ void drawUpcABars (Bitmap *upcBitmap, char *digits, int x, int y,
 /* make and return a full-height UPC-A barcode */
 Bitmap *makeUpcAFull (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 107;
-    static int baseHeight = 60;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth +
-                                 ((extraWidth <= 6) ? 0 : (extraWidth - 6)),
-                                 height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_UPCA, 0, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawUpcABars (result, digits, 6, y, height - 10, height - 4);
 
     drawDigitChar (result, 0, height - 14, digits[0]);
@@ -909,13 +2217,14 @@ Bitmap *makeUpcAFull (char *digits, int y, int extraWidth)
 /* make and return a short-height UPC-A barcode */
 Bitmap *makeUpcAShort (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 95;
-    static int baseHeight = 40;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth + extraWidth, height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_UPCA, 1, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawUpcABars (result, digits, 0, y, height - 9, height - 9);
 
     for (i = 0; i < 12; i++)
@@ -926,24 +2235,10 @@ Bitmap *makeUpcAShort (char *digits, int y, int extraWidth)
     return result;
 }
 
-/* make and return a UPC-A barcode */
+/* make and return a UPC-A barcode from 12 normalized digits (see
+ * upcEanParse()) */
 Bitmap *makeUpcA (char *digits, int shortForm, int y, int extraWidth)
 {
-    int i;
-    unsigned int mul = 3;
-    unsigned int sum = 0;
-
-    for (i = 0; i < 11; i++)
-    {
-        sum += charToDigit (digits[i]) * mul;
-        mul ^= 2;
-    }
-
-    if (digits[11] == '?')
-    {
-        digits[11] = ((10 - (sum % 10)) % 10) + '0';
-    }
-
     if (shortForm)
     {
         return makeUpcAShort (digits, y, extraWidth);
@@ -992,15 +2287,14 @@ void drawUpcEBars (Bitmap *upcBitmap, char *digits, int x, int y,
 /* make and return a full-height UPC-E barcode */
 Bitmap *makeUpcEFull (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 63;
-    static int baseHeight = 60;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth +
-                                 ((extraWidth <= 6) ? 0 : (extraWidth - 6)),
-                                 height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_UPCE, 0, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawUpcEBars (result, digits, 6, y, height - 10, height - 4);
 
     drawDigitChar (result, 0, height - 14, digits[0]);
@@ -1018,13 +2312,14 @@ Bitmap *makeUpcEFull (char *digits, int y, int extraWidth)
 /* make and return a short-height UPC-E barcode */
 Bitmap *makeUpcEShort (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 51;
-    static int baseHeight = 40;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth + extraWidth, height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_UPCE, 1, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawUpcEBars (result, digits, 0, y, height - 9, height - 9);
 
     for (i = 0; i < 8; i++)
@@ -1035,240 +2330,287 @@ Bitmap *makeUpcEShort (char *digits, int y, int extraWidth)
     return result;
 }
 
+/* the ways of compressing a UPC-A number into UPC-E, numbered as returned
+ * by upcECompressRule(), as the sources of the first 7 compressed digits;
+ * entries below 12 are indices into the UPC-A digits, and the others are
+ * literal digits (the 8th digit is always the check digit) */
+static const char upcECompressMaps[5][7] =
+{
+    { 0 },                              /* not compressible */
+    { 0, 1, 2, 3, 4, 5, 10 },           /* 5 digit manufacturer */
+    { 0, 1, 2, 3, 4, 10, '4' },         /* 4 digit manufacturer */
+    { 0, 1, 2, 3, 9, 10, '3' },         /* 3 digit manufacturer */
+    { 0, 1, 2, 8, 9, 10, 3 }            /* 2 digit, ending in 0-2 */
+};
+
+/* the ways of expanding a UPC-E number into UPC-A, indexed by its 7th
+ * digit, as the sources of the first 11 expanded digits; entries below 8
+ * are indices into the UPC-E digits, and the others are literal digits
+ * (the 12th digit is always the check digit) */
+static const char upcEExpandMaps[10][11] =
+{
+    { 0, 1, 2, 6, '0', '0', '0', '0', 3, 4, 5 },
+    { 0, 1, 2, 6, '0', '0', '0', '0', 3, 4, 5 },
+    { 0, 1, 2, 6, '0', '0', '0', '0', 3, 4, 5 },
+    { 0, 1, 2, 3, '0', '0', '0', '0', '0', 4, 5 },
+    { 0, 1, 2, 3, 4, '0', '0', '0', '0', '0', 5 },
+    { 0, 1, 2, 3, 4, 5, '0', '0', '0', '0', 6 },
+    { 0, 1, 2, 3, 4, 5, '0', '0', '0', '0', 6 },
+    { 0, 1, 2, 3, 4, 5, '0', '0', '0', '0', 6 },
+    { 0, 1, 2, 3, 4, 5, '0', '0', '0', '0', 6 },
+    { 0, 1, 2, 3, 4, 5, '0', '0', '0', '0', 6 }
+};
+
+/* classify how the 12 given UPC-A digits may be compressed into UPC-E,
+ * given the mask of which of the digits are '0' (bit n for digit n);
+ * returns an index into upcECompressMaps, 0 meaning it can't be; which
+ * way applies depends only on a handful of zeros and the values of digits
+ * 3 and 10, so this is all done with bit operations */
+static inline int upcECompressRule (const char *expanded, unsigned int zeros)
+{
+    unsigned int system = (unsigned char) (expanded[0] - '0') <= 1;
+    unsigned int small = (unsigned char) (expanded[3] - '0') <= 2;
+    unsigned int big = (expanded[10] >= '5');
+    unsigned int z4 = (zeros >> 4) & 1;
+    unsigned int z5 = (zeros >> 5) & 1;
+    unsigned int z67 = ((zeros >> 6) & 3) == 3;
+    unsigned int z678 = ((zeros >> 6) & 7) == 7;
+    unsigned int z6789 = ((zeros >> 6) & 15) == 15;
+
+    return system
+        * (((z5 ^ 1) & z6789 & big)
+           | ((z5 & (z4 ^ 1) & z6789) * 2)
+           | ((z5 & z4 & (small ^ 1) & z678) * 3)
+           | ((z5 & z4 & small & z67) * 4));
+}
+
 /* compress 12 digits into a UPC-E number, storing into the given result
  * array, or just store '\0' into the first element, if the form factor
  * is incorrect */
 void compressToUpcEDigits (char *expanded, char *compressed)
 {
+    const char *map;
+    unsigned int zeros = 0;
+    int rule;
     int i;
 
-    compressed[0] = '\0';
+    for (i = 4; i < 10; i++)
+    {
+        zeros |= (expanded[i] == '0') << i;
+    }
+
+    rule = upcECompressRule (expanded, zeros);
+    map = upcECompressMaps[rule];
+    for (i = 0; i < 7; i++)
+    {
+        compressed[i] = (map[i] < 12) ? expanded[(int) map[i]] : map[i];
+    }
+
+    compressed[0] = (rule == 0) ? '\0' : compressed[0];
     compressed[7] = expanded[11];
     compressed[8] = '\0';
+}
+
+/* expand 8 UPC-E digits into a UPC-A number, storing into the given result
+ * array, or just store '\0' into the first element, if the form factor
+ * is incorrect; this will also calculate the check digit, if it is
+ * specified as '?' */
+void expandToUpcADigits (char *compressed, char *expanded)
+{
+    unsigned int last = (unsigned char) (compressed[6] - '0');
+    const char *map;
+    int i;
 
-    if ((expanded[0] != '0') && (expanded[0] != '1'))
+    if ((compressed[0] != '0') && (compressed[0] != '1'))
     {
         return;
     }
 
-    if (expanded[5] != '0')
+    /* anything other than a digit is treated like a 9 */
+    map = upcEExpandMaps[(last <= 9) ? last : 9];
+    for (i = 0; i < 11; i++)
     {
-        if ((expanded[6] != '0')
-            || (expanded[7] != '0')
-            || (expanded[8] != '0')
-            || (expanded[9] != '0')
-            || (expanded[10] < '5'))
-        {
-            return;
-        }
-
-        compressed[0] = expanded[0];
-        compressed[1] = expanded[1];
-        compressed[2] = expanded[2];
-        compressed[3] = expanded[3];
-        compressed[4] = expanded[4];
-        compressed[5] = expanded[5];
-        compressed[6] = expanded[10];
-        return;
+        expanded[i] = (map[i] < 8) ? compressed[(int) map[i]] : map[i];
     }
+    expanded[11] = compressed[7];
 
-    if (expanded[4] != '0')
+    if (expanded[11] == '?')
     {
-        if ((expanded[6] != '0')
-            || (expanded[7] != '0')
-            || (expanded[8] != '0')
-            || (expanded[9] != '0'))
-        {
-            return;
-        }
+        expanded[11] = upcEanCheckDigit (expanded, 11);
+    }
+}
 
-        compressed[0] = expanded[0];
-        compressed[1] = expanded[1];
-        compressed[2] = expanded[2];
-        compressed[3] = expanded[3];
-        compressed[4] = expanded[4];
-        compressed[5] = expanded[10];
-        compressed[6] = '4';
-        return;
+/* the forms in which a GTIN (see gtinNormalize()) may be encoded, as bits
+ * of a mask: one per symbology, plus one for having a correct check
+ * digit */
+#define GTIN_FORM(symbology) (1 << (symbology))
+#define GTIN_CHECK_OK (1 << 4)
+
+/* the symbologies a GTIN may be encoded in (leaving aside UPC-E, which
+ * has further restrictions), indexed by its count of leading zeros: EAN-13
+ * needs at least one, UPC-A two, and EAN-8 six */
+static const unsigned char gtinZeroForms[15] =
+{
+    [0]       = 0,
+    [1]       = GTIN_FORM (SYMBOL_EAN13),
+    [2 ... 5] = GTIN_FORM (SYMBOL_EAN13) | GTIN_FORM (SYMBOL_UPCA),
+    [6 ... 14] =
+        GTIN_FORM (SYMBOL_EAN13) | GTIN_FORM (SYMBOL_UPCA)
+        | GTIN_FORM (SYMBOL_EAN8)
+};
+
+/* the number of '0's that pad a GTIN of each length out to 14 digits, or
+ * -1 for lengths that GTINs don't come in */
+static const signed char gtinPadding[15] =
+{
+    -1, -1, -1, -1, -1, -1, -1, -1, 6, -1, -1, -1, 2, 1, 0
+};
+
+/* the number of digits printed under each symbology */
+static const int symbologyDigits[] =
+{
+    [SYMBOL_UPCA] = 12, [SYMBOL_UPCE] = 8, [SYMBOL_EAN13] = 13,
+    [SYMBOL_EAN8] = 8
+};
+
+/* return the mask of forms that the given canonical GTIN (see
+ * gtinNormalize()) can take */
+int gtinForms (char *gtin)
+{
+    unsigned int zeros;  /* bit n set if gtin[n] is '0' */
+    unsigned int digits; /* bit n set if gtin[n] is a digit */
+    int forms;
+
+#ifdef __SSE2__
+    __m128i chunk = _mm_loadu_si128 ((__m128i *) gtin);
+    __m128i values = _mm_sub_epi8 (chunk, _mm_set1_epi8 ('0'));
+    __m128i nine = _mm_set1_epi8 (9);
+
+    zeros = _mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('0')));
+    digits = _mm_movemask_epi8 (
+        _mm_cmpeq_epi8 (_mm_max_epu8 (values, nine), nine));
+#else
+    int i;
+
+    zeros = 0;
+    digits = 0;
+    for (i = 0; i < 14; i++)
+    {
+        zeros |= (gtin[i] == '0') << i;
+        digits |= ((unsigned char) (gtin[i] - '0') <= 9) << i;
     }
+#endif
 
-    if ((expanded[3] != '0')
-        && (expanded[3] != '1')
-        && (expanded[3] != '2'))
+    /* the count of leading zeros is the count of trailing one bits */
+    forms = gtinZeroForms[__builtin_ctz (~zeros | (1 << 14))];
+
+    if (forms & GTIN_FORM (SYMBOL_UPCA))
     {
-        if ((expanded[6] != '0')
-            || (expanded[7] != '0')
-            || (expanded[8] != '0'))
-        {
-            return;
-        }
+        char compressed[9];
 
-        compressed[0] = expanded[0];
-        compressed[1] = expanded[1];
-        compressed[2] = expanded[2];
-        compressed[3] = expanded[3];
-        compressed[4] = expanded[9];
-        compressed[5] = expanded[10];
-        compressed[6] = '3';
-        return;
+        compressToUpcEDigits (gtin + 2, compressed);
+        forms |= (compressed[0] != '\0') ? GTIN_FORM (SYMBOL_UPCE) : 0;
     }
 
-    if ((expanded[6] != '0')
-        || (expanded[7] != '0'))
+    if (((digits & 0x3fff) == 0x3fff)
+        && (upcEanCheckDigit (gtin, 13) == gtin[13]))
     {
-        return;
+        forms |= GTIN_CHECK_OK;
     }
 
-    compressed[0] = expanded[0];
-    compressed[1] = expanded[1];
-    compressed[2] = expanded[2];
-    compressed[3] = expanded[8];
-    compressed[4] = expanded[9];
-    compressed[5] = expanded[10];
-    compressed[6] = expanded[3];
-    return;
+    return forms;
 }
 
-/* expand 8 UPC-E digits into a UPC-A number, storing into the given result
- * array, or just store '\0' into the first element, if the form factor
- * is incorrect; this will also calculate the check digit, if it is
- * specified as '?' */
-void expandToUpcADigits (char *compressed, char *expanded)
+/* normalize the given count of digits of a GTIN-8, -12, -13, or -14 (or,
+ * if upcE, of a compressed UPC-E number of 7 or 8 digits, with the
+ * leading 0 implied for 7) into its canonical 14-digit form, by padding
+ * it with leading zeros; the last digit may be given as '?', to have it
+ * calculated; the result is stored as a string into gtin, which must have
+ * room for 16 characters (so that it can be read as a vector); returns
+ * the mask of forms the GTIN can take (see gtinForms()), or 0 if the
+ * digits don't make a GTIN */
+int gtinNormalize (char *digits, int length, int upcE, char *gtin)
 {
-    int i;
-
-    if ((compressed[0] != '0') && (compressed[0] != '1'))
-    {
-        return;
-    }
+    char expanded[13];
+    int pad;
 
-    expanded[0] = compressed[0];
-    expanded[6] = '0';
-    expanded[7] = '0';
-    expanded[11] = compressed[7];
+    memset (gtin, '0', 14);
+    gtin[14] = '\0';
+    gtin[15] = '\0';
 
-    switch (compressed[6])
+    if (upcE)
     {
-        case '0':
-        case '1':
-        case '2':
-        {
-            expanded[1] = compressed[1];
-            expanded[2] = compressed[2];
-            expanded[3] = compressed[6];
-            expanded[4] = '0';
-            expanded[5] = '0';
-            expanded[8] = compressed[3];
-            expanded[9] = compressed[4];
-            expanded[10] = compressed[5];
-            break;
-        }
-        case '3':
-        {
-            expanded[1] = compressed[1];
-            expanded[2] = compressed[2];
-            expanded[3] = compressed[3];
-            expanded[4] = '0';
-            expanded[5] = '0';
-            expanded[8] = '0';
-            expanded[9] = compressed[4];
-            expanded[10] = compressed[5];
-            break;
-        }
-        case '4':
+        char compressed[9];
+
+        if ((length != 7) && (length != 8))
         {
-            expanded[1] = compressed[1];
-            expanded[2] = compressed[2];
-            expanded[3] = compressed[3];
-            expanded[4] = compressed[4];
-            expanded[5] = '0';
-            expanded[8] = '0';
-            expanded[9] = '0';
-            expanded[10] = compressed[5];
-            break;
+            return 0;
         }
-        default:
+
+        compressed[0] = '0';
+        memcpy (compressed + 8 - length, digits, length);
+        expanded[0] = '\0';
+        expandToUpcADigits (compressed, expanded);
+        if (expanded[0] == '\0')
         {
-            expanded[1] = compressed[1];
-            expanded[2] = compressed[2];
-            expanded[3] = compressed[3];
-            expanded[4] = compressed[4];
-            expanded[5] = compressed[5];
-            expanded[8] = '0';
-            expanded[9] = '0';
-            expanded[10] = compressed[6];
-            break;
+            return 0;
         }
+
+        digits = expanded;
+        length = 12;
     }
 
-    if (expanded[11] == '?')
+    pad = ((unsigned int) length <= 14) ? gtinPadding[length] : -1;
+    if (pad < 0)
     {
-        unsigned int mul = 3;
-        unsigned int sum = 0;
-
-        for (i = 0; i < 11; i++)
-        {
-            sum += charToDigit (expanded[i]) * mul;
-            mul ^= 2;
-        }
+        return 0;
+    }
 
-        expanded[11] = ((10 - (sum % 10)) % 10) + '0';
+    memcpy (gtin + pad, digits, length);
+    if (gtin[13] == '?')
+    {
+        gtin[13] = upcEanCheckDigit (gtin, 13);
     }
+
+    return gtinForms (gtin);
 }
 
-/* make and return a UPC-E barcode */
-Bitmap *makeUpcE (char *digits, int shortForm, int y, int extraWidth)
+/* convert the given canonical GTIN back into the digits printed under the
+ * given symbology (UPC-E numbers being in compressed form), stored as a
+ * string into digits; returns 0 (storing "") if it can't take that form */
+int gtinDenormalize (char *gtin, Symbology symbology, char *digits)
 {
-    char expandedDigits[13];
-    char compressedDigits[9];
-
-    expandedDigits[0] = '\0';
-    compressedDigits[0] = '\0';
+    int count = symbologyDigits[symbology];
 
-    switch (strlen (digits))
+    digits[0] = '\0';
+    if (! (gtinForms (gtin) & GTIN_FORM (symbology)))
     {
-        case 7:
-        {
-            compressedDigits[0] = '0';
-            strcpy (compressedDigits + 1, digits);
-            break;
-        }
-        case 8:
-        {
-            strcpy (compressedDigits, digits);
-            break;
-        }
-        case 12:
-        {
-            strcpy (expandedDigits, digits);
-            compressToUpcEDigits (expandedDigits, compressedDigits);
-            if (compressedDigits[0] == '\0')
-            {
-                return NULL;
-            }
-            break;
-        }
-        default:
-        {
-            return NULL;
-        }
+        return 0;
     }
 
-    expandToUpcADigits (compressedDigits, expandedDigits);
-    if (expandedDigits[0] == '\0')
+    if (symbology == SYMBOL_UPCE)
     {
-        return NULL;
+        compressToUpcEDigits (gtin + 2, digits);
+    }
+    else
+    {
+        memcpy (digits, gtin + 14 - count, count + 1);
     }
 
-    compressedDigits[7] = expandedDigits[11];
+    return 1;
+}
 
+/* make and return a UPC-E barcode from 8 normalized digits (see
+ * upcEanParse()) */
+Bitmap *makeUpcE (char *digits, int shortForm, int y, int extraWidth)
+{
     if (shortForm)
     {
-        return makeUpcEShort (compressedDigits, y, extraWidth);
+        return makeUpcEShort (digits, y, extraWidth);
     }
     else
     {
-        return makeUpcEFull (compressedDigits, y, extraWidth);
+        return makeUpcEFull (digits, y, extraWidth);
     }
 }
 
@@ -1313,13 +2655,14 @@ void drawEan13Bars (Bitmap *upcBitmap, char *digits, int x, int y,
 /* make and return a full-height EAN-13 barcode */
 Bitmap *makeEan13Full (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 101;
-    static int baseHeight = 60;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth + extraWidth, height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_EAN13, 0, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawEan13Bars (result, digits, 6, y, height - 10, height - 4);
 
     drawDigitChar (result, 0, height - 7, digits[0]);
@@ -1336,13 +2679,14 @@ Bitmap *makeEan13Full (char *digits, int y, int extraWidth)
 /* make and return a short-height EAN-13 barcode */
 Bitmap *makeEan13Short (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 95;
-    static int baseHeight = 40;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth + extraWidth, height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_EAN13, 1, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawEan13Bars (result, digits, 0, y, height - 9, height - 9);
 
     for (i = 0; i < 13; i++)
@@ -1353,24 +2697,10 @@ Bitmap *makeEan13Short (char *digits, int y, int extraWidth)
     return result;
 }
 
-/* make and return an EAN-13 barcode */
+/* make and return an EAN-13 barcode from 13 normalized digits (see
+ * upcEanParse()) */
 Bitmap *makeEan13 (char *digits, int shortForm, int y, int extraWidth)
 {
-    int i;
-    unsigned int mul = 1;
-    unsigned int sum = 0;
-
-    for (i = 0; i < 12; i++)
-    {
-        sum += charToDigit (digits[i]) * mul;
-        mul ^= 2;
-    }
-
-    if (digits[12] == '?')
-    {
-        digits[12] = ((10 - (sum % 10)) % 10) + '0';
-    }
-
     if (shortForm)
     {
         return makeEan13Short (digits, y, extraWidth);
@@ -1421,13 +2751,14 @@ void drawEan8Bars (Bitmap *upcBitmap, char *digits, int x, int y,
 /* make and return a full-height EAN-8 barcode */
 Bitmap *makeEan8Full (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 67;
-    static int baseHeight = 60;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth + extraWidth, height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_EAN8, 0, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawEan8Bars (result, digits, 0, y, height - 10, height - 4);
 
     for (i = 0; i < 4; i++)
@@ -1442,13 +2773,14 @@ Bitmap *makeEan8Full (char *digits, int y, int extraWidth)
 /* make and return a short-height EAN-8 barcode */
 Bitmap *makeEan8Short (char *digits, int y, int extraWidth)
 {
-    static int baseWidth = 67;
-    static int baseHeight = 40;
-
-    int height = baseHeight + y;
-    Bitmap *result = makeBitmap (baseWidth + extraWidth, height);
+    int width;
+    int height;
+    Bitmap *result;
     int i;
 
+    upcEanMeasure (SYMBOL_EAN8, 1, y, extraWidth, &width, &height);
+    result = makeBitmap (width, height);
+
     drawEan8Bars (result, digits, 0, y, height - 9, height - 9);
 
     for (i = 0; i < 8; i++)
@@ -1459,24 +2791,10 @@ Bitmap *makeEan8Short (char *digits, int y, int extraWidth)
     return result;
 }
 
-/* make and return an EAN-8 barcode */
+/* make and return an EAN-8 barcode from 8 normalized digits (see
+ * upcEanParse()) */
 Bitmap *makeEan8 (char *digits, int shortForm, int y, int extraWidth)
 {
-    int i;
-    unsigned int mul = 3;
-    unsigned int sum = 0;
-
-    for (i = 0; i < 7; i++)
-    {
-        sum += charToDigit (digits[i]) * mul;
-        mul ^= 2;
-    }
-
-    if (digits[7] == '?')
-    {
-        digits[7] = ((10 - (sum % 10)) % 10) + '0';
-    }
-
     if (shortForm)
     {
         return makeEan8Short (digits, y, extraWidth);
@@ -1487,22 +2805,109 @@ Bitmap *makeEan8 (char *digits, int shortForm, int y, int extraWidth)
     }
 }
 
-/* dispatch to the right form factor UPC/EAN barcode generator,
- * based on the number of digits present and/or requested; pass
- * explicitDigitCount as 0 if you want DWIM-type behavior */
-void processUpcEan (char *str, int explicitDigitCount, int shortForm,
-                    int httpHeader)
+/* a UPC/EAN number that has been parsed and normalized, ready to be
+ * encoded; the digits are exactly the ones that are printed under the
+ * barcode (so UPC-E numbers are in compressed form), with the check digit
+ * filled in */
+typedef struct
+{
+    Symbology symbology; /* which symbology to use */
+    char digits[16];     /* the main digits */
+    char gtin[16];       /* the canonical 14-digit form (see
+                          * gtinNormalize()) */
+    int forms;           /* mask of forms the GTIN can take */
+    char supDigits[8];   /* the supplemental digits, or "" if none */
+    char *banner;        /* the banner text, or NULL if none */
+    char bannerText[40]; /* storage for a banner made up by the parser */
+    int mcheck;          /* count of magic characters seen */
+}
+UpcEanCode;
+
+/* the kinds of numbers that upcEanParse() may be asked for, by the count
+ * of digits requested: 0 (anything), 6 (UPC-E), 8 (EAN-8), 12 (UPC-A or
+ * EAN-13), and anything else */
+typedef enum
+{
+    UPC_EAN_ANY, UPC_EAN_UPCE, UPC_EAN_EAN8, UPC_EAN_12, UPC_EAN_OTHER
+}
+UpcEanRequest;
+
+/* special choices of symbology, beyond the actual ones: none at all, and
+ * (for 8 digits) UPC-E if the first digit is 0 or EAN-8 if not */
+#define UPC_EAN_CHOOSE_NONE -1
+#define UPC_EAN_CHOOSE_8 -2
+
+/* how upcEanParse() treats a number of a given digit count, when asked
+ * for a given kind of number: the symbology chosen, and the error to
+ * report if that is UPC_EAN_CHOOSE_NONE or if the number can't be encoded
+ * in it */
+typedef struct
+{
+    int symbology;
+    ErrorCode error;
+}
+UpcEanChoice;
+
+/* the choice for a digit count that isn't supported at all */
+#define UPC_EAN_UNSUPPORTED { UPC_EAN_CHOOSE_NONE, ERROR_DIGIT_COUNT }
+
+/* the choices for each kind of request, indexed by digit count; counts
+ * not listed aren't supported at all */
+#define UPC_EAN_CHOICES(c7, e7, c8, e8, c12, e12, c13, e13)            \
+    {                                                                   \
+        [0 ... 6] = UPC_EAN_UNSUPPORTED,                                \
+        [7] = { c7, e7 }, [8] = { c8, e8 },                             \
+        [9 ... 11] = UPC_EAN_UNSUPPORTED,                               \
+        [12] = { c12, e12 }, [13] = { c13, e13 },                       \
+        [14 ... 15] = UPC_EAN_UNSUPPORTED                               \
+    }
+
+static const UpcEanChoice upcEanChoices[][16] =
+{
+    [UPC_EAN_ANY] = UPC_EAN_CHOICES (
+        SYMBOL_UPCE, ERROR_NONE,
+        UPC_EAN_CHOOSE_8, ERROR_UPCE_FIRST_DIGIT,
+        SYMBOL_UPCA, ERROR_NONE,
+        SYMBOL_EAN13, ERROR_NONE),
+    [UPC_EAN_UPCE] = UPC_EAN_CHOICES (
+        SYMBOL_UPCE, ERROR_NONE,
+        SYMBOL_UPCE, ERROR_UPCE_FIRST_DIGIT,
+        SYMBOL_UPCE, ERROR_UPCE_UNCOMPRESSIBLE,
+        UPC_EAN_CHOOSE_NONE, ERROR_THIRTEEN_DIGITS),
+    [UPC_EAN_EAN8] = UPC_EAN_CHOICES (
+        UPC_EAN_CHOOSE_NONE, ERROR_SEVEN_DIGITS,
+        SYMBOL_EAN8, ERROR_NONE,
+        UPC_EAN_CHOOSE_NONE, ERROR_TWELVE_DIGITS,
+        UPC_EAN_CHOOSE_NONE, ERROR_THIRTEEN_DIGITS),
+    [UPC_EAN_12] = UPC_EAN_CHOICES (
+        UPC_EAN_CHOOSE_NONE, ERROR_SEVEN_DIGITS,
+        UPC_EAN_CHOOSE_NONE, ERROR_EIGHT_DIGITS,
+        SYMBOL_UPCA, ERROR_NONE,
+        SYMBOL_EAN13, ERROR_NONE),
+    [UPC_EAN_OTHER] = UPC_EAN_CHOICES (
+        UPC_EAN_CHOOSE_NONE, ERROR_SEVEN_DIGITS,
+        UPC_EAN_CHOOSE_NONE, ERROR_EIGHT_DIGITS,
+        UPC_EAN_CHOOSE_NONE, ERROR_TWELVE_DIGITS,
+        UPC_EAN_CHOOSE_NONE, ERROR_THIRTEEN_DIGITS)
+};
+
+/* parse the given string into the given code struct, choosing the
+ * symbology based on the number of digits present and/or requested, and
+ * normalizing the digits; pass explicitDigitCount as 0 if you want
+ * DWIM-type behavior; if the number isn't supported, this returns 0 and
+ * stores the reason in *error */
+int upcEanParse (char *str, int explicitDigitCount, UpcEanCode *code,
+                 ErrorCode *error)
 {
+    const UpcEanChoice *choice;
     char digits[16];
     int digitCount = 0;
-    char supDigits[8];
     int supDigitCount = 0;
     char *instr = str;
     char *banner = NULL;
     int supplement = 0;
-    int mcheck = 0;
-    int vstart = 8;
-    Bitmap *barcode;
+
+    code->mcheck = 0;
 
     if (str == NULL)
     {
@@ -1517,7 +2922,7 @@ void processUpcEan (char *str, int explicitDigitCount, int shortForm,
         {
             if (supplement)
             {
-                supDigits[supDigitCount] = *instr;
+                code->supDigits[supDigitCount] = *instr;
                 supDigitCount++;
             }
             else
@@ -1541,7 +2946,7 @@ void processUpcEan (char *str, int explicitDigitCount, int shortForm,
         }
         else
         {
-            mcheck += ((c == 0x5b) && (instr == str)) |
+            code->mcheck += ((c == 0x5b) && (instr == str)) |
                 ((c == 0x4d) && (instr == (str + 1))) |
                 ((c == 0x5d) && (instr == (str + 2)));
         }
@@ -1549,22 +2954,13 @@ void processUpcEan (char *str, int explicitDigitCount, int shortForm,
     }
 
     digits[digitCount] = '\0';
-    supDigits[supDigitCount] = '\0';
+    code->supDigits[supDigitCount] = '\0';
+    PROBE3 (encode__digits, digitCount, supDigitCount, explicitDigitCount);
 
-    if (supDigitCount == 0)
-    {
-        supplement = 0;
-    }
-    else if ((supDigitCount == 2) || (supDigitCount == 5))
+    if ((supDigitCount != 0) && (supDigitCount != 2) && (supDigitCount != 5))
     {
-        supplement = upcEanSupplementWidth (supDigits);
-    }
-    else
-    {
-        textToXbm ("The entered number is not supported;\n"
-                   "supplements may only be 2 or 5 digits.",
-                   httpHeader);
-        return;
+        *error = ERROR_SUPPLEMENT_LENGTH;
+        return 0;
     }
 
     if (banner == NULL)
@@ -1574,113 +2970,90 @@ void processUpcEan (char *str, int explicitDigitCount, int shortForm,
     else if (*banner == '\0')
     {
         banner = NULL;
-        vstart = 0;
     }
-
-    switch (digitCount)
+    code->banner = banner;
+
+    choice = &upcEanChoices[(explicitDigitCount == 0) ? UPC_EAN_ANY
+                            : (explicitDigitCount == 6) ? UPC_EAN_UPCE
+                            : (explicitDigitCount == 8) ? UPC_EAN_EAN8
+                            : (explicitDigitCount == 12) ? UPC_EAN_12
+                            : UPC_EAN_OTHER][digitCount];
+    switch (choice->symbology)
     {
-        case 7:
+        case UPC_EAN_CHOOSE_NONE:
         {
-            if ((explicitDigitCount != 0) && (explicitDigitCount != 6))
-            {
-                textToXbm ("The entered number is not supported;\n"
-                           "Passing 7 digits is only possible for\n"
-                           "UPC-E barcodes.",
-                           httpHeader);
-                return;
-            }
-            barcode = makeUpcE (digits, shortForm, vstart, supplement);
+            *error = choice->error;
+            return 0;
+        }
+        case UPC_EAN_CHOOSE_8:
+        {
+            code->symbology = (digits[0] == '0') ? SYMBOL_UPCE : SYMBOL_EAN8;
             break;
         }
-        case 8:
+        default:
         {
-            if (explicitDigitCount == 0)
-            {
-                if (digits[0] == '0')
-                {
-                    barcode = makeUpcE (digits, shortForm, vstart, supplement);
-                }
-                else
-                {
-                    barcode = makeEan8 (digits, shortForm, vstart, supplement);
-                }
-            }
-            else if (explicitDigitCount == 6)
-            {
-                barcode = makeUpcE (digits, shortForm, vstart, supplement);
-                if (barcode == NULL)
-                {
-                    textToXbm ("The entered number is not supported;\n"
-                               "UPC-E barcodes must start with the\n"
-                               "digit 0 or 1.",
-                               httpHeader);
-                    return;
-                }
-            }
-            else if (explicitDigitCount == 8)
-            {
-                barcode = makeEan8 (digits, shortForm, vstart, supplement);
-            }
-            else
-            {
-                textToXbm ("The entered number is not supported;\n"
-                           "Passing 8 digits is only possible for\n"
-                           "EAN-8 and UPC-E barcodes.",
-                           httpHeader);
-                return;
-            }
+            code->symbology = choice->symbology;
+            break;
+        }
+    }
+
+    /* numbers given in UPC-E form are expanded, and all are padded out to
+     * 14 digits */
+    code->forms = gtinNormalize (digits, digitCount,
+                                 (code->symbology == SYMBOL_UPCE)
+                                 && (digitCount <= 8),
+                                 code->gtin);
+    if (! (code->forms & GTIN_FORM (code->symbology)))
+    {
+        *error = choice->error;
+        return 0;
+    }
+
+    if ((code->symbology == SYMBOL_UPCE) && (digitCount <= 8))
+    {
+        /* some numbers can be compressed more than one way, so the form
+         * given is kept, with just the check digit filled in */
+        code->digits[0] = '0';
+        memcpy (code->digits + 8 - digitCount, digits, digitCount);
+        code->digits[7] = code->gtin[13];
+        code->digits[8] = '\0';
+    }
+    else
+    {
+        gtinDenormalize (code->gtin, code->symbology, code->digits);
+    }
+
+    return 1;
+}
+
+/* make and return the bitmap for the given parsed code */
+Bitmap *upcEanCodeToBitmap (UpcEanCode *code, int shortForm)
+{
+    int supplement = upcEanSupplementWidth (code->supDigits);
+    int vstart = (code->banner == NULL) ? 0 : 8;
+    Bitmap *barcode;
+
+    switch (code->symbology)
+    {
+        case SYMBOL_UPCA:
+        {
+            barcode = makeUpcA (code->digits, shortForm, vstart, supplement);
             break;
         }
-        case 12:
+        case SYMBOL_UPCE:
         {
-            if ((explicitDigitCount == 0) || (explicitDigitCount == 12))
-            {
-                barcode = makeUpcA (digits, shortForm, vstart, supplement);
-            }
-            else if (explicitDigitCount == 6)
-            {
-                barcode = makeUpcE (digits, shortForm, vstart, supplement);
-                if (barcode == NULL)
-                {
-                    textToXbm ("The entered number is not supported;\n"
-                               "In order to fit into a UPC-E barcode,\n"
-                               "the original number must meet several\n"
-                               "restrictions.",
-                               httpHeader);
-                    return;
-                }
-            }
-            else
-            {
-                textToXbm ("The entered number is not supported;\n"
-                           "Passing 12 digits is only possible for\n"
-                           "UPC-A and UPC-E barcodes.",
-                           httpHeader);
-                return;
-            }
+            barcode = makeUpcE (code->digits, shortForm, vstart, supplement);
             break;
         }
-        case 13:
+        case SYMBOL_EAN13:
         {
-            if ((explicitDigitCount != 0)
-                && (explicitDigitCount != 12))
-            {
-                textToXbm ("The entered number is not supported;\n"
-                           "Passing 13 digits is only possible for\n"
-                           "EAN-13 barcodes.",
-                           httpHeader);
-                return;
-            }
-            barcode = makeEan13 (digits, shortForm, vstart, supplement);
+            barcode = makeEan13 (code->digits, shortForm, vstart, supplement);
             break;
         }
         default:
         {
-            textToXbm ("The entered number is not supported;\n"
-                       "You must supply 7, 8, 12, or 13 digits\n"
-                       "for the primary UPC/EAN number to encode.",
-                       httpHeader);
-            return;
+            barcode = makeEan8 (code->digits, shortForm, vstart, supplement);
+            break;
         }
     }
 
@@ -1688,520 +3061,9049 @@ void processUpcEan (char *str, int explicitDigitCount, int shortForm,
     {
         if (shortForm)
         {
-            drawUpcEanSupplementalBars (barcode, supDigits,
+            drawUpcEanSupplementalBars (barcode, code->supDigits,
                                         barcode->width - supplement,
                                         vstart, barcode->height - 1, 0);
         }
         else
         {
-            drawUpcEanSupplementalBars (barcode, supDigits,
+            drawUpcEanSupplementalBars (barcode, code->supDigits,
                                         barcode->width - supplement,
                                         vstart + 1, barcode->height - 4, 1);
         }
     }
 
-    if (banner != NULL)
+    if (code->banner != NULL)
     {
         bitmapDrawString5x8 (barcode,
                              (barcode->width + 1 -
-                              ((int) strlen (banner) * 5)) / 2,
+                              ((int) strlen (code->banner) * 5)) / 2,
                              0,
-                             banner);
+                             code->banner);
     }
 
-    if (mcheck == 3)
+    if (code->mcheck == 3)
     {
         bitmapCopyRect (barcode, barcode->width - 5, barcode->height - 56,
                         &font5x8, 0, 0, 5, 56);
     }
 
-    bitmapPrintXBM (barcode,
-                    "the milk.com barcode generator; "
-                    "http://www.milk.com/barcode/",
-                    "milk_barcode", httpHeader);
-
-    bitmapFree (barcode);
+    return barcode;
 }
 
-
-
-/* ----------------------------------------------------------------------------
- * xbm integrity checker
- */
-
-/* check the integrity of an XBM file; spits out check value and
- * auxiliary data. */
-void xbmIntegrity (int mask)
+/* make and return the bitmap for the given UPC/EAN string (see
+ * upcEanParse()); if the number isn't supported, this returns NULL (having
+ * rendered nothing) and stores the reason in *error */
+Bitmap *upcEanToBitmap (char *str, int explicitDigitCount, int shortForm,
+                        ErrorCode *error)
 {
-    char c;
-    char bits = 0;
-    int bitCount = 0;
-    int nextIsABit = 0;
-    int val = 0;
-    int trigger = (mask >> 8) & 0xff;
-
-    mask &= 0xff;
-
-    printf ("integrity check: ");
+    UpcEanCode code;
 
-    for (;;)
+    if (! upcEanParse (str, explicitDigitCount, &code, error))
     {
-        if ((fread (&c, 1, 1, stdin) == 0) || (c == 0x7d))
-        {
-            break;
-        }
-
-        if (c == trigger)
-        {
-            nextIsABit = 1;
-        }
-        else if (nextIsABit)
-        {
-            bits = ((bits >> 1) & 0x7f) + ((c == 0x20) ? 0 : 0x80);
-            bitCount++;
-            if (bitCount == 8)
-            {
-                if (bits == 0)
-                {
-                    break;
-                }
-
-                bits ^= mask;
-                val ^= bits;
-
-                if ((bits >= 0x20) && (bits <= 0x7e))
-                {
-                    fwrite (&bits, 1, 1, stdout);
-                }
-
-                bitCount = 0;
-                bits = 0;
-            }
-            nextIsABit = 0;
-        }
-        else
-        {
-            nextIsABit = 0;
-        }
+        return NULL;
     }
 
-    printf (" 0x%02x\n", (val & 0xff));
+    return upcEanCodeToBitmap (&code, shortForm);
 }
 
+/* compute the size of the bitmap that upcEanCodeToBitmap() would make for
+ * the given code, without making it */
+void upcEanCodeMeasure (UpcEanCode *code, int shortForm,
+                        int *width, int *height)
+{
+    upcEanMeasure (code->symbology, shortForm,
+                   (code->banner == NULL) ? 0 : 8,
+                   upcEanSupplementWidth (code->supDigits),
+                   width, height);
+}
 
+/* the widest possible main pattern (EAN-13/UPC-A), in modules */
+#define UPC_EAN_MAX_MODULES 95
 
-/* ----------------------------------------------------------------------------
- * password-checking stuff
- */
+/* the widest possible supplemental pattern (5 digits), in modules */
+#define UPC_EAN_MAX_SUPPLEMENT_MODULES 47
+
+/* the number of blank modules between a main pattern and its supplement,
+ * as drawn by upcEanToBitmap() */
+#define UPC_EAN_SUPPLEMENT_GAP 8
 
-/* return the password associated with the given time (granular to hours) */
-int passwordFor (time_t t)
+/* write the given pattern of modules (as '0' for space and '1' for bar),
+ * returning the position just after it */
+char *encodeModules (char *out, const char *pattern)
 {
-    int base = (t / 3600) & 0xffff;
-    char *s = password;
-    while (*s)
+    while (*pattern != '\0')
     {
-        base = ((base * 37) + *s) & 0xffff;
-        s++;
+        *out = *pattern;
+        out++;
+        pattern++;
     }
 
-    return base;
+    return out;
 }
 
-/* print out the password for the current time (called from main for
- * the --print-password option) */
-void printPassword (void)
+/* write the 7 modules of the given digit in the given pattern set,
+ * returning the position just after them */
+char *encodeUpcEanDigit (char *out, char n, UpcSet set)
 {
-    printf ("%d\n", passwordFor (time (NULL)));
-}
+    unsigned int bits = upcEanDigitBits (n, set);
+    int i;
 
-/* verify that the given password is valid; each password lasts for an
- * hour, and this checks the current and last 2 passwords, so each password
- * will work for a period of 3 hours */
-int verifyPassword (int pass)
-{
-    time_t now = time (NULL);
+    for (i = 6; i >= 0; i--)
+    {
+        *out = (bits & (1 << i)) ? '1' : '0';
+        out++;
+    }
 
-    return
-        (pass == passwordFor (now)) ||
-        (pass == passwordFor (now - 3600)) ||
-        (pass == passwordFor (now - 7200));
+    return out;
 }
 
-
-
-/* ----------------------------------------------------------------------------
- * HTTP form stuff
- */
-
-/* extract and unescape the string between the given pointers (not including
- * the character pointed to by the "to" pointer), into the given buffer;
- * if the string won't fit then it is truncated; the stored result is always
- * null-terminated; this returns NULL if there was a format problem. */
-char *formExtractString (char *from, char *to, char *buf, int bufSize)
+/* write the modules of the main part of the given code into the given
+ * string (which must have room for UPC_EAN_MAX_MODULES + 1 characters),
+ * exactly as upcEanToBitmap() would draw them, and return the count of
+ * modules written */
+int upcEanEncode (UpcEanCode *code, char *modules)
 {
-    char *out = buf;
+    char *digits = code->digits;
+    char *out = modules;
+    int leftPattern = 0;
+    int i;
 
-    while ((bufSize > 1) && (from < to))
+    switch (code->symbology)
     {
-        char c = *from;
-        from++;
-
-        if (c == '=')
-        {
-            break;
-        }
-        else if (c == '+')
+        case SYMBOL_EAN13:
         {
-            c = ' ';
+            leftPattern = ean13FirstDigit[charToDigit (digits[0])];
+            digits++;
         }
-        else if (c == '%')
+        /* fall through */
+        case SYMBOL_UPCA:
         {
-            char c1 = tolower (from[0]);
-            char c2 = tolower (from[1]);
-            from += 2;
-
-            if ((c1 >= '0') && (c1 <= '9'))
+            out = encodeModules (out, "101");
+            for (i = 0; i < 6; i++)
             {
-                c = (c1 - '0') << 4;
+                out = encodeUpcEanDigit (
+                    out, digits[i],
+                    (leftPattern & (1 << (5 - i))) ? UPC_LEFT_B : UPC_LEFT_A);
             }
-            else if ((c1 >= 'a') && (c1 <= 'f'))
+            out = encodeModules (out, "01010");
+            for (i = 6; i < 12; i++)
             {
-                c = (c1 - 'a' + 10) << 4;
+                out = encodeUpcEanDigit (out, digits[i], UPC_RIGHT);
             }
-            else
+            out = encodeModules (out, "101");
+            break;
+        }
+        case SYMBOL_UPCE:
+        {
+            int parityPattern = upcELastDigit[charToDigit (digits[7])];
+
+            if (digits[0] == '1')
             {
-                /* bad character in % sequence */
-                return NULL;
+                parityPattern = ~parityPattern;
             }
 
-            if ((c2 >= '0') && (c2 <= '9'))
+            out = encodeModules (out, "101");
+            for (i = 0; i < 6; i++)
             {
-                c += c2 - '0';
+                out = encodeUpcEanDigit (
+                    out, digits[i + 1],
+                    (parityPattern & (1 << (5 - i))) ? UPC_LEFT_B : UPC_LEFT_A);
             }
-            else if ((c2 >= 'a') && (c2 <= 'f'))
+            out = encodeModules (out, "010101");
+            break;
+        }
+        case SYMBOL_EAN8:
+        {
+            out = encodeModules (out, "101");
+            for (i = 0; i < 4; i++)
             {
-                c += c2 - 'a' + 10;
+                out = encodeUpcEanDigit (out, digits[i], UPC_LEFT_A);
             }
-            else
+            out = encodeModules (out, "01010");
+            for (i = 4; i < 8; i++)
             {
-                /* bad character in % sequence */
-                return NULL;
+                out = encodeUpcEanDigit (out, digits[i], UPC_RIGHT);
             }
+            out = encodeModules (out, "101");
+            break;
         }
-
-        *out = c;
-        out++;
-        bufSize--;
     }
 
     *out = '\0';
-    return buf;
+    return out - modules;
 }
 
-/* extract the first key/value pair from the given form-encoded string,
- * including doing the requisite unescaping, and return the start of the
- * next key/value pair; keys or values that don't fit in the space provided
- * are truncated; the stored results are always null-terminated; this
- * returns NULL if no data was successfully parsed. */
-char *formExtractFirst (char *form, char *key, int keySize,
-                        char *value, int valueSize)
+/* write the modules of the given supplemental code into the given string
+ * (which must have room for UPC_EAN_MAX_SUPPLEMENT_MODULES + 1
+ * characters), and return the count of modules written, which is 0 if
+ * there is no supplement */
+int upcEanEncodeSupplement (char *supDigits, char *modules)
 {
-    char *equalsPtr = form;
+    int len = strlen (supDigits);
+    int parity = upcEanSupplementParity (supDigits);
+    char *out = modules;
+    int i;
 
-    /* find the '=' */
-    while (*equalsPtr && (*equalsPtr != '='))
+    if (len != 0)
     {
-        equalsPtr++;
+        out = encodeModules (out, "1011");
     }
 
-    if (*equalsPtr != '=')
+    for (i = 0; i < len; i++)
     {
-        /* no '='; bad form data/end of form */
-        return NULL;
+        if (i != 0)
+        {
+            out = encodeModules (out, "01");
+        }
+        out = encodeUpcEanDigit (
+            out, supDigits[i],
+            (parity & (1 << (len - 1 - i))) ? UPC_LEFT_B : UPC_LEFT_A);
     }
 
-    key = formExtractString (form, equalsPtr, key, keySize);
-    if (key == NULL)
-    {
-        /* format problem */
-        return NULL;
-    }
+    *out = '\0';
+    return out - modules;
+}
 
-    /* find the '&' or the end of the string */
-    form = equalsPtr + 1;
-    while (*form && (*form != '&'))
+/* append a JSON object describing the encoding of the given code to the
+ * given buffer: the symbology, the human-readable digits, the module
+ * pattern, the module ranges of the long guard bars, and (if present) the
+ * banner and the supplement with its module offset */
+void bufferAppendUpcEanJson (Buffer *out, UpcEanCode *code)
+{
+    static const char *symbologyNames[] =
     {
-        form++;
-    }
+        [SYMBOL_UPCA] = "upc-a", [SYMBOL_UPCE] = "upc-e",
+        [SYMBOL_EAN13] = "ean-13", [SYMBOL_EAN8] = "ean-8"
+    };
+    static const char *guards[] =
+    {
+        [SYMBOL_UPCA] = "[[0,10],[45,50],[85,95]]",
+        [SYMBOL_UPCE] = "[[0,3],[45,51]]",
+        [SYMBOL_EAN13] = "[[0,3],[45,50],[92,95]]",
+        [SYMBOL_EAN8] = "[[0,3],[31,36],[64,67]]"
+    };
 
-    value = formExtractString (equalsPtr + 1, form, value, valueSize);
-    if (value == NULL)
+    char modules[UPC_EAN_MAX_MODULES + 1];
+    int count = upcEanEncode (code, modules);
+
+    bufferPrintf (out,
+                  "{\"symbology\":\"%s\",\"text\":\"%s\",\"gtin\":\"%s\","
+                  "\"checkOk\":%s,\"width\":%d,\"modules\":\"%s\","
+                  "\"guards\":%s",
+                  symbologyNames[code->symbology], code->digits, code->gtin,
+                  (code->forms & GTIN_CHECK_OK) ? "true" : "false", count,
+                  modules, guards[code->symbology]);
+
+    if (code->banner != NULL)
     {
-        /* format problem */
-        return NULL;
+        bufferAppendString (out, ",\"banner\":");
+        bufferAppendJsonString (out, code->banner);
     }
 
-    if (*form == '&')
+    if (code->supDigits[0] != '\0')
     {
-        form++;
+        char supModules[UPC_EAN_MAX_SUPPLEMENT_MODULES + 1];
+        int supCount = upcEanEncodeSupplement (code->supDigits, supModules);
+
+        bufferPrintf (out,
+                      ",\"supplement\":{\"text\":\"%s\",\"offset\":%d,"
+                      "\"width\":%d,\"modules\":\"%s\"}",
+                      code->supDigits, count + UPC_EAN_SUPPLEMENT_GAP,
+                      supCount, supModules);
     }
 
-    return form;
+    bufferAppendString (out, "}");
 }
 
 
 
 /* ----------------------------------------------------------------------------
- * run the show
+ * upc/ean decoding
  */
 
-/* different modes of operation */
-typedef enum
+/* the most runs (of bars and spaces) that upcEanDecodeRow() looks at in
+ * one row; a main pattern and a 5-digit supplement have 90, so anything
+ * with many more than that is noise */
+#define UPC_EAN_MAX_RUNS 128
+
+/* boolean whether each rendered barcode is decoded again and checked
+ * against the number it was rendered from (set by --verify) */
+static int verifyRenders = 0;
+
+/* the meaning of each 7-module digit pattern, as its digit plus 10 times
+ * its pattern set, or 0xff for patterns that aren't digits */
+static unsigned char upcEanPatternTable[128];
+static pthread_once_t upcEanPatternOnce = PTHREAD_ONCE_INIT;
+
+/* set up upcEanPatternTable (called only through upcEanPatternOnce) */
+void upcEanPatternSetup (void)
 {
-    MODE_UPCEAN, MODE_UPCEAN_SHORT, MODE_UPCE, MODE_UPCE_SHORT,
-    MODE_EAN8, MODE_EAN8_SHORT,
-    MODE_TEXT, MODE_PONDER, MODE_CHECK, MODE_PRINT_PASSWORD
+    int i;
+
+    memset (upcEanPatternTable, 0xff, sizeof (upcEanPatternTable));
+    for (i = 0; i < 10; i++)
+    {
+        upcEanPatternTable[upcLeftA[i]] = i + 10 * UPC_LEFT_A;
+        upcEanPatternTable[upcLeftB[i]] = i + 10 * UPC_LEFT_B;
+        upcEanPatternTable[upcRight[i]] = i + 10 * UPC_RIGHT;
+    }
 }
-Mode;
 
-/* all the possible options to the program */
+/* the runs of one row of an image, as read by upcEanDecodeRow() */
 typedef struct
 {
-    int requirePassword; /* boolean whether to require a password */
-    int httpHeader;      /* boolean whether to generate an HTTP reply header */
-    Mode mode;           /* mode of operation */
-    char *password;      /* password value */
-    char *value;         /* value to encode */
+    int runs[UPC_EAN_MAX_RUNS]; /* widths in pixels, alternating space and
+                                 * bar, starting (and ending) with space */
+    int count;                  /* count of runs */
+    int pos;                    /* index of the next run to read */
+    int guardWidth;             /* width of the start guard (3 modules) */
 }
-Options;
+UpcEanScan;
 
-/* initialize an options struct */
-void initOptions (Options *opts)
+/* read the runs of the given row of the given bitmap into the given scan;
+ * returns 0 if there are too many of them */
+int upcEanScanRow (Bitmap *b, int y, UpcEanScan *scan)
 {
-    opts->requirePassword = 0;
-    opts->httpHeader = 0;
-    opts->mode = MODE_UPCEAN;
-    opts->password = NULL;
-    opts->value = NULL;
-}
+    unsigned char *row = b->buf + y * b->widthBytes;
+    int color = 0;
+    int width = 0;
+    int x = 0;
 
-/* interpret a mode string */
-int setMode (Options *opts, char *mode)
-{
-    if (strcmp (mode, "upcean") == 0)
-    {
-        opts->mode = MODE_UPCEAN;
-    }
-    else if (strcmp (mode, "upcean-short") == 0)
+    scan->count = 0;
+    scan->pos = 0;
+
+    while (x < b->width)
     {
-        opts->mode = MODE_UPCEAN_SHORT;
+        int bits = row[x >> 3];
+
+        if (((x & 7) == 0) && ((x + 8) <= b->width)
+            && (bits == (color ? 0xff : 0x00)))
+        {
+            /* a whole byte continuing the current run */
+            width += 8;
+            x += 8;
+            continue;
+        }
+
+        if (((bits >> (x & 7)) & 1) != color)
+        {
+            if (scan->count == (UPC_EAN_MAX_RUNS - 2))
+            {
+                return 0;
+            }
+            scan->runs[scan->count] = width;
+            scan->count++;
+            color ^= 1;
+            width = 0;
+        }
+
+        width++;
+        x++;
     }
-    else if (strcmp (mode, "upce") == 0)
+
+    scan->runs[scan->count] = width;
+    scan->count++;
+    if (color)
     {
-        opts->mode = MODE_UPCE;
+        /* the image ends with a bar; give it an empty space after */
+        scan->runs[scan->count] = 0;
+        scan->count++;
     }
-    else if (strcmp (mode, "upce-short") == 0)
+
+    return 1;
+}
+
+/* return boolean whether the next count runs of the given scan are each
+ * one module wide (as in a guard pattern), consuming them if so */
+int upcEanScanGuard (UpcEanScan *scan, int count)
+{
+    int i;
+
+    if ((scan->pos + count) > scan->count)
     {
-        opts->mode = MODE_UPCE_SHORT;
+        return 0;
     }
-    else if (strcmp (mode, "ean8") == 0)
+
+    for (i = 0; i < count; i++)
     {
-        opts->mode = MODE_EAN8;
+        /* round (3 * width / guardWidth) to get modules */
+        int width = scan->runs[scan->pos + i];
+        if (((6 * width + scan->guardWidth) / (2 * scan->guardWidth)) != 1)
+        {
+            return 0;
+        }
     }
-    else if (strcmp (mode, "ean8-short") == 0)
+
+    scan->pos += count;
+    return 1;
+}
+
+/* read the next digit (4 runs, of 7 modules in all) of the given scan,
+ * returning its entry in upcEanPatternTable, or -1 if it isn't a digit;
+ * the runs are measured against the width of the whole digit, so that
+ * bars which are a bit wide or narrow still read correctly */
+int upcEanScanDigit (UpcEanScan *scan)
+{
+    int *runs = scan->runs + scan->pos;
+    int total;
+    int pattern = 0;
+    int modules = 0;
+    int bar = scan->pos & 1;
+    int i;
+
+    if ((scan->pos + 4) > scan->count)
     {
-        opts->mode = MODE_EAN8_SHORT;
+        return -1;
     }
-    else if (strcmp (mode, "text") == 0)
+
+    total = runs[0] + runs[1] + runs[2] + runs[3];
+    for (i = 0; i < 4; i++)
     {
-        opts->mode = MODE_TEXT;
+        /* round (7 * width / total) to get modules */
+        int count = (14 * runs[i] + total) / (2 * total);
+
+        if ((count < 1) || (count > 4))
+        {
+            return -1;
+        }
+
+        pattern = (pattern << count) | (bar ? ((1 << count) - 1) : 0);
+        modules += count;
+        bar ^= 1;
     }
-    else
+
+    if (modules != 7)
     {
-        return 0;
+        return -1;
     }
 
-    return 1;
+    scan->pos += 4;
+    return (upcEanPatternTable[pattern] == 0xff)
+        ? -1 : upcEanPatternTable[pattern];
 }
 
-/* set options from an http form submission string */
-void setOptionsFromForm (Options *opts, char *form)
+/* read count digits of the given scan, storing their characters into
+ * digits and their parity (a bit per digit, set for Left B, with the
+ * first digit in the highest bit) into *parity; each digit must be in one
+ * of the two Left sets (if right is 0) or in the Right set (if not);
+ * returns boolean success */
+int upcEanScanDigits (UpcEanScan *scan, int count, int right, char *digits,
+                      int *parity)
 {
-    char key[100];
-    char value[2000];
+    int i;
 
-    while (*form)
+    *parity = 0;
+    for (i = 0; i < count; i++)
     {
-        form = formExtractFirst (form, key, 100, value, 2000);
-        if (form == NULL)
-        {
-            break;
-        }
+        int entry = upcEanScanDigit (scan);
+        int set = entry / 10;
 
-        if (strcmp (key, "password") == 0)
-        {
-            opts->password = strdup (value);
-        }
-        else if (strcmp (key, "value") == 0)
+        if ((entry < 0) || ((set == UPC_RIGHT) != right))
         {
-            opts->value = strdup (value);
+            return 0;
         }
-        else if (strcmp (key, "mode") == 0)
+
+        digits[i] = '0' + (entry % 10);
+        *parity = (*parity << 1) | (set == UPC_LEFT_B);
+    }
+
+    return 1;
+}
+
+/* return the index of the given value in the given table of 10, or -1 if
+ * it isn't there */
+int upcEanTableIndex (unsigned int *table, unsigned int value)
+{
+    int i;
+
+    for (i = 0; i < 10; i++)
+    {
+        if (table[i] == value)
         {
-            setMode (opts, value);
+            return i;
         }
     }
+
+    return -1;
 }
 
-/* set options from argv */
-void setOptionsFromArgv (Options *opts, int argc, char *argv[])
+/* read the supplement, if any, that follows the main pattern of the given
+ * scan into supDigits (leaving it "" if there is none); returns boolean
+ * success */
+int upcEanScanSupplement (UpcEanScan *scan, char *supDigits)
 {
-    int parseForm = 0;
+    int *runs;
+    int count = 0;
+    int parity;
+    int bit;
 
-    /* skip the name of the executable */
-    argv++;
-    argc--;
+    supDigits[0] = '\0';
 
-    while (argc > 0)
+    /* skip the gap; nothing past it means no supplement */
+    scan->pos++;
+    if (scan->pos >= (scan->count - 1))
     {
-        if (strncmp (*argv, "--", 2) != 0)
-        {
-            break;
-        }
+        return 1;
+    }
 
-        if (strcmp (*argv, "--require-password") == 0)
-        {
-            opts->requirePassword = 1;
-        }
-        else if (strcmp (*argv, "--http-header") == 0)
+    /* the start guard, "1011" */
+    runs = scan->runs + scan->pos;
+    if (((scan->pos + 3) > scan->count)
+        || (((6 * runs[0] + scan->guardWidth) / (2 * scan->guardWidth)) != 1)
+        || (((6 * runs[1] + scan->guardWidth) / (2 * scan->guardWidth)) != 1)
+        || (((6 * runs[2] + scan->guardWidth) / (2 * scan->guardWidth)) != 2))
+    {
+        return 0;
+    }
+    scan->pos += 3;
+
+    parity = 0;
+    for (;;)
+    {
+        if ((count == 5) || ! upcEanScanDigits (scan, 1, 0, supDigits + count,
+                                                &bit))
         {
-            opts->httpHeader = 1;
+            return 0;
         }
-        else if (strncmp (*argv, "--mode=", 7) == 0)
+        parity = (parity << 1) | bit;
+        count++;
+
+        /* each digit but the last is followed by a "01" separator */
+        if (! upcEanScanGuard (scan, 2))
         {
-            char *modeStr = (*argv) + 7;
-            setMode (opts, modeStr);
+            break;
         }
-        else if (strcmp (*argv, "--check") == 0)
+    }
+
+    supDigits[count] = '\0';
+    return ((count == 2) || (count == 5))
+        && ((upcEanSupplementParity (supDigits) & ((1 << count) - 1))
+            == parity);
+}
+
+/* decode the UPC-A, UPC-E, EAN-13, or EAN-8 barcode (and supplement) that
+ * crosses the given row of the given bitmap, as a scanner would: the row
+ * is read as runs of bars and spaces, whose widths are matched against
+ * the digit patterns; the digits (as they would be printed), supplement,
+ * GTIN, and forms are stored into the given code, whose GTIN_CHECK_OK
+ * form says whether the check digit is correct; returns 0 if the row
+ * doesn't hold a barcode (with a correct supplement parity) */
+int upcEanDecodeRow (Bitmap *b, int y, UpcEanCode *code)
+{
+    UpcEanScan scan;
+    char *digits = code->digits;
+    int leftParity;
+    int rightParity;
+    int length;
+    int first;
+    int mark;
+
+    pthread_once (&upcEanPatternOnce, upcEanPatternSetup);
+
+    code->digits[0] = '\0';
+    code->supDigits[0] = '\0';
+    code->banner = NULL;
+    code->mcheck = 0;
+
+    if (! upcEanScanRow (b, y, &scan) || (scan.count < 5))
+    {
+        return 0;
+    }
+
+    /* the start guard (after the quiet zone), which sets the module width */
+    scan.guardWidth = scan.runs[1] + scan.runs[2] + scan.runs[3];
+    scan.pos = 1;
+    if ((scan.guardWidth == 0) || ! upcEanScanGuard (&scan, 3))
+    {
+        return 0;
+    }
+
+    /* EAN-8 has 4 digits before its center guard, and the others 6 */
+    if (upcEanScanDigits (&scan, 4, 0, digits, &leftParity)
+        && upcEanScanGuard (&scan, 5))
+    {
+        if ((leftParity != 0)
+            || ! upcEanScanDigits (&scan, 4, 1, digits + 4, &rightParity)
+            || ! upcEanScanGuard (&scan, 3))
         {
-            opts->mode = MODE_CHECK;
+            return 0;
         }
-        else if (strcmp (*argv, "--print-password") == 0)
+        code->symbology = SYMBOL_EAN8;
+        length = 8;
+    }
+    else
+    {
+        scan.pos = 4;
+        if (! upcEanScanDigits (&scan, 6, 0, digits + 1, &leftParity))
         {
-            opts->mode = MODE_PRINT_PASSWORD;
+            return 0;
         }
-        else if (strcmp (*argv, "--form-data") == 0)
+
+        /* the UPC-E end guard starts out like a center guard, so a
+         * failure to read the rest of an EAN-13 means to try UPC-E */
+        first = upcEanTableIndex (ean13FirstDigit, leftParity);
+        mark = scan.pos;
+        if ((first >= 0)
+            && upcEanScanGuard (&scan, 5)
+            && upcEanScanDigits (&scan, 6, 1, digits + 7, &rightParity)
+            && upcEanScanGuard (&scan, 3))
         {
-            parseForm = 1;
+            /* EAN-13, with the first digit in the parity of the left
+             * half; UPC-A is the same as EAN-13 with a first digit of 0 */
+            if (first == 0)
+            {
+                memmove (digits, digits + 1, 12);
+                code->symbology = SYMBOL_UPCA;
+                length = 12;
+            }
+            else
+            {
+                digits[0] = '0' + first;
+                code->symbology = SYMBOL_EAN13;
+                length = 13;
+            }
         }
         else
         {
-            fprintf (stderr, "unrecognized option: %s\n", *argv);
+            /* UPC-E, with the number system and check digit in the
+             * parity of the digits */
+            scan.pos = mark;
+            if (! upcEanScanGuard (&scan, 6))
+            {
+                return 0;
+            }
+
+            first = upcEanTableIndex (upcELastDigit, leftParity);
+            digits[0] = '0';
+            if (first < 0)
+            {
+                first = upcEanTableIndex (upcELastDigit, ~leftParity & 0x3f);
+                digits[0] = '1';
+            }
+            if (first < 0)
+            {
+                return 0;
+            }
+            digits[7] = '0' + first;
+            code->symbology = SYMBOL_UPCE;
+            length = 8;
         }
+    }
 
-        argc--;
-        argv++;
+    digits[length] = '\0';
+    code->forms = gtinNormalize (digits, length,
+                                 code->symbology == SYMBOL_UPCE, code->gtin);
+
+    return upcEanScanSupplement (&scan, code->supDigits);
+}
+
+/* return boolean whether the given image, rendered from the given code,
+ * decodes back to the same number (and supplement) in the same symbology
+ * (counting UPC-A and EAN-13 as the same, since a UPC-A barcode is
+ * exactly an EAN-13 one that starts with 0); the digits are compared as
+ * given, so a number with a wrong check digit (which is drawn as given)
+ * verifies if it reads back the same; a few rows are tried, in case one
+ * of them crosses something other than the bars */
+int upcEanVerify (UpcEanCode *code, Bitmap *b)
+{
+    static const int fractions[] = { 2, 3, 4 };
+    UpcEanCode decoded;
+    int i;
+
+    if (code->mcheck == 3)
+    {
+        /* the magic picture crosses every row, so there's no telling */
+        return 1;
     }
 
-    if (argc != 0)
+    for (i = 0; i < 3; i++)
     {
-        if (parseForm)
+        int y = b->height / fractions[i];
+
+        if (upcEanDecodeRow (b, y, &decoded)
+            && (strcmp (decoded.gtin, code->gtin) == 0)
+            && (strcmp (decoded.supDigits, code->supDigits) == 0)
+            && ((decoded.symbology == code->symbology)
+                || ((decoded.symbology != SYMBOL_UPCE)
+                    && (decoded.symbology != SYMBOL_EAN8)
+                    && (code->symbology != SYMBOL_UPCE)
+                    && (code->symbology != SYMBOL_EAN8))))
         {
-            setOptionsFromForm (opts, *argv);
-        }
-        else
-        {
-            opts->value = strdup (*argv);
+            return 1;
         }
     }
 
-    if (opts->value != NULL)
+    return 0;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * book numbers
+ */
+
+/* the kinds of numbers that bookParse() understands, all of which are
+ * encoded as EAN-13 (ISBNs under the 978 and 979 prefixes, ISSNs under
+ * 977, and ISMNs under 979-0) */
+typedef enum
+{
+    BOOK_ISBN, BOOK_ISSN, BOOK_ISMN
+}
+BookKind;
+
+/* the name of each kind of number, as used in banners */
+static const char *bookLabels[] =
+{
+    [BOOK_ISBN] = "ISBN",
+    [BOOK_ISSN] = "ISSN",
+    [BOOK_ISMN] = "ISMN"
+};
+
+/* calculate and return the mod-11 check character ('0'..'9', or 'X' for
+ * 10) for the given count of digits, weighted from count + 1 down to 2 as
+ * ISBN-10 and ISSN do */
+char bookMod11CheckDigit (const char *digits, int count)
+{
+    int sum = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
     {
-        char *value = opts->value;
-        if (*value == ':')
-        {
-            char *col2 = strchr (value + 1, ':');
-            if (col2 != NULL)
-            {
-                int amt = col2 - value;
-                char *mstr = malloc (amt);
-                amt--;
-                memcpy (mstr, value + 1, amt);
-                mstr[amt] = '\0';
-                if (setMode (opts, mstr))
-                {
-                    char *newv = strdup (col2 + 1);
-                    free (opts->value);
-                    opts->value = newv;
-                }
-                free (mstr);
-            }
-        }
+        sum += (digits[i] - '0') * (count + 1 - i);
     }
+
+    sum = (11 - (sum % 11)) % 11;
+    return (sum == 10) ? 'X' : (sum + '0');
 }
 
-int main (int argc, char *argv[])
+/* parse the given price (e.g. "$12.95", without the '$') into the
+ * 5-digit supplement that prints it in U.S. dollars, stored as a string
+ * into supDigits; prices of $100 and up are all printed as "59999", which
+ * by convention means that the price isn't encoded; returns 0 if the
+ * price is malformed */
+int bookParsePrice (const char *str, const char *end, char *supDigits)
 {
-    Options opts;
-    initOptions (&opts);
-    setOptionsFromArgv (&opts, argc, argv);
+    int dollars = 0;
+    int cents = 0;
+    int centDigits = 0;
+    int dollarDigits = 0;
 
-    if (opts.requirePassword)
+    while ((str < end) && isdigit ((unsigned char) *str))
     {
-        if ((opts.password == NULL)
-            || ! verifyPassword (strtol (opts.password, NULL, 0)))
-        {
-            opts.mode = MODE_PONDER;
-        }
+        dollars = (dollars < 100) ? (dollars * 10 + (*str - '0')) : 100;
+        dollarDigits++;
+        str++;
     }
 
-    switch (opts.mode)
+    if ((str < end) && (*str == '.'))
     {
-        case MODE_UPCEAN:
+        str++;
+        while ((str < end) && isdigit ((unsigned char) *str)
+               && (centDigits < 2))
         {
-            processUpcEan (opts.value, 0, 0, opts.httpHeader);
-            break;
+            cents = cents * 10 + (*str - '0');
+            centDigits++;
+            str++;
         }
-        case MODE_UPCEAN_SHORT:
+        if (centDigits == 1)
         {
-            processUpcEan (opts.value, 0, 1, opts.httpHeader);
-            break;
+            cents *= 10;
+        }
+    }
+
+    if ((str != end) || ((dollarDigits + centDigits) == 0))
+    {
+        return 0;
+    }
+
+    if (dollars >= 100)
+    {
+        strcpy (supDigits, "59999");
+    }
+    else
+    {
+        sprintf (supDigits, "5%02d%02d", dollars, cents);
+    }
+
+    return 1;
+}
+
+/* parse the supplement (after the comma) of a book number, up to the
+ * given end, into supDigits, as either 2 or 5 digits or a price (see
+ * bookParsePrice()); returns 0 (storing the reason in *error) if it is
+ * malformed */
+int bookParseSupplement (const char *str, const char *end, char *supDigits,
+                         ErrorCode *error)
+{
+    int count = 0;
+
+    while ((str < end) && (*str == ' '))
+    {
+        str++;
+    }
+
+    if ((str < end) && (*str == '$'))
+    {
+        if (! bookParsePrice (str + 1, end, supDigits))
+        {
+            *error = ERROR_BOOK_PRICE;
+            return 0;
+        }
+        return 1;
+    }
+
+    for (; str < end; str++)
+    {
+        if (! isdigit ((unsigned char) *str))
+        {
+            if (*str == ' ')
+            {
+                continue;
+            }
+            count = 0;
+            break;
+        }
+        if (count == 5)
+        {
+            count = 0;
+            break;
+        }
+        supDigits[count] = *str;
+        count++;
+    }
+
+    supDigits[count] = '\0';
+    if ((count != 2) && (count != 5))
+    {
+        *error = ERROR_SUPPLEMENT_LENGTH;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* parse the given ISBN (10 or 13 digits), ISSN (8 digits), or ISMN ("M"
+ * and 9 digits, or 13 digits) into the given code struct as the EAN-13
+ * number that encodes it, with its check digit recomputed; the number may
+ * be preceded by its name (e.g. "ISBN 0-201-37962-4"), hyphens and spaces
+ * within it are ignored, and its own check digit (which is verified) may
+ * be given as '?', to have it calculated; as for upcEanParse(), it may be
+ * followed by a comma and a supplement, which may also be a price in
+ * dollars (e.g. ",$12.95"), and then by a colon and a banner; the default
+ * banner is the name and number, much as written; if the number isn't
+ * supported, this returns 0 and stores the reason in *error */
+int bookParse (char *str, UpcEanCode *code, ErrorCode *error)
+{
+    char digits[16];
+    char *ean = code->digits;
+    int count = 0;
+    int hyphens = 0;
+    char *start;
+    char *checkAt = NULL;
+    char *p;
+    BookKind kind;
+    const char *prefix = "";
+    char given;
+    char check;
+    int i;
+
+    code->symbology = SYMBOL_EAN13;
+    code->supDigits[0] = '\0';
+    code->mcheck = 0;
+
+    if (str == NULL)
+    {
+        *error = ERROR_BOOK_NUMBER;
+        return 0;
+    }
+
+    /* skip the name of the number, if given */
+    for (start = str; *start == ' '; start++)
+    {
+        /* just skipping */
+    }
+    if ((strncasecmp (start, "ISBN", 4) == 0)
+        || (strncasecmp (start, "ISSN", 4) == 0)
+        || (strncasecmp (start, "ISMN", 4) == 0))
+    {
+        for (start += 4; *start == ' '; start++)
+        {
+            /* just skipping */
+        }
+    }
+
+    for (p = start; (*p != '\0') && (*p != ',') && (*p != ':'); p++)
+    {
+        char c = toupper ((unsigned char) *p);
+
+        if ((c == ' ') || (c == '-'))
+        {
+            hyphens += (c == '-');
+            continue;
+        }
+
+        if ((count == 13)
+            || ! (isdigit ((unsigned char) c) || (c == '?') || (c == 'X')
+                  || ((c == 'M') && (count == 0))))
+        {
+            *error = ERROR_BOOK_NUMBER;
+            return 0;
+        }
+
+        digits[count] = c;
+        count++;
+        checkAt = p;
+    }
+
+    /* everything before the check digit (and after the M of an old-style
+     * ISMN) must be a digit */
+    for (i = (count != 0) && (digits[0] == 'M'); i < (count - 1); i++)
+    {
+        if (! isdigit ((unsigned char) digits[i]))
+        {
+            *error = ERROR_BOOK_NUMBER;
+            return 0;
+        }
+    }
+
+    given = (count == 0) ? '\0' : digits[count - 1];
+
+    if ((count == 10) && (digits[0] == 'M'))
+    {
+        /* M is an alias of 979-0, and the check digit is the same */
+        kind = BOOK_ISMN;
+        prefix = (hyphens != 0) ? "979-0" : "9790";
+        memcpy (ean, "9790", 4);
+        memcpy (ean + 4, digits + 1, 8);
+        check = upcEanCheckDigit (ean, 12);
+    }
+    else if ((count == 10) || (count == 8))
+    {
+        /* an ISBN-10 goes under 978, and an ISSN under 977 with the issue
+         * variant 00; both lose their mod-11 check digit */
+        check = bookMod11CheckDigit (digits, count - 1);
+        if (count == 10)
+        {
+            kind = BOOK_ISBN;
+            prefix = (hyphens != 0) ? "978-" : "978";
+            memcpy (ean, "978", 3);
+            memcpy (ean + 3, digits, 9);
+        }
+        else
+        {
+            kind = BOOK_ISSN;
+            memcpy (ean, "977", 3);
+            memcpy (ean + 3, digits, 7);
+            memcpy (ean + 10, "00", 2);
+        }
+    }
+    else if ((count == 13) && isdigit ((unsigned char) digits[0])
+             && (given != 'X')
+             && ((memcmp (digits, "978", 3) == 0)
+                 || (memcmp (digits, "979", 3) == 0)
+                 || (memcmp (digits, "977", 3) == 0)))
+    {
+        kind = (digits[2] == '7') ? BOOK_ISSN
+            : (digits[3] == '0') && (digits[2] == '9') ? BOOK_ISMN
+            : BOOK_ISBN;
+        memcpy (ean, digits, 12);
+        check = upcEanCheckDigit (ean, 12);
+    }
+    else
+    {
+        *error = ERROR_BOOK_NUMBER;
+        return 0;
+    }
+
+    if ((given != '?') && (given != check))
+    {
+        *error = ERROR_BOOK_CHECK;
+        return 0;
+    }
+
+    ean[12] = upcEanCheckDigit (ean, 12);
+    ean[13] = '\0';
+    code->forms = gtinNormalize (ean, 13, 0, code->gtin);
+
+    if (*p == ',')
+    {
+        char *supEnd = strchr (p, ':');
+
+        if (supEnd == NULL)
+        {
+            supEnd = p + strlen (p);
+        }
+
+        if (! bookParseSupplement (p + 1, supEnd, code->supDigits, error))
+        {
+            return 0;
+        }
+        p = supEnd;
+    }
+
+    if (*p == ':')
+    {
+        code->banner = (p[1] == '\0') ? NULL : (p + 1);
+    }
+    else
+    {
+        char *out = code->bannerText;
+        char *limit = code->bannerText + sizeof (code->bannerText) - 1;
+        char *q;
+
+        /* the number is shown as written, but with the prefix that
+         * converts it to 13 digits, if needed, and the check digit filled
+         * in (which for an ISSN remains its own) */
+        out += sprintf (out, "%s %s", bookLabels[kind], prefix);
+        for (q = start; (q <= checkAt) && (out < limit); q++)
+        {
+            if ((*q == 'M') || (*q == 'm'))
+            {
+                continue;
+            }
+            *out = (q != checkAt) ? *q
+                : (kind == BOOK_ISSN) ? check : ean[12];
+            out++;
+        }
+        *out = '\0';
+        code->banner = code->bannerText;
+    }
+
+    return 1;
+}
+
+/* make and return the bitmap for the given book number string (see
+ * bookParse()); if the number isn't supported, this returns NULL (having
+ * rendered nothing) and stores the reason in *error */
+Bitmap *bookToBitmap (char *str, int shortForm, ErrorCode *error)
+{
+    UpcEanCode code;
+
+    if (! bookParse (str, &code, error))
+    {
+        return NULL;
+    }
+
+    return upcEanCodeToBitmap (&code, shortForm);
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * bulk check digits
+ */
+
+/* the widest digit string that the bulk check digit code accepts; each
+ * string is handled as one 16-byte vector */
+#define GTIN_MAX_WIDTH 16
+
+/* the remainder reported for a string that isn't all digits */
+#define GTIN_NOT_DIGITS 0xff
+
+/* the number of strings that gtinValidate() and numberStream() handle at
+ * a time */
+#define GTIN_CHUNK 4096
+
+/* boolean whether gtinRemainders() weighs a whole number per SSSE3
+ * multiply-add; "--bench check" clears it to time the digit loop */
+static int gtinUseSimd = 1;
+
+/* return the sum of the given digits, weighted as for upcEanCheckDigit(),
+ * mod 10; if hasCheck, the last digit is taken to be the check digit (and
+ * is weighted 1), so the string is valid if the result is 0; this returns
+ * GTIN_NOT_DIGITS if any character isn't a digit */
+int gtinRemainder (const char *digits, int width, int hasCheck)
+{
+    unsigned int mul = hasCheck ? 1 : 3;
+    unsigned int sum = 0;
+    int i;
+
+    for (i = width - 1; i >= 0; i--)
+    {
+        unsigned int d = (unsigned char) digits[i] - '0';
+        if (d > 9)
+        {
+            return GTIN_NOT_DIGITS;
+        }
+        sum += d * mul;
+        mul ^= 2;
+    }
+
+    return sum % 10;
+}
+
+#ifdef __SSSE3__
+
+/* set up the per-byte weights, and the mask of the bytes in use, for
+ * strings of the given width (see gtinRemainder()) */
+static void gtinSimdSetup (int width, int hasCheck, __m128i *weights,
+                           __m128i *inUse)
+{
+    signed char w[16];
+    signed char m[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        int fromRight = width - 1 - i;
+        if (fromRight < 0)
+        {
+            w[i] = 0;
+            m[i] = 0;
+        }
+        else
+        {
+            w[i] = ((fromRight & 1) == (hasCheck != 0)) ? 3 : 1;
+            m[i] = -1;
+        }
+    }
+
+    *weights = _mm_loadu_si128 ((__m128i *) w);
+    *inUse = _mm_loadu_si128 ((__m128i *) m);
+}
+
+/* reduce each of the given (16-bit) sums mod 10, by way of a multiply and
+ * shift that divides by 10 exactly for sums under 16384 */
+static inline __m128i gtinMod10x8 (__m128i sums)
+{
+    __m128i tens = _mm_mulhi_epu16 (sums, _mm_set1_epi16 (6554));
+    return _mm_sub_epi16 (sums, _mm_mullo_epi16 (tens, _mm_set1_epi16 (10)));
+}
+
+/* compute the remainders of the 8 strings starting at the given position
+ * and separated by stride bytes, each of which must have 16 readable
+ * bytes, storing them into the given array */
+static void gtinRemainders8 (const char *data, long stride, __m128i weights,
+                             __m128i inUse, unsigned char *out)
+{
+    __m128i nine = _mm_set1_epi8 (9);
+    __m128i pairs[8];
+    __m128i sums;
+    unsigned int bad = 0;
+    int j;
+
+    for (j = 0; j < 8; j++)
+    {
+        /* digit values, with anything else mapping above 9 */
+        __m128i d = _mm_sub_epi8 (
+            _mm_loadu_si128 ((__m128i *) (data + j * stride)),
+            _mm_set1_epi8 ('0'));
+        __m128i notDigit = _mm_andnot_si128 (
+            _mm_cmpeq_epi8 (_mm_max_epu8 (d, nine), nine), inUse);
+
+        bad |= (_mm_movemask_epi8 (notDigit) != 0) << j;
+        pairs[j] = _mm_maddubs_epi16 (d, weights);
+    }
+
+    /* three rounds of horizontal adds leave one sum per string */
+    sums = _mm_hadd_epi16 (
+        _mm_hadd_epi16 (_mm_hadd_epi16 (pairs[0], pairs[1]),
+                        _mm_hadd_epi16 (pairs[2], pairs[3])),
+        _mm_hadd_epi16 (_mm_hadd_epi16 (pairs[4], pairs[5]),
+                        _mm_hadd_epi16 (pairs[6], pairs[7])));
+    sums = gtinMod10x8 (sums);
+    _mm_storel_epi64 ((__m128i *) out, _mm_packus_epi16 (sums, sums));
+
+    while (bad != 0)
+    {
+        out[__builtin_ctz (bad)] = GTIN_NOT_DIGITS;
+        bad &= bad - 1;
+    }
+}
+
+#endif
+
+#ifdef __AVX2__
+
+/* 16-string version of gtinRemainders8(), with strings j and j + 8 sharing
+ * a vector */
+static void gtinRemainders16 (const char *data, long stride, __m128i weights,
+                              __m128i inUse, unsigned char *out)
+{
+    __m256i weights2 = _mm256_broadcastsi128_si256 (weights);
+    __m256i inUse2 = _mm256_broadcastsi128_si256 (inUse);
+    __m256i nine = _mm256_set1_epi8 (9);
+    __m256i pairs[8];
+    __m256i sums;
+    __m128i tens;
+    unsigned int bad = 0;
+    int j;
+
+    for (j = 0; j < 8; j++)
+    {
+        __m256i d = _mm256_sub_epi8 (
+            _mm256_inserti128_si256 (
+                _mm256_castsi128_si256 (
+                    _mm_loadu_si128 ((__m128i *) (data + j * stride))),
+                _mm_loadu_si128 ((__m128i *) (data + (j + 8) * stride)),
+                1),
+            _mm256_set1_epi8 ('0'));
+        unsigned int notDigit = _mm256_movemask_epi8 (
+            _mm256_andnot_si256 (
+                _mm256_cmpeq_epi8 (_mm256_max_epu8 (d, nine), nine),
+                inUse2));
+
+        bad |= (((notDigit & 0xffff) != 0) << j)
+            | (((notDigit >> 16) != 0) << (j + 8));
+        pairs[j] = _mm256_maddubs_epi16 (d, weights2);
+    }
+
+    sums = _mm256_hadd_epi16 (
+        _mm256_hadd_epi16 (_mm256_hadd_epi16 (pairs[0], pairs[1]),
+                           _mm256_hadd_epi16 (pairs[2], pairs[3])),
+        _mm256_hadd_epi16 (_mm256_hadd_epi16 (pairs[4], pairs[5]),
+                           _mm256_hadd_epi16 (pairs[6], pairs[7])));
+    sums = _mm256_sub_epi16 (
+        sums,
+        _mm256_mullo_epi16 (
+            _mm256_mulhi_epu16 (sums, _mm256_set1_epi16 (6554)),
+            _mm256_set1_epi16 (10)));
+    tens = _mm_packus_epi16 (_mm256_castsi256_si128 (sums),
+                             _mm256_extracti128_si256 (sums, 1));
+    _mm_storeu_si128 ((__m128i *) out, tens);
+
+    while (bad != 0)
+    {
+        out[__builtin_ctz (bad)] = GTIN_NOT_DIGITS;
+        bad &= bad - 1;
+    }
+}
+
+#endif
+
+/* compute the remainders (see gtinRemainder()) of count digit strings of
+ * the given width (at most GTIN_MAX_WIDTH), the first one at data and
+ * each one stride bytes after the one before, storing them into the given
+ * array */
+void gtinRemainders (const char *data, int width, long stride, int count,
+                     int hasCheck, unsigned char *remainders)
+{
+    int i = 0;
+
+#ifdef __SSSE3__
+    if (gtinUseSimd && (count > 0))
+    {
+        /* the vectorized code reads 16 bytes of every string, so it has
+         * to leave any strings too near the end to the scalar code */
+        long limit = (long) (count - 1) * stride + width;
+        __m128i weights;
+        __m128i inUse;
+
+        gtinSimdSetup (width, hasCheck, &weights, &inUse);
+
+#ifdef __AVX2__
+        while (((i + 16) <= count)
+               && (((long) (i + 15) * stride + 16) <= limit))
+        {
+            gtinRemainders16 (data + (long) i * stride, stride, weights,
+                              inUse, remainders + i);
+            i += 16;
+        }
+#endif
+
+        while (((i + 8) <= count)
+               && (((long) (i + 7) * stride + 16) <= limit))
+        {
+            gtinRemainders8 (data + (long) i * stride, stride, weights,
+                             inUse, remainders + i);
+            i += 8;
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        remainders[i] = gtinRemainder (data + (long) i * stride, width,
+                                       hasCheck);
+    }
+}
+
+/* validate count GTINs (that is, digit strings ending with a check digit)
+ * laid out as for gtinRemainders(); store the indices of the invalid ones
+ * (including any that aren't all digits) into the given array, which must
+ * have room for count of them, and return how many there are */
+int gtinValidate (const char *data, int width, long stride, int count,
+                  int *invalid)
+{
+    unsigned char remainders[GTIN_CHUNK];
+    int found = 0;
+    int base;
+
+    for (base = 0; base < count; base += GTIN_CHUNK)
+    {
+        int n = ((count - base) < GTIN_CHUNK) ? (count - base) : GTIN_CHUNK;
+        int i = 0;
+
+        gtinRemainders (data + (long) base * stride, width, stride, n, 1,
+                        remainders);
+
+#ifdef __SSE2__
+        /* go 16 at a time, mostly just skipping over valid ones */
+        for (; (i + 16) <= n; i += 16)
+        {
+            unsigned int nonzero = 0xffff & ~_mm_movemask_epi8 (
+                _mm_cmpeq_epi8 (
+                    _mm_loadu_si128 ((__m128i *) (remainders + i)),
+                    _mm_setzero_si128 ()));
+
+            while (nonzero != 0)
+            {
+                invalid[found] = base + i + __builtin_ctz (nonzero);
+                found++;
+                nonzero &= nonzero - 1;
+            }
+        }
+#endif
+
+        for (; i < n; i++)
+        {
+            if (remainders[i] != 0)
+            {
+                invalid[found] = base + i;
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+/* compute the check digits of count digit strings (not including a check
+ * digit) laid out as for gtinRemainders(), storing the check digit
+ * characters into the given array, or '\0' for any string that isn't all
+ * digits; return the number of those */
+int gtinComplete (const char *data, int width, long stride, int count,
+                  char *checks)
+{
+    static const char checkDigits[10] = "0987654321";
+    int bad = 0;
+    int i;
+
+    gtinRemainders (data, width, stride, count, 0, (unsigned char *) checks);
+
+    for (i = 0; i < count; i++)
+    {
+        unsigned char r = checks[i];
+        if (r == GTIN_NOT_DIGITS)
+        {
+            checks[i] = '\0';
+            bad++;
+        }
+        else
+        {
+            checks[i] = checkDigits[r];
+        }
+    }
+
+    return bad;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * bulk UPC-E conversion
+ */
+
+/* boolean whether upcECompressBulk() and upcEExpandBulk() rearrange the
+ * digits with byte shuffles, rather than one number at a time through
+ * compressToUpcEDigits() and expandToUpcADigits(); "--bench upce" clears
+ * it to compare the two */
+static int upcEUseSimd = 1;
+
+#ifdef __SSSE3__
+
+/* set up byte shuffles (and literal digits to combine with them) that
+ * build numbers from the given maps (of the given count of maps, each of
+ * the given length, with indices below the given limit; see
+ * upcECompressMaps), with the check digit taken from the given index */
+static void upcESimdSetup (const char *maps, int mapCount, int length,
+                           int limit, int checkIndex, __m128i *shuffles,
+                           __m128i *literals)
+{
+    int m;
+
+    for (m = 0; m < mapCount; m++)
+    {
+        const char *map = maps + m * length;
+        char shuffle[16];
+        char literal[16];
+        int i;
+
+        memset (shuffle, 0x80, 16);
+        memset (literal, 0, 16);
+        for (i = 0; i < length; i++)
+        {
+            if (map[i] < limit)
+            {
+                shuffle[i] = map[i];
+            }
+            else
+            {
+                literal[i] = map[i];
+            }
+        }
+        shuffle[length] = checkIndex;
+
+        shuffles[m] = _mm_loadu_si128 ((__m128i *) shuffle);
+        literals[m] = _mm_loadu_si128 ((__m128i *) literal);
+    }
+}
+
+#endif
+
+/* compress count UPC-A numbers of 12 digits, the first one at data and
+ * each one stride bytes after the one before, into UPC-E (just as
+ * compressToUpcEDigits() does), storing the 8 digits of each (not
+ * null-terminated) into out, each one outStride bytes after the one
+ * before; a number that can't be compressed gets a '\0' as its first
+ * digit; returns the count of those */
+int upcECompressBulk (const char *data, long stride, int count, char *out,
+                      long outStride)
+{
+    int bad = 0;
+    int i = 0;
+
+#ifdef __SSSE3__
+    if (upcEUseSimd && (count > 0))
+    {
+        /* the vectorized code reads 16 bytes of every number */
+        long limit = (long) (count - 1) * stride + 12;
+        __m128i shuffles[5];
+        __m128i literals[5];
+
+        upcESimdSetup (&upcECompressMaps[0][0], 5, 7, 12, 11, shuffles,
+                       literals);
+
+        for (; (i < count) && (((long) i * stride + 16) <= limit); i++)
+        {
+            const char *expanded = data + (long) i * stride;
+            char *compressed = out + (long) i * outStride;
+            __m128i chunk = _mm_loadu_si128 ((__m128i *) expanded);
+            unsigned int zeros = _mm_movemask_epi8 (
+                _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('0')));
+            int rule = upcECompressRule (expanded, zeros);
+
+            _mm_storel_epi64 (
+                (__m128i *) compressed,
+                _mm_or_si128 (_mm_shuffle_epi8 (chunk, shuffles[rule]),
+                              literals[rule]));
+            compressed[0] = (rule == 0) ? '\0' : compressed[0];
+            bad += (rule == 0);
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        char compressed[9];
+
+        compressToUpcEDigits ((char *) data + (long) i * stride, compressed);
+        memcpy (out + (long) i * outStride, compressed, 8);
+        bad += (compressed[0] == '\0');
+    }
+
+    return bad;
+}
+
+/* expand count UPC-E numbers of 8 digits, laid out as for
+ * upcECompressBulk(), into UPC-A (just as expandToUpcADigits() does),
+ * storing the 12 digits of each (not null-terminated) into out, each one
+ * outStride bytes after the one before; a number that can't be expanded
+ * gets a '\0' as its first digit; returns the count of those */
+int upcEExpandBulk (const char *data, long stride, int count, char *out,
+                    long outStride)
+{
+    int bad = 0;
+    int i = 0;
+
+#ifdef __SSSE3__
+    if (upcEUseSimd && (count > 0))
+    {
+        long limit = (long) (count - 1) * stride + 8;
+        __m128i shuffles[10];
+        __m128i literals[10];
+
+        upcESimdSetup (&upcEExpandMaps[0][0], 10, 11, 8, 7, shuffles,
+                       literals);
+
+        for (; (i < count) && (((long) i * stride + 16) <= limit); i++)
+        {
+            const char *compressed = data + (long) i * stride;
+            char *expanded = out + (long) i * outStride;
+            unsigned int last = (unsigned char) (compressed[6] - '0');
+            __m128i chunk = _mm_loadu_si128 ((__m128i *) compressed);
+            __m128i digits;
+            int ok = (compressed[0] == '0') || (compressed[0] == '1');
+            int high;
+
+            last = (last <= 9) ? last : 9;
+            digits = _mm_or_si128 (_mm_shuffle_epi8 (chunk, shuffles[last]),
+                                   literals[last]);
+
+            /* 12 bytes, without touching the next number */
+            _mm_storel_epi64 ((__m128i *) expanded, digits);
+            high = _mm_cvtsi128_si32 (_mm_srli_si128 (digits, 8));
+            memcpy (expanded + 8, &high, 4);
+
+            if (expanded[11] == '?')
+            {
+                expanded[11] = upcEanCheckDigit (expanded, 11);
+            }
+            expanded[0] = ok ? expanded[0] : '\0';
+            bad += ! ok;
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        char expanded[12];
+
+        expanded[0] = '\0';
+        expandToUpcADigits ((char *) data + (long) i * stride, expanded);
+        memcpy (out + (long) i * outStride, expanded, 12);
+        bad += (expanded[0] == '\0');
+    }
+
+    return bad;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * number files
+ */
+
+/* the size of the input buffer used by numberStream() */
+#define NUMBER_STREAM_BYTES (1 << 20)
+
+/* the things numberStream() can do to a file of numbers */
+typedef enum
+{
+    NUMBERS_VALIDATE, NUMBERS_COMPLETE, NUMBERS_CONVERT
+}
+NumbersTask;
+
+/* the lengths of numbers accepted for each task, as bitmasks */
+static const unsigned int numbersLengths[] =
+{
+    [NUMBERS_VALIDATE] = (1 << 8) | (1 << 12) | (1 << 13) | (1 << 14),
+    [NUMBERS_COMPLETE] = (1 << 7) | (1 << 11) | (1 << 12) | (1 << 13),
+    [NUMBERS_CONVERT]  = (1 << 7) | (1 << 8) | (1 << 12)
+};
+
+/* the state of numberStream(): a chunk of lines, each one right-aligned in
+ * a slot of GTIN_MAX_WIDTH bytes and padded on the left with '0's (which
+ * changes neither the check digit nor, for 7 digits, the meaning of a
+ * UPC-E number), and the output so far */
+typedef struct
+{
+    char slots[GTIN_CHUNK * GTIN_MAX_WIDTH];
+    int lengths[GTIN_CHUNK];
+    int count;
+    NumbersTask task;
+    unsigned long long firstLine; /* 1-based number of the first line */
+    unsigned long long bad;       /* count of bad lines so far */
+    Buffer out;
+}
+NumberStream;
+
+/* convert the numbers in the given stream's chunk between UPC-A and
+ * UPC-E (whichever each one isn't), writing the results (or empty lines
+ * for ones that can't be converted) to the given position, and returning
+ * the position after them */
+char *numberStreamConvert (NumberStream *stream, char *pos)
+{
+    static char compressed[GTIN_CHUNK * 8];
+    static char expanded[GTIN_CHUNK * 12];
+    unsigned char remainders[GTIN_CHUNK];
+    int i;
+
+    /* convert everything both ways, and pick out the right results (the
+     * remainders are just for weeding out non-digits) */
+    gtinRemainders (stream->slots, GTIN_MAX_WIDTH, GTIN_MAX_WIDTH,
+                    stream->count, 1, remainders);
+    upcECompressBulk (stream->slots + GTIN_MAX_WIDTH - 12, GTIN_MAX_WIDTH,
+                      stream->count, compressed, 8);
+    upcEExpandBulk (stream->slots + GTIN_MAX_WIDTH - 8, GTIN_MAX_WIDTH,
+                    stream->count, expanded, 12);
+
+    for (i = 0; i < stream->count; i++)
+    {
+        const char *result = (stream->lengths[i] == 12)
+            ? (compressed + i * 8)
+            : (expanded + i * 12);
+        int length = (stream->lengths[i] == 12) ? 8 : 12;
+
+        if ((remainders[i] == GTIN_NOT_DIGITS) || (result[0] == '\0'))
+        {
+            stream->bad++;
+        }
+        else
+        {
+            memcpy (pos, result, length);
+            pos += length;
+        }
+        *pos = '\n';
+        pos++;
+    }
+
+    return pos;
+}
+
+/* process the lines in the given stream's chunk, appending the output for
+ * them to its buffer, and writing that out; the chunk is left empty */
+void numberStreamFlush (NumberStream *stream)
+{
+    char *pos;
+    int i;
+
+    /* enough for a line number or a converted number, per line */
+    bufferReserve (&stream->out, stream->count * 24);
+    pos = stream->out.buf;
+
+    switch (stream->task)
+    {
+        case NUMBERS_VALIDATE:
+        {
+            int invalid[GTIN_CHUNK];
+            int count = gtinValidate (stream->slots, GTIN_MAX_WIDTH,
+                                      GTIN_MAX_WIDTH, stream->count,
+                                      invalid);
+
+            for (i = 0; i < count; i++)
+            {
+                pos = fragmentNumber (pos, stream->firstLine + invalid[i]);
+                *pos = '\n';
+                pos++;
+            }
+            stream->bad += count;
+            break;
+        }
+        case NUMBERS_COMPLETE:
+        {
+            char checks[GTIN_CHUNK];
+
+            stream->bad += gtinComplete (stream->slots, GTIN_MAX_WIDTH,
+                                         GTIN_MAX_WIDTH, stream->count,
+                                         checks);
+            for (i = 0; i < stream->count; i++)
+            {
+                if (checks[i] != '\0')
+                {
+                    int length = stream->lengths[i];
+                    memcpy (pos,
+                            stream->slots + (i + 1) * GTIN_MAX_WIDTH - length,
+                            length);
+                    pos += length;
+                    *pos = checks[i];
+                    pos++;
+                }
+                *pos = '\n';
+                pos++;
+            }
+            break;
+        }
+        case NUMBERS_CONVERT:
+        {
+            pos = numberStreamConvert (stream, pos);
+            break;
+        }
+    }
+
+    fwrite (stream->out.buf, 1, pos - stream->out.buf, stdout);
+    stream->firstLine += stream->count;
+    stream->count = 0;
+}
+
+/* add the given line (which need not be null-terminated) to the given
+ * stream, flushing it if that fills its chunk; a line of a length that
+ * isn't accepted is stored as a non-digit, so that it gets reported as
+ * bad */
+void numberStreamAdd (NumberStream *stream, const char *line, int length)
+{
+    char *slot = stream->slots + stream->count * GTIN_MAX_WIDTH;
+
+    if ((length > 0) && (line[length - 1] == '\r'))
+    {
+        length--;
+    }
+
+    memset (slot, '0', GTIN_MAX_WIDTH);
+    if ((length <= GTIN_MAX_WIDTH)
+        && ((numbersLengths[stream->task] >> length) & 1))
+    {
+        memcpy (slot + GTIN_MAX_WIDTH - length, line, length);
+    }
+    else
+    {
+        slot[GTIN_MAX_WIDTH - 1] = 'x';
+        length = 0;
+    }
+
+    stream->lengths[stream->count] = length;
+    stream->count++;
+
+    if (stream->count == GTIN_CHUNK)
+    {
+        numberStreamFlush (stream);
+    }
+}
+
+/* read newline-separated numbers from stdin and perform the given task on
+ * them, writing out the results:
+ *
+ *     NUMBERS_VALIDATE: validate them as GTINs (UPC/EAN numbers of 8, 12,
+ *       13, or 14 digits, including the check digit), writing out the
+ *       line numbers of the invalid ones
+ *     NUMBERS_COMPLETE: compute their check digits, writing out each one
+ *       with its check digit appended (or an empty line, if it isn't a
+ *       number of 7, 11, 12, or 13 digits)
+ *     NUMBERS_CONVERT: convert UPC-A numbers (12 digits) to UPC-E and
+ *       UPC-E numbers (7 or 8 digits) to UPC-A, writing out each result
+ *       (or an empty line, if it can't be converted)
+ *
+ * a summary is written to stderr, and this returns the number of bad
+ * lines */
+unsigned long long numberStream (NumbersTask task)
+{
+    static const char *badNames[] =
+    {
+        [NUMBERS_VALIDATE] = "invalid",
+        [NUMBERS_COMPLETE] = "not completed",
+        [NUMBERS_CONVERT]  = "not converted"
+    };
+    static char in[NUMBER_STREAM_BYTES];
+    static NumberStream stream;
+    int have = 0;
+    int skipping = 0;
+    int eof = 0;
+
+    stream.count = 0;
+    stream.task = task;
+    stream.firstLine = 1;
+    stream.bad = 0;
+    bufferInit (&stream.out);
+
+    while (! eof)
+    {
+        char *pos = in;
+        char *end;
+        int amt = read (0, in + have, NUMBER_STREAM_BYTES - have);
+
+        if (amt <= 0)
+        {
+            eof = 1;
+            amt = 0;
+        }
+        end = in + have + amt;
+
+        for (;;)
+        {
+            char *newline = memchr (pos, '\n', end - pos);
+            if (newline == NULL)
+            {
+                break;
+            }
+
+            if (skipping)
+            {
+                /* the rest of an overlong line, already reported */
+                skipping = 0;
+            }
+            else
+            {
+                numberStreamAdd (&stream, pos, newline - pos);
+            }
+            pos = newline + 1;
+        }
+
+        have = end - pos;
+        if (skipping)
+        {
+            have = 0;
+        }
+        else if ((have == NUMBER_STREAM_BYTES) || (eof && (have != 0)))
+        {
+            /* a line that fills the whole buffer is certainly bad, and
+             * the rest of it gets skipped; a final line without a
+             * newline is still a line */
+            numberStreamAdd (&stream, pos, eof ? have : 0);
+            skipping = ! eof;
+            have = 0;
+        }
+        else
+        {
+            memmove (in, pos, have);
+        }
+    }
+
+    numberStreamFlush (&stream);
+    bufferFree (&stream.out);
+    fflush (stdout);
+
+    fprintf (stderr, "%llu numbers, %llu %s\n", stream.firstLine - 1,
+             stream.bad, badNames[task]);
+    return stream.bad;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * xbm integrity checker
+ */
+
+/* the maximum number of threads used to check files */
+#define XBM_CHECK_MAX_THREADS 16
+
+/* the number of files checked (and reported on) at a time */
+#define XBM_CHECK_CHUNK 1024
+
+/* boolean whether xbmFindTrigger() compares a vector of bytes at a time
+ * against the trigger; "--bench xbm" clears it when timing checks */
+static int xbmUseSimd = 1;
+
+/* the text of an XBM file, either mapped or read into memory */
+typedef struct
+{
+    char *data;   /* the text */
+    long length;  /* length of the text */
+    int mapped;   /* boolean whether the text is mapped (vs. malloc()ed) */
+}
+XbmText;
+
+/* load the text of the file open on the given descriptor, mapping it if
+ * possible (that is, if it's a regular file) and otherwise reading it all
+ * in; returns 0 (with errno set) on failure */
+int xbmTextLoad (int fd, XbmText *text)
+{
+    struct stat st;
+    Buffer buf;
+
+    text->data = NULL;
+    text->length = 0;
+    text->mapped = 0;
+
+    if ((fstat (fd, &st) == 0) && S_ISREG (st.st_mode) && (st.st_size > 0))
+    {
+        void *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data != MAP_FAILED)
+        {
+            madvise (data, st.st_size, MADV_SEQUENTIAL);
+            text->data = data;
+            text->length = st.st_size;
+            text->mapped = 1;
+            return 1;
+        }
+    }
+
+    bufferInit (&buf);
+    for (;;)
+    {
+        ssize_t amount;
+
+        bufferReserve (&buf, 65536);
+        amount = read (fd, buf.buf + buf.length, buf.capacity - buf.length);
+        if (amount == 0)
+        {
+            break;
+        }
+        else if (amount < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            bufferFree (&buf);
+            return 0;
+        }
+        buf.length += amount;
+    }
+
+    text->data = buf.buf;
+    text->length = buf.length;
+    return 1;
+}
+
+/* release the given loaded text */
+void xbmTextFree (XbmText *text)
+{
+    if (text->mapped)
+    {
+        munmap (text->data, text->length);
+    }
+    else
+    {
+        free (text->data);
+    }
+
+    text->data = NULL;
+    text->length = 0;
+}
+
+/* return the position of the first byte at or after pos which is either
+ * the given trigger or a '}' (which ends a check), or end if there is
+ * none; the bytes in between don't matter, so the search goes a chunk at
+ * a time */
+const char *xbmFindTrigger (const char *pos, const char *end, int trigger)
+{
+#ifdef __SSE2__
+    if (xbmUseSimd)
+    {
+        __m128i trigger16 = _mm_set1_epi8 ((char) trigger);
+        __m128i brace16 = _mm_set1_epi8 ('}');
+        unsigned int mask;
+
+#ifdef __AVX2__
+        __m256i trigger32 = _mm256_set1_epi8 ((char) trigger);
+        __m256i brace32 = _mm256_set1_epi8 ('}');
+
+        while ((end - pos) >= 32)
+        {
+            __m256i chunk = _mm256_loadu_si256 ((const __m256i *) pos);
+            mask = (unsigned int) _mm256_movemask_epi8 (
+                _mm256_or_si256 (_mm256_cmpeq_epi8 (chunk, trigger32),
+                                 _mm256_cmpeq_epi8 (chunk, brace32)));
+            if (mask != 0)
+            {
+                return pos + __builtin_ctz (mask);
+            }
+            pos += 32;
+        }
+#endif
+
+        while ((end - pos) >= 16)
+        {
+            __m128i chunk = _mm_loadu_si128 ((const __m128i *) pos);
+            mask = _mm_movemask_epi8 (
+                _mm_or_si128 (_mm_cmpeq_epi8 (chunk, trigger16),
+                              _mm_cmpeq_epi8 (chunk, brace16)));
+            if (mask != 0)
+            {
+                return pos + __builtin_ctz (mask);
+            }
+            pos += 16;
+        }
+    }
+#endif
+
+    while ((pos < end) && (*pos != '}') && ((unsigned char) *pos != trigger))
+    {
+        pos++;
+    }
+
+    return pos;
+}
+
+/* check the integrity of the given XBM text; appends the auxiliary data
+ * to the given buffer and returns the check value. Each byte after a run
+ * of triggers is a bit (clear for a space, and set otherwise), and every
+ * 8 of them make a byte of auxiliary data, up to a zero byte or a '}' */
+int xbmIntegrityCheck (const char *data, long length, int mask, Buffer *out)
+{
+    const char *pos = data;
+    const char *end = data + length;
+    int trigger = (mask >> 8) & 0xff;
+    int bits = 0;
+    int bitCount = 0;
+    int val = 0;
+
+    mask &= 0xff;
+
+    for (;;)
+    {
+        pos = xbmFindTrigger (pos, end, trigger);
+        if ((pos == end) || (*pos == '}'))
+        {
+            break;
+        }
+
+        do
+        {
+            pos++;
+        }
+        while ((pos < end) && ((unsigned char) *pos == trigger));
+
+        if ((pos == end) || (*pos == '}'))
+        {
+            break;
+        }
+
+        bits = (bits >> 1) | ((*pos == ' ') ? 0 : 0x80);
+        pos++;
+        bitCount++;
+
+        if (bitCount == 8)
+        {
+            if (bits == 0)
+            {
+                break;
+            }
+
+            bits ^= mask;
+            val ^= bits;
+
+            if ((bits >= 0x20) && (bits <= 0x7e))
+            {
+                char c = bits;
+                bufferAppend (out, &c, 1);
+            }
+
+            bitCount = 0;
+            bits = 0;
+        }
+    }
+
+    return val;
+}
+
+/* the state of a job checking many files */
+typedef struct
+{
+    char **names;    /* names of the files to check */
+    int count;       /* count of files */
+    int mask;        /* mask (and trigger) to check with */
+    int next;        /* index of the next file to claim */
+    Buffer *reports; /* report line for each file */
+    int *failed;     /* boolean for each file whether it couldn't be read */
+}
+XbmCheckJob;
+
+/* check files from the given job until there are none left to claim;
+ * this is run in each of the job's threads */
+void *xbmCheckWorker (void *arg)
+{
+    XbmCheckJob *job = arg;
+
+    for (;;)
+    {
+        int i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED);
+        Buffer *report;
+        XbmText text;
+        int fd;
+        int val;
+
+        if (i >= job->count)
+        {
+            break;
+        }
+
+        report = &job->reports[i];
+        fd = open (job->names[i], O_RDONLY);
+        if ((fd < 0) || ! xbmTextLoad (fd, &text))
+        {
+            bufferPrintf (report, "%s: %s\n", job->names[i],
+                          strerror (errno));
+            job->failed[i] = 1;
+            if (fd >= 0)
+            {
+                close (fd);
+            }
+            continue;
+        }
+        close (fd);
+
+        bufferPrintf (report, "%s: integrity check: ", job->names[i]);
+        val = xbmIntegrityCheck (text.data, text.length, job->mask, report);
+        bufferPrintf (report, " 0x%02x\n", val & 0xff);
+        job->failed[i] = 0;
+        xbmTextFree (&text);
+    }
+
+    return NULL;
+}
+
+/* check the integrity of each of the given files (in parallel, a chunk at
+ * a time), printing a check value line for each, in order; returns the
+ * count of files that couldn't be read */
+int xbmIntegrityFiles (char **names, int count, int mask)
+{
+    pthread_t threads[XBM_CHECK_MAX_THREADS];
+    Buffer reports[XBM_CHECK_CHUNK];
+    int failed[XBM_CHECK_CHUNK];
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    XbmCheckJob job;
+    int bad = 0;
+    int done;
+    int i;
+
+    job.mask = mask;
+    job.reports = reports;
+    job.failed = failed;
+
+    for (done = 0; done < count; done += job.count)
+    {
+        int threadCount;
+        int started;
+
+        job.names = names + done;
+        job.count = count - done;
+        if (job.count > XBM_CHECK_CHUNK)
+        {
+            job.count = XBM_CHECK_CHUNK;
+        }
+        job.next = 0;
+
+        threadCount = job.count;
+        if (threadCount > cpus)
+        {
+            threadCount = cpus;
+        }
+        if (threadCount > XBM_CHECK_MAX_THREADS)
+        {
+            threadCount = XBM_CHECK_MAX_THREADS;
+        }
+
+        for (i = 0; i < job.count; i++)
+        {
+            bufferInit (&reports[i]);
+        }
+
+        /* the calling thread does its share of the work too */
+        for (started = 0; started < (threadCount - 1); started++)
+        {
+            if (pthread_create (&threads[started], NULL, xbmCheckWorker,
+                                &job) != 0)
+            {
+                break;
+            }
+        }
+
+        xbmCheckWorker (&job);
+
+        for (i = 0; i < started; i++)
+        {
+            pthread_join (threads[i], NULL);
+        }
+
+        for (i = 0; i < job.count; i++)
+        {
+            fwrite (reports[i].buf, 1, reports[i].length,
+                    failed[i] ? stderr : stdout);
+            bad += failed[i];
+            bufferFree (&reports[i]);
+        }
+    }
+
+    fflush (stdout);
+    return bad;
+}
+
+/* check the integrity of an XBM file read from stdin; spits out check
+ * value and auxiliary data. */
+void xbmIntegrity (int mask)
+{
+    XbmText text;
+    Buffer report;
+    int val = 0;
+
+    bufferInit (&report);
+
+    if (xbmTextLoad (0, &text))
+    {
+        val = xbmIntegrityCheck (text.data, text.length, mask, &report);
+        xbmTextFree (&text);
+    }
+
+    printf ("integrity check: ");
+    if (report.length != 0)
+    {
+        fwrite (report.buf, 1, report.length, stdout);
+    }
+    printf (" 0x%02x\n", (val & 0xff));
+    bufferFree (&report);
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * password-checking stuff
+ */
+
+/* the state of a SHA-256 hash in progress */
+typedef struct
+{
+    unsigned int h[8];         /* chaining value */
+    unsigned char block[64];   /* input not yet hashed */
+    int blockLength;           /* count of bytes in block */
+    unsigned long long length; /* count of bytes hashed in all */
+}
+Sha256;
+
+/* the SHA-256 round constants */
+static const unsigned int sha256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* rotate the given word right by the given count of bits */
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* start a SHA-256 hash */
+void sha256Init (Sha256 *s)
+{
+    static const unsigned int initial[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy (s->h, initial, sizeof (initial));
+    s->blockLength = 0;
+    s->length = 0;
+}
+
+/* hash one 64-byte block into the given state */
+void sha256Block (Sha256 *s, const unsigned char *block)
+{
+    unsigned int w[64];
+    unsigned int a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    unsigned int e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = ((unsigned int) block[i * 4] << 24)
+            | ((unsigned int) block[i * 4 + 1] << 16)
+            | ((unsigned int) block[i * 4 + 2] << 8)
+            | block[i * 4 + 3];
+    }
+
+    for (; i < 64; i++)
+    {
+        unsigned int s0 = SHA256_ROTR (w[i - 15], 7)
+            ^ SHA256_ROTR (w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = SHA256_ROTR (w[i - 2], 17)
+            ^ SHA256_ROTR (w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    for (i = 0; i < 64; i++)
+    {
+        unsigned int t1 = h
+            + (SHA256_ROTR (e, 6) ^ SHA256_ROTR (e, 11) ^ SHA256_ROTR (e, 25))
+            + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        unsigned int t2 =
+            (SHA256_ROTR (a, 2) ^ SHA256_ROTR (a, 13) ^ SHA256_ROTR (a, 22))
+            + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    s->h[0] += a;
+    s->h[1] += b;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+    s->h[5] += f;
+    s->h[6] += g;
+    s->h[7] += h;
+}
+
+/* add the given bytes to a SHA-256 hash */
+void sha256Update (Sha256 *s, const void *data, int length)
+{
+    const unsigned char *p = data;
+
+    s->length += length;
+    while (length > 0)
+    {
+        int amount = 64 - s->blockLength;
+
+        if (amount > length)
+        {
+            amount = length;
+        }
+
+        memcpy (s->block + s->blockLength, p, amount);
+        s->blockLength += amount;
+        p += amount;
+        length -= amount;
+
+        if (s->blockLength == 64)
+        {
+            sha256Block (s, s->block);
+            s->blockLength = 0;
+        }
+    }
+}
+
+/* finish a SHA-256 hash, storing the 32-byte digest into out */
+void sha256Final (Sha256 *s, unsigned char *out)
+{
+    unsigned long long bits = s->length * 8;
+    unsigned char pad = 0x80;
+    int i;
+
+    sha256Update (s, &pad, 1);
+    pad = 0;
+    while (s->blockLength != 56)
+    {
+        sha256Update (s, &pad, 1);
+    }
+
+    for (i = 7; i >= 0; i--)
+    {
+        s->block[56 + 7 - i] = (unsigned char) (bits >> (i * 8));
+    }
+    sha256Block (s, s->block);
+
+    for (i = 0; i < 32; i++)
+    {
+        out[i] = (unsigned char) (s->h[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+/* an HMAC-SHA256 key, as the hash states just after the inner and outer
+ * padded keys, so that a tag costs only the hashing of the message */
+typedef struct
+{
+    Sha256 inner;
+    Sha256 outer;
+}
+HmacKey;
+
+/* set up the given HMAC-SHA256 key from the given secret */
+void hmacInit (HmacKey *k, const void *secret, int length)
+{
+    unsigned char key[64];
+    unsigned char pad[64];
+    int i;
+
+    memset (key, 0, sizeof (key));
+    if (length > 64)
+    {
+        Sha256 s;
+        sha256Init (&s);
+        sha256Update (&s, secret, length);
+        sha256Final (&s, key);
+    }
+    else
+    {
+        memcpy (key, secret, length);
+    }
+
+    for (i = 0; i < 64; i++)
+    {
+        pad[i] = key[i] ^ 0x36;
+    }
+    sha256Init (&k->inner);
+    sha256Update (&k->inner, pad, 64);
+
+    for (i = 0; i < 64; i++)
+    {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    sha256Init (&k->outer);
+    sha256Update (&k->outer, pad, 64);
+}
+
+/* compute the HMAC-SHA256 tag of the given message under the given key,
+ * storing the 32-byte tag into out */
+void hmacSha256 (const HmacKey *k, const void *data, int length,
+                 unsigned char *out)
+{
+    Sha256 s = k->inner;
+    unsigned char digest[32];
+
+    sha256Update (&s, data, length);
+    sha256Final (&s, digest);
+
+    s = k->outer;
+    sha256Update (&s, digest, 32);
+    sha256Final (&s, out);
+}
+
+/* the count of bytes of the tag that a password keeps, and the length of
+ * the password, which is those bytes in hex */
+#define PASSWORD_TAG_BYTES 8
+#define PASSWORD_LENGTH (PASSWORD_TAG_BYTES * 2)
+
+/* the count of hours that a password is valid for */
+#define PASSWORD_HOURS 3
+
+/* the passwords valid during one hour: the current one, and those of the
+ * hours before it */
+typedef struct
+{
+    long long hour;                                  /* the hour, or -1 */
+    char passwords[PASSWORD_HOURS][PASSWORD_LENGTH]; /* not terminated */
+}
+PasswordWindow;
+
+/* the key that passwords (and signatures) are made with, set up from the
+ * base password the first time it is needed */
+static HmacKey passwordKey;
+static pthread_once_t passwordKeyOnce = PTHREAD_ONCE_INIT;
+
+/* set up the password key (called only through passwordKeyOnce) */
+void passwordKeySetup (void)
+{
+    hmacInit (&passwordKey, password, strlen (password));
+}
+
+/* the passwords for the current hour, double-buffered: they are only
+ * ever recomputed (under the lock) into the window that isn't current,
+ * which is then published, so checking a password takes no lock and no
+ * hashing; a reader of the old window would have to be stalled for a
+ * whole hour for it to be overwritten under it */
+static PasswordWindow passwordWindows[2] = { { .hour = -1 }, { .hour = -1 } };
+static int passwordCurrent = 0;
+static pthread_mutex_t passwordLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* store the password for the given hour into out (which must have room
+ * for PASSWORD_LENGTH characters; it is not terminated); this is the
+ * leading bytes, in hex, of the HMAC tag of the hour (as 8 big-endian
+ * bytes) keyed by the base password; the key must be set up */
+void passwordFor (long long hour, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char message[8];
+    unsigned char tag[32];
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        message[i] = (unsigned char) (hour >> (56 - i * 8));
+    }
+    hmacSha256 (&passwordKey, message, 8, tag);
+
+    for (i = 0; i < PASSWORD_TAG_BYTES; i++)
+    {
+        out[i * 2] = hex[tag[i] >> 4];
+        out[i * 2 + 1] = hex[tag[i] & 0xf];
+    }
+}
+
+/* return the window of passwords valid at the given time, computing them
+ * only if the hour has changed since they were last computed */
+const PasswordWindow *passwordWindow (time_t t)
+{
+    long long hour = t / 3600;
+    PasswordWindow *w =
+        &passwordWindows[__atomic_load_n (&passwordCurrent, __ATOMIC_ACQUIRE)];
+
+    if (w->hour == hour)
+    {
+        return w;
+    }
+
+    pthread_mutex_lock (&passwordLock);
+    w = &passwordWindows[passwordCurrent];
+    if (w->hour != hour)
+    {
+        int next = passwordCurrent ^ 1;
+        int i;
+
+        pthread_once (&passwordKeyOnce, passwordKeySetup);
+        w = &passwordWindows[next];
+        for (i = 0; i < PASSWORD_HOURS; i++)
+        {
+            passwordFor (hour - i, w->passwords[i]);
+        }
+        w->hour = hour;
+        __atomic_store_n (&passwordCurrent, next, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock (&passwordLock);
+
+    return w;
+}
+
+/* print out the password for the current time (called from main for
+ * the --print-password option) */
+void printPassword (void)
+{
+    const PasswordWindow *w = passwordWindow (time (NULL));
+
+    printf ("%.*s\n", PASSWORD_LENGTH, w->passwords[0]);
+}
+
+/* compare the given count of characters of two strings, returning 0 if
+ * they are the same, or else some bits that differ; this takes the same
+ * time however much of them differs, so as not to reveal how close a guess
+ * is to a secret */
+unsigned int secretDiff (const char *a, const char *b, int length)
+{
+    unsigned int diff = 0;
+    int i;
+
+    for (i = 0; i < length; i++)
+    {
+        diff |= (unsigned char) (a[i] ^ b[i]);
+    }
+
+    return diff;
+}
+
+/* verify that the given password is valid; each password lasts for an
+ * hour, and this checks the current and last 2 passwords, so each password
+ * will work for a period of 3 hours; the comparison takes the same time
+ * whether or not (and wherever) the password differs from a valid one */
+int verifyPassword (const char *pass)
+{
+    const PasswordWindow *w = passwordWindow (time (NULL));
+    char given[PASSWORD_LENGTH];
+    unsigned int valid = 0;
+    int length;
+    int i;
+
+    /* a password of the wrong length is compared as if it were padded
+     * (or cut) to the right length, and then rejected */
+    length = strnlen (pass, PASSWORD_LENGTH + 1);
+    memset (given, 0, PASSWORD_LENGTH);
+    memcpy (given, pass,
+            (length < PASSWORD_LENGTH) ? length : PASSWORD_LENGTH);
+
+    for (i = 0; i < PASSWORD_HOURS; i++)
+    {
+        unsigned int diff = secretDiff (given, w->passwords[i],
+                                        PASSWORD_LENGTH);
+        valid |= ((diff - 1) >> 8) & 1;
+    }
+
+    return valid & (length == PASSWORD_LENGTH);
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * HTTP form stuff
+ */
+
+/* the maximum number of key/value pairs accepted in one form submission */
+#define FORM_MAX_PAIRS 64
+
+/* a key/value pair parsed out of form data; both strings point directly
+ * into the (unescaped in place) form buffer, and are null-terminated */
+typedef struct
+{
+    char *key;
+    int keyLength;
+    char *value;
+    int valueLength;
+}
+FormPair;
+
+/* hex digit values, offset by one so that 0 means "not a hex digit" */
+static unsigned char hexDigitTable[256] =
+{
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+    ['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+/* boolean whether formParse() copies runs of plain characters and decodes
+ * runs of escapes 16 bytes at a time; "--bench form" clears it to time the
+ * byte-at-a-time loop */
+static int formUseSimd = 1;
+
+/* decode the "%XX" escape whose two hex digits start at the given pointer;
+ * returns the byte value, or -1 if either digit is bad */
+int formDecodeEscape (const char *hex)
+{
+    int hi = hexDigitTable[(unsigned char) hex[0]];
+    int lo;
+
+    if (hi == 0)
+    {
+        /* checked separately so as not to read past a final '\0' */
+        return -1;
+    }
+
+    lo = hexDigitTable[(unsigned char) hex[1]];
+    return (lo == 0) ? -1 : (((hi - 1) << 4) | (lo - 1));
+}
+
+#ifdef __SSE2__
+
+/* return a bitmask with one bit set for each byte in the given chunk which
+ * is special to form encoding (that is, '&', '=', '%', or '+') */
+static inline unsigned int formSpecialMask16 (__m128i chunk)
+{
+    __m128i special =
+        _mm_or_si128 (
+            _mm_or_si128 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('&')),
+                          _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('='))),
+            _mm_or_si128 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('%')),
+                          _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('+'))));
+
+    return _mm_movemask_epi8 (special);
+}
+
+#endif
+
+#ifdef __AVX2__
+
+/* 32-byte version of formSpecialMask16() */
+static inline unsigned int formSpecialMask32 (__m256i chunk)
+{
+    __m256i special =
+        _mm256_or_si256 (
+            _mm256_or_si256 (
+                _mm256_cmpeq_epi8 (chunk, _mm256_set1_epi8 ('&')),
+                _mm256_cmpeq_epi8 (chunk, _mm256_set1_epi8 ('='))),
+            _mm256_or_si256 (
+                _mm256_cmpeq_epi8 (chunk, _mm256_set1_epi8 ('%')),
+                _mm256_cmpeq_epi8 (chunk, _mm256_set1_epi8 ('+'))));
+
+    return (unsigned int) _mm256_movemask_epi8 (special);
+}
+
+#endif
+
+/* copy the run of bytes starting at *inPtr which need no unescaping to
+ * *outPtr (which is either the same place or earlier in the same buffer),
+ * a chunk at a time, stopping at the first special character or when less
+ * than a chunk remains before end; both pointers are updated */
+void formCopyPlain (char **inPtr, char **outPtr, char *end)
+{
+#ifdef __SSE2__
+    char *in = *inPtr;
+    char *out = *outPtr;
+    unsigned int mask = 0;
+
+#ifdef __AVX2__
+    while ((end - in) >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256 ((__m256i *) in);
+        mask = formSpecialMask32 (chunk);
+        if (mask != 0)
+        {
+            break;
+        }
+
+        if (out != in)
+        {
+            /* safe even when overlapping, since the load came first */
+            _mm256_storeu_si256 ((__m256i *) out, chunk);
+        }
+        in += 32;
+        out += 32;
+    }
+#endif
+
+    while ((mask == 0) && ((end - in) >= 16))
+    {
+        __m128i chunk = _mm_loadu_si128 ((__m128i *) in);
+        mask = formSpecialMask16 (chunk);
+        if (mask != 0)
+        {
+            break;
+        }
+
+        if (out != in)
+        {
+            _mm_storeu_si128 ((__m128i *) out, chunk);
+        }
+        in += 16;
+        out += 16;
+    }
+
+    if (mask != 0)
+    {
+        /* copy the plain prefix of the chunk that stopped the scan */
+        int count = __builtin_ctz (mask);
+        if ((out != in) && (count != 0))
+        {
+            memmove (out, in, count);
+        }
+        in += count;
+        out += count;
+    }
+
+    *inPtr = in;
+    *outPtr = out;
+#endif
+}
+
+/* decode a run of five back-to-back "%XX" escapes (15 bytes, as seen in
+ * escaped UTF-8 text) starting at *inPtr into *outPtr, using a vectorized
+ * nibble lookup; returns 0 (consuming nothing) if there aren't 16 bytes
+ * left before end or the bytes aren't exactly such a run, or 1 (updating
+ * both pointers) if the run was decoded */
+int formDecodeEscapeRun (char **inPtr, char **outPtr, char *end)
+{
+#ifdef __SSE2__
+    /* positions of the '%'s and of the hex digits, respectively */
+    static const unsigned int percentMask = 0x1249;
+    static const unsigned int hexMask = 0x6db6;
+
+    char *in = *inPtr;
+    char *out = *outPtr;
+    __m128i chunk;
+    __m128i lower;
+    __m128i isDigit;
+    __m128i isLetter;
+    __m128i nibbles;
+    unsigned int valid;
+    int i;
+
+    if ((end - in) < 16)
+    {
+        return 0;
+    }
+
+    chunk = _mm_loadu_si128 ((__m128i *) in);
+    if ((_mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('%')))
+         & 0x7fff) != percentMask)
+    {
+        return 0;
+    }
+
+    /* classify every byte as a decimal digit or a (case-folded) hex
+     * letter; the signed compares are fine since hex digits are ASCII */
+    lower = _mm_or_si128 (chunk, _mm_set1_epi8 (0x20));
+    isDigit = _mm_and_si128 (_mm_cmpgt_epi8 (chunk, _mm_set1_epi8 ('0' - 1)),
+                             _mm_cmplt_epi8 (chunk, _mm_set1_epi8 ('9' + 1)));
+    isLetter = _mm_and_si128 (_mm_cmpgt_epi8 (lower, _mm_set1_epi8 ('a' - 1)),
+                              _mm_cmplt_epi8 (lower, _mm_set1_epi8 ('f' + 1)));
+    valid = _mm_movemask_epi8 (_mm_or_si128 (isDigit, isLetter));
+
+    if ((valid & hexMask) != hexMask)
+    {
+        /* let the scalar code report (or handle) it */
+        return 0;
+    }
+
+    /* the nibble value is the low four bits, plus 9 for letters */
+    nibbles = _mm_add_epi8 (_mm_and_si128 (chunk, _mm_set1_epi8 (0x0f)),
+                            _mm_and_si128 (isLetter, _mm_set1_epi8 (9)));
+
+#ifdef __SSSE3__
+    {
+        /* gather each hi/lo nibble pair next to each other, and combine
+         * them as hi * 16 + lo */
+        __m128i pairs = _mm_shuffle_epi8 (
+            nibbles,
+            _mm_setr_epi8 (1, 2, 4, 5, 7, 8, 10, 11, 13, 14,
+                           -1, -1, -1, -1, -1, -1));
+        __m128i words = _mm_maddubs_epi16 (
+            pairs,
+            _mm_setr_epi8 (16, 1, 16, 1, 16, 1, 16, 1, 16, 1,
+                           0, 0, 0, 0, 0, 0));
+        unsigned char bytes[16];
+
+        _mm_storeu_si128 ((__m128i *) bytes, _mm_packus_epi16 (words, words));
+        for (i = 0; i < 5; i++)
+        {
+            out[i] = bytes[i];
+        }
+    }
+#else
+    {
+        unsigned char nibs[16];
+
+        _mm_storeu_si128 ((__m128i *) nibs, nibbles);
+        for (i = 0; i < 5; i++)
+        {
+            out[i] = (nibs[i * 3 + 1] << 4) | nibs[i * 3 + 2];
+        }
+    }
+#endif
+
+    *inPtr = in + 15;
+    *outPtr = out + 5;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* parse the given form-encoded string in a single pass, unescaping it in
+ * place (unescaped text is never longer than its escaped form), and store
+ * views of the key/value pairs into the given array; pairs are separated
+ * by '&', empty pairs are skipped, and a pair with no '=' has an empty
+ * value; this returns the number of pairs found, -1 if there was a bad
+ * "%" escape, or -2 if there were more than maxPairs pairs (nothing is
+ * ever truncated) */
+int formParse (char *form, FormPair *pairs, int maxPairs)
+{
+    char *end = form + strlen (form);
+    char *in = form;
+    char *out = form;
+    char *start = form;
+    FormPair *pair = NULL;
+    int count = 0;
+
+    for (;;)
+    {
+        char c;
+
+        if (formUseSimd && (*in != '%') && (*in != '+'))
+        {
+            /* not obviously at a special character, so try for a run */
+            formCopyPlain (&in, &out, end);
+        }
+
+        c = *in;
+        in++;
+
+        if ((c == '&') || (c == '\0'))
+        {
+            if (pair != NULL)
+            {
+                /* end of a value */
+                *out = '\0';
+                pair->valueLength = out - pair->value;
+                pair = NULL;
+            }
+            else if (out != start)
+            {
+                /* end of a key with no '=' */
+                if (count == maxPairs)
+                {
+                    return -2;
+                }
+                *out = '\0';
+                pair = &pairs[count];
+                pair->key = start;
+                pair->keyLength = out - start;
+                pair->value = out;
+                pair->valueLength = 0;
+                pair = NULL;
+                count++;
+            }
+
+            if (c == '\0')
+            {
+                return count;
+            }
+
+            out = in;
+            start = in;
+            continue;
+        }
+        else if ((c == '=') && (pair == NULL))
+        {
+            /* end of a key */
+            if (count == maxPairs)
+            {
+                return -2;
+            }
+            *out = '\0';
+            pair = &pairs[count];
+            pair->key = start;
+            pair->keyLength = out - start;
+            pair->value = in;
+            count++;
+            out = in;
+            continue;
+        }
+        else if (c == '+')
+        {
+            c = ' ';
+        }
+        else if (c == '%')
+        {
+            int value;
+
+            in--;
+            if (formUseSimd && formDecodeEscapeRun (&in, &out, end))
+            {
+                continue;
+            }
+
+            value = formDecodeEscape (in + 1);
+            if (value < 0)
+            {
+                /* bad character in % sequence */
+                return -1;
+            }
+
+            c = value;
+            in += 3;
+        }
+
+        *out = c;
+        out++;
+    }
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * JSON stuff
+ */
+
+/* skip over any JSON whitespace at the given position */
+char *jsonSkipSpace (char *pos)
+{
+    while ((*pos == ' ') || (*pos == '\t') || (*pos == '\n') || (*pos == '\r'))
+    {
+        pos++;
+    }
+
+    return pos;
+}
+
+/* parse the four hex digits at the given position, returning their value,
+ * or -1 if they aren't all hex digits */
+int jsonParseHex4 (const char *hex)
+{
+    int result = 0;
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        int digit = hexDigitTable[(unsigned char) hex[i]];
+        if (digit == 0)
+        {
+            /* also stops at a '\0' */
+            return -1;
+        }
+        result = (result << 4) | (digit - 1);
+    }
+
+    return result;
+}
+
+/* store the UTF-8 encoding of the given code point at the given position,
+ * returning the position just past it */
+char *utf8Encode (char *out, unsigned int cp)
+{
+    if (cp < 0x80)
+    {
+        *out++ = cp;
+    }
+    else if (cp < 0x800)
+    {
+        *out++ = 0xc0 | (cp >> 6);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+    else if (cp < 0x10000)
+    {
+        *out++ = 0xe0 | (cp >> 12);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+    else
+    {
+        *out++ = 0xf0 | (cp >> 18);
+        *out++ = 0x80 | ((cp >> 12) & 0x3f);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+
+    return out;
+}
+
+/* parse the JSON string literal at *posPtr (which must point at its
+ * opening quote), unescaping it in place (the unescaped form is never
+ * longer), and advance *posPtr past the closing quote; this returns the
+ * start of the null-terminated result, or NULL if the literal is
+ * malformed (including if it contains an escaped null) */
+char *jsonParseString (char **posPtr)
+{
+    char *in = *posPtr;
+    char *out;
+    char *start;
+
+    if (*in != '"')
+    {
+        return NULL;
+    }
+
+    in++;
+    start = in;
+    out = in;
+
+    for (;;)
+    {
+        char c = *in;
+        in++;
+
+        if (c == '"')
+        {
+            break;
+        }
+        else if ((unsigned char) c < 0x20)
+        {
+            /* control characters (including the final '\0') must be
+             * escaped */
+            return NULL;
+        }
+        else if (c == '\\')
+        {
+            c = *in;
+            in++;
+
+            switch (c)
+            {
+                case '"':
+                case '\\':
+                case '/':                break;
+                case 'b':  c = '\b';     break;
+                case 'f':  c = '\f';     break;
+                case 'n':  c = '\n';     break;
+                case 'r':  c = '\r';     break;
+                case 't':  c = '\t';     break;
+                case 'u':
+                {
+                    int cp = jsonParseHex4 (in);
+                    in += 4;
+
+                    if ((cp >= 0xd800) && (cp < 0xdc00))
+                    {
+                        /* high surrogate; must be followed by a low one */
+                        int low = ((in[0] == '\\') && (in[1] == 'u'))
+                            ? jsonParseHex4 (in + 2) : -1;
+
+                        if ((low < 0xdc00) || (low > 0xdfff))
+                        {
+                            return NULL;
+                        }
+
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        in += 6;
+                    }
+                    else if ((cp <= 0) || ((cp >= 0xdc00) && (cp < 0xe000)))
+                    {
+                        /* bad hex, null, or lone low surrogate */
+                        return NULL;
+                    }
+
+                    out = utf8Encode (out, cp);
+                    continue;
+                }
+                default:
+                {
+                    return NULL;
+                }
+            }
+        }
+
+        *out = c;
+        out++;
+    }
+
+    *out = '\0';
+    *posPtr = in;
+    return start;
+}
+
+/* parse the JSON array of strings at *posPtr in place, storing pointers to
+ * the (null-terminated) strings in the given array, and advance *posPtr
+ * past it; returns the number of strings, -1 if the array is malformed,
+ * or -2 if there are more than maxStrings strings */
+int jsonParseStringArrayAt (char **posPtr, char **strings, int maxStrings)
+{
+    char *pos = jsonSkipSpace (*posPtr);
+    int count = 0;
+
+    if (*pos != '[')
+    {
+        return -1;
+    }
+
+    pos = jsonSkipSpace (pos + 1);
+    if (*pos == ']')
+    {
+        pos++;
+    }
+    else
+    {
+        for (;;)
+        {
+            if (count == maxStrings)
+            {
+                return -2;
+            }
+
+            strings[count] = jsonParseString (&pos);
+            if (strings[count] == NULL)
+            {
+                return -1;
+            }
+            count++;
+
+            pos = jsonSkipSpace (pos);
+            if (*pos == ']')
+            {
+                pos++;
+                break;
+            }
+            else if (*pos != ',')
+            {
+                return -1;
+            }
+
+            pos = jsonSkipSpace (pos + 1);
+        }
+    }
+
+    *posPtr = pos;
+    return count;
+}
+
+/* parse the given JSON text, which must be just an array of strings (see
+ * jsonParseStringArrayAt()) */
+int jsonParseStringArray (char *json, char **strings, int maxStrings)
+{
+    int count = jsonParseStringArrayAt (&json, strings, maxStrings);
+
+    if ((count >= 0) && (*jsonSkipSpace (json) != '\0'))
+    {
+        return -1;
+    }
+
+    return count;
+}
+
+/* ----------------------------------------------------------------------------
+ * xbm reading
+ */
+
+/* the largest width or height accepted by xbmParse() */
+#define XBM_MAX_DIMENSION 65536
+
+/* the number of bytes of text that make up each entry of the bits array,
+ * in the usual layout (e.g. "0x3f, "), as written by bitmapWriteXbm() */
+#define XBM_ENTRY_BYTES 6
+
+/* boolean whether xbmParse() decodes "0xNN, " entries two at a time with
+ * SSE2 instead of one by one; "--bench xbm" clears it when timing reads */
+static int xbmReadUseSimd = 1;
+
+/* return the position just past any whitespace and C comments at or
+ * after pos, but not past end */
+const char *xbmSkipSpace (const char *pos, const char *end)
+{
+    while (pos < end)
+    {
+        if (isspace ((unsigned char) *pos))
+        {
+            pos++;
+        }
+        else if (((end - pos) >= 2) && (pos[0] == '/') && (pos[1] == '*'))
+        {
+            pos += 2;
+            while (((end - pos) >= 2) && ! ((pos[0] == '*') && (pos[1] == '/')))
+            {
+                pos++;
+            }
+            pos = ((end - pos) >= 2) ? (pos + 2) : end;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return pos;
+}
+
+/* return the position of the end of the line containing pos (that is, of
+ * its newline), or end if there is none */
+const char *xbmLineEnd (const char *pos, const char *end)
+{
+    const char *nl = memchr (pos, '\n', end - pos);
+    return (nl == NULL) ? end : nl;
+}
+
+/* return boolean whether the given string appears in the given range */
+int xbmContains (const char *pos, const char *end, const char *str)
+{
+    int length = strlen (str);
+
+    while ((end - pos) >= length)
+    {
+        if (memcmp (pos, str, length) == 0)
+        {
+            return 1;
+        }
+        pos++;
+    }
+
+    return 0;
+}
+
+/* parse a "#define NAME VALUE" line (from just after the "#define") for
+ * the image's width or height, storing the value into *width or *height
+ * according to the suffix of the name; other defines (e.g. of the hot
+ * spot) are ignored; returns 0 if it's malformed */
+int xbmParseDefine (const char *pos, const char *end, int *width,
+                    int *height)
+{
+    const char *name;
+    int *target = NULL;
+    long value = 0;
+
+    while ((pos < end) && ((*pos == ' ') || (*pos == '\t')))
+    {
+        pos++;
+    }
+
+    name = pos;
+    while ((pos < end) && (isalnum ((unsigned char) *pos) || (*pos == '_')))
+    {
+        pos++;
+    }
+
+    if (((pos - name) >= 6) && (memcmp (pos - 6, "_width", 6) == 0))
+    {
+        target = width;
+    }
+    else if (((pos - name) >= 7) && (memcmp (pos - 7, "_height", 7) == 0))
+    {
+        target = height;
+    }
+    else
+    {
+        return 1;
+    }
+
+    while ((pos < end) && ((*pos == ' ') || (*pos == '\t')))
+    {
+        pos++;
+    }
+
+    if ((pos == end) || ! isdigit ((unsigned char) *pos))
+    {
+        return 0;
+    }
+
+    while ((pos < end) && isdigit ((unsigned char) *pos))
+    {
+        value = value * 10 + (*pos - '0');
+        if (value > XBM_MAX_DIMENSION)
+        {
+            return 0;
+        }
+        pos++;
+    }
+
+    *target = value;
+    return 1;
+}
+
+/* parse one entry of the bits array at *posPtr, which must be a hex
+ * number of one or two digits (e.g. "0x3f"), followed by a comma (or, for
+ * the last one, optionally not); returns the byte value and updates
+ * *posPtr to point at the next entry, or returns -1 if the entry is
+ * malformed */
+int xbmParseEntry (const char **posPtr, const char *end)
+{
+    const char *pos = xbmSkipSpace (*posPtr, end);
+    int value = 0;
+    int digits = 0;
+
+    if (((end - pos) < 3) || (pos[0] != '0') || ((pos[1] | 0x20) != 'x'))
+    {
+        return -1;
+    }
+    pos += 2;
+
+    while ((pos < end) && (hexDigitTable[(unsigned char) *pos] != 0))
+    {
+        if (digits == 2)
+        {
+            /* too big for a byte (e.g. an X10-style short) */
+            return -1;
+        }
+        value = (value << 4) | (hexDigitTable[(unsigned char) *pos] - 1);
+        digits++;
+        pos++;
+    }
+
+    if (digits == 0)
+    {
+        return -1;
+    }
+
+    pos = xbmSkipSpace (pos, end);
+    if ((pos < end) && (*pos == ','))
+    {
+        /* skip to the next entry, where the vectorized path can pick up */
+        pos = xbmSkipSpace (pos + 1, end);
+    }
+    else if ((pos == end) || (*pos != '}'))
+    {
+        return -1;
+    }
+
+    *posPtr = pos;
+    return value;
+}
+
+#ifdef __SSE2__
+
+/* decode the entries of the bits array at *posPtr into *outPtr, two at a
+ * time, for as long as they are laid out in the usual way (see
+ * XBM_ENTRY_BYTES), with each one followed by either ", " or " ,"; stops
+ * (leaving the rest to the scalar code) at anything else, such as the end
+ * of a line, when less than a chunk remains before end, or when count
+ * entries are left; both pointers are updated */
+void xbmDecodeEntries (const char **posPtr, unsigned char **outPtr,
+                       const char *end, long count)
+{
+    /* the template of two entries, and the start of a third: "0x" where
+     * it must be, and the separators (and hex digits) zeroed out */
+    const __m128i layout =
+        _mm_setr_epi8 ('0', 'x', 0, 0, 0, 0, '0', 'x', 0, 0, 0, 0,
+                       '0', 'x', 0, 0);
+    const __m128i fixed =
+        _mm_setr_epi8 (-1, -1, 0, 0, 0, 0, -1, -1, 0, 0, 0, 0,
+                       -1, -1, 0, 0);
+    const __m128i hexes =
+        _mm_setr_epi8 (0, 0, -1, -1, 0, 0, 0, 0, -1, -1, 0, 0,
+                       0, 0, 0, 0);
+    const __m128i seps =
+        _mm_setr_epi8 (0, 0, 0, 0, -1, -1, 0, 0, 0, 0, -1, -1,
+                       0, 0, 0, 0);
+    const char *pos = *posPtr;
+    unsigned char *out = *outPtr;
+
+    while ((count >= 2) && ((end - pos) >= 16))
+    {
+        __m128i chunk = _mm_loadu_si128 ((const __m128i *) pos);
+        __m128i lower = _mm_or_si128 (chunk, _mm_set1_epi8 (0x20));
+        __m128i isDigit =
+            _mm_and_si128 (_mm_cmpgt_epi8 (chunk, _mm_set1_epi8 ('0' - 1)),
+                           _mm_cmplt_epi8 (chunk, _mm_set1_epi8 ('9' + 1)));
+        __m128i isLetter =
+            _mm_and_si128 (_mm_cmpgt_epi8 (lower, _mm_set1_epi8 ('a' - 1)),
+                           _mm_cmplt_epi8 (lower, _mm_set1_epi8 ('f' + 1)));
+        __m128i isSep =
+            _mm_or_si128 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 (',')),
+                          _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 (' ')));
+        __m128i isComma = _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 (','));
+        __m128i ok =
+            _mm_and_si128 (
+                _mm_or_si128 (_mm_andnot_si128 (fixed, _mm_set1_epi8 (-1)),
+                              _mm_cmpeq_epi8 (chunk, layout)),
+                _mm_and_si128 (
+                    _mm_or_si128 (_mm_andnot_si128 (hexes,
+                                                    _mm_set1_epi8 (-1)),
+                                  _mm_or_si128 (isDigit, isLetter)),
+                    _mm_or_si128 (_mm_andnot_si128 (seps,
+                                                    _mm_set1_epi8 (-1)),
+                                  isSep)));
+        unsigned int commas =
+            _mm_movemask_epi8 (_mm_and_si128 (isComma, seps));
+        __m128i values;
+
+        /* each entry's separator must have exactly one comma */
+        if ((_mm_movemask_epi8 (ok) != 0xffff)
+            || (__builtin_popcount (commas & 0x30) != 1)
+            || (__builtin_popcount (commas & 0xc00) != 1))
+        {
+            break;
+        }
+
+        /* a digit's value is its low nybble, plus 9 for a letter */
+        values = _mm_add_epi8 (_mm_and_si128 (chunk, _mm_set1_epi8 (0x0f)),
+                               _mm_and_si128 (isLetter, _mm_set1_epi8 (9)));
+        values = _mm_and_si128 (values, hexes);
+        values = _mm_or_si128 (_mm_slli_epi16 (values, 4),
+                               _mm_srli_epi16 (values, 8));
+        out[0] = _mm_extract_epi16 (values, 1);
+        out[1] = _mm_extract_epi16 (values, 4);
+
+        pos += XBM_ENTRY_BYTES * 2;
+        out += 2;
+        count -= 2;
+    }
+
+    *posPtr = pos;
+    *outPtr = out;
+}
+
+#endif
+
+/* parse the given XBM text into a new bitmap; the text need not be
+ * null-terminated (so it may be mapped from a file), and is read in a
+ * single pass; returns NULL (storing a description of the problem into
+ * *reason) if the text is malformed */
+Bitmap *xbmParse (const char *data, long length, const char **reason)
+{
+    const char *pos = data;
+    const char *end = data + length;
+    int width = -1;
+    int height = -1;
+    Bitmap *result;
+    unsigned char *out;
+    long count;
+
+    /* the defines of the width and height, up to the declaration */
+    for (;;)
+    {
+        const char *lineEnd;
+
+        pos = xbmSkipSpace (pos, end);
+        if (pos == end)
+        {
+            *reason = "no bits array";
+            return NULL;
+        }
+        else if (*pos != '#')
+        {
+            break;
+        }
+
+        lineEnd = xbmLineEnd (pos, end);
+        if (((lineEnd - pos) < 7) || (memcmp (pos, "#define", 7) != 0)
+            || ! xbmParseDefine (pos + 7, lineEnd, &width, &height))
+        {
+            *reason = "bad #define";
+            return NULL;
+        }
+        pos = lineEnd;
+    }
+
+    if ((width <= 0) || (height <= 0))
+    {
+        *reason = "missing or zero width or height";
+        return NULL;
+    }
+
+    /* the declaration, which must be of chars (not X10-style shorts) */
+    {
+        const char *brace = memchr (pos, '{', end - pos);
+        const char *bits;
+
+        if (brace == NULL)
+        {
+            *reason = "no bits array";
+            return NULL;
+        }
+
+        bits = memchr (pos, '[', brace - pos);
+        if ((bits == NULL) || ! xbmContains (pos, bits, "char"))
+        {
+            *reason = "bits array isn't of char";
+            return NULL;
+        }
+
+        pos = brace + 1;
+    }
+
+    /* at least 3 bytes of text per entry, so this can't be fooled into
+     * allocating much more than the text itself */
+    count = (long) ((width + 7) >> 3) * height;
+    if (count > ((end - pos) / 3))
+    {
+        *reason = "too few bits";
+        return NULL;
+    }
+
+    result = makeBitmap (width, height);
+    out = result->buf;
+
+    while (count > 0)
+    {
+        int value;
+
+#ifdef __SSE2__
+        if (xbmReadUseSimd)
+        {
+            unsigned char *start = out;
+            xbmDecodeEntries (&pos, &out, end, count);
+            count -= out - start;
+            if (count == 0)
+            {
+                break;
+            }
+        }
+#endif
+
+        value = xbmParseEntry (&pos, end);
+        if (value < 0)
+        {
+            *reason = "bad entry in bits array";
+            bitmapFree (result);
+            return NULL;
+        }
+
+        *out = value;
+        out++;
+        count--;
+    }
+
+    pos = xbmSkipSpace (pos, end);
+    if ((pos == end) || (*pos != '}'))
+    {
+        *reason = "too many bits";
+        bitmapFree (result);
+        return NULL;
+    }
+
+    return result;
+}
+
+/* read the named XBM file into a new bitmap; returns NULL (storing a
+ * description of the problem into *reason) if it can't be read or is
+ * malformed */
+Bitmap *xbmRead (const char *name, const char **reason)
+{
+    XbmText text;
+    Bitmap *result;
+    int fd = open (name, O_RDONLY);
+
+    if ((fd < 0) || ! xbmTextLoad (fd, &text))
+    {
+        *reason = strerror (errno);
+        if (fd >= 0)
+        {
+            close (fd);
+        }
+        return NULL;
+    }
+    close (fd);
+
+    result = xbmParse (text.data, text.length, reason);
+    xbmTextFree (&text);
+    return result;
+}
+
+/* replace the 5x8 font with the one in the named XBM file, which must be
+ * laid out the same way (one 8-pixel-wide column of 128 characters);
+ * returns 0 (storing a description of the problem into *reason) if it
+ * can't be */
+int fontLoad (const char *name, const char **reason)
+{
+    Bitmap *b = xbmRead (name, reason);
+
+    if (b == NULL)
+    {
+        return 0;
+    }
+    else if ((b->width != font5x8.width) || (b->height != font5x8.height))
+    {
+        *reason = "font isn't 8x1024";
+        bitmapFree (b);
+        return 0;
+    }
+
+    memcpy (font5x8Buf, b->buf, sizeof (font5x8Buf));
+    bitmapFree (b);
+    return 1;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * CGI request ingestion
+ */
+
+/* the maximum size of form data accepted from a CGI request, either as
+ * the query string or as a POST body */
+#define FORM_MAX_BYTES 65536
+
+/* the one buffer that CGI form data is read into, with room for a
+ * terminating null */
+static char formBuffer[FORM_MAX_BYTES + 1];
+
+/* reply to a CGI request with the given rejection (see rejectResponse()),
+ * and exit; this is used to reject requests before doing any work on
+ * them */
+void cgiReject (HeaderId header, const char *reason)
+{
+    Response r;
+
+    responseInit (&r);
+    rejectResponse (&r, header, reason);
+    responseWrite (&r, 1, RESPONSE_CGI, 0);
+    exit (0);
+}
+
+/* read exactly the given number of bytes from stdin into the given buffer;
+ * returns 0 if the input ended early or there was an error */
+int readFully (char *buf, int length)
+{
+    while (length > 0)
+    {
+        ssize_t amt = read (0, buf, length);
+
+        if (amt > 0)
+        {
+            buf += amt;
+            length -= amt;
+        }
+        else if ((amt == 0) || (errno != EINTR))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* return whether the given content type header value names the given
+ * media type (ignoring any parameters) */
+int isContentType (const char *header, const char *type)
+{
+    int length = strlen (type);
+
+    return (header != NULL)
+        && (strncasecmp (header, type, length) == 0)
+        && ((header[length] == '\0') || (header[length] == ';'));
+}
+
+/* check whether a request with the given method, content type, and
+ * content length (each null if absent) is acceptable, without looking at
+ * its data; if so, return 1, with *isJson set to indicate whether the data
+ * is a JSON request object (as opposed to form data), and *length set to
+ * the length of the body (0 for requests without one); if not, return 0,
+ * with *header and *reason set to the rejection to send (see
+ * rejectResponse()) */
+int requestCheck (const char *method, const char *type, const char *lengthStr,
+                  int *isJson, int *length, HeaderId *header,
+                  const char **reason)
+{
+    char *lengthEnd;
+    long amt;
+
+    *isJson = 0;
+    *length = 0;
+
+    if ((method == NULL)
+        || (strcmp (method, "GET") == 0)
+        || (strcmp (method, "HEAD") == 0))
+    {
+        return 1;
+    }
+
+    if (strcmp (method, "POST") != 0)
+    {
+        *header = HEADER_TEXT_405;
+        *reason = "Only GET, HEAD, and POST are supported.";
+        return 0;
+    }
+
+    if (isContentType (type, "application/json"))
+    {
+        *isJson = 1;
+    }
+    else if (! isContentType (type, "application/x-www-form-urlencoded"))
+    {
+        *header = HEADER_TEXT_415;
+        *reason = "POST bodies must be form-encoded or JSON.";
+        return 0;
+    }
+
+    if ((lengthStr == NULL) || (*lengthStr == '\0'))
+    {
+        *header = HEADER_TEXT_411;
+        *reason = "POST bodies must have a length.";
+        return 0;
+    }
+
+    amt = strtol (lengthStr, &lengthEnd, 10);
+    if ((*lengthEnd != '\0') || (amt < 0))
+    {
+        *header = HEADER_TEXT_400;
+        *reason = "The content length is invalid.";
+        return 0;
+    }
+    else if (amt > FORM_MAX_BYTES)
+    {
+        *header = HEADER_TEXT_413;
+        *reason = "The POST body is too large.";
+        return 0;
+    }
+
+    *length = amt;
+    return 1;
+}
+
+/* return whether the CGI request is a HEAD request, whose response
+ * consists of just the header */
+int cgiIsHead (void)
+{
+    char *method = getenv ("REQUEST_METHOD");
+
+    return (method != NULL) && (strcmp (method, "HEAD") == 0);
+}
+
+/* get the data of the CGI request described by the environment (per RFC
+ * 3875), from either QUERY_STRING or a POST body on stdin, into
+ * formBuffer; returns the null-terminated data, and sets *isJson to
+ * indicate whether it is a JSON request object (as opposed to form
+ * data); oversized or otherwise unacceptable requests are rejected (see
+ * cgiReject()) before anything is read */
+char *cgiReadRequest (int *isJson)
+{
+    char *method = getenv ("REQUEST_METHOD");
+    int length;
+    HeaderId header;
+    const char *reason;
+
+    if (! requestCheck (method, getenv ("CONTENT_TYPE"),
+                        getenv ("CONTENT_LENGTH"),
+                        isJson, &length, &header, &reason))
+    {
+        cgiReject (header, reason);
+    }
+
+    if ((method == NULL) || (strcmp (method, "POST") != 0))
+    {
+        char *query = getenv ("QUERY_STRING");
+
+        if (query == NULL)
+        {
+            query = "";
+        }
+
+        if (strlen (query) > FORM_MAX_BYTES)
+        {
+            cgiReject (HEADER_TEXT_414, "The query string is too long.");
+        }
+
+        strcpy (formBuffer, query);
+    }
+    else
+    {
+        if (! readFully (formBuffer, length))
+        {
+            cgiReject (HEADER_TEXT_400, "The POST body was cut short.");
+        }
+        formBuffer[length] = '\0';
+    }
+
+    return formBuffer;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * keyword recognition
+ */
+
+/* all the words recognized as form keys, mode names, and (without the
+ * leading "--") commandline options */
+typedef enum
+{
+    KW_NONE,
+    KW_PASSWORD, KW_VALUE, KW_MODE,
+    KW_UPCEAN, KW_UPCEAN_SHORT, KW_UPCE, KW_UPCE_SHORT, KW_EAN8,
+    KW_EAN8_SHORT, KW_TEXT,
+    KW_REQUIRE_PASSWORD, KW_HTTP_HEADER, KW_CHECK, KW_PRINT_PASSWORD,
+    KW_FORM_DATA, KW_BENCH, KW_CGI,
+    KW_VALUES, KW_LAYOUT, KW_MULTIPART, KW_SPRITE,
+    KW_FORMAT, KW_JSON, KW_XBM, KW_JSON_DATA,
+    KW_OUTPUT, KW_IMAGE, KW_MODULES, KW_SIZE, KW_HEAD, KW_SERVE,
+    KW_VALIDATE, KW_COMPLETE, KW_CONVERT, KW_ISBN, KW_ISBN_SHORT,
+    KW_CATALOG, KW_SIG, KW_EXP, KW_SIGN, KW_RATE_LIMIT, KW_FONT,
+    KW_VERIFY, KW_LOAD, KW_RATE, KW_CONNECTIONS, KW_DURATION, KW_METRICS,
+    KW_TRACE, KW_TRACE_SAMPLE
+}
+Keyword;
+
+/* flags of a keyword, for its use as a commandline option: whether it
+ * takes a value (and requires one), and whether that value must be a
+ * positive number (which implies the former) */
+#define KEYWORD_VALUE 1
+#define KEYWORD_NUMBER 3
+
+/* an entry in the keyword table */
+typedef struct
+{
+    const char *name;
+    int length;
+    Keyword keyword;
+    int flags;           /* KEYWORD_* flags */
+}
+KeywordEntry;
+
+/* parameters of the keyword hash, which is perfect: under this seed,
+ * every keyword lands in a different slot of the table; the seed, the
+ * table size, and the table below are all generated by the script
+ * make-keyword-table (next to this file), which is to be run after adding
+ * a keyword (with its entry put anywhere in the table), and whose --check
+ * option tells whether the table is as it would make it */
+#define KEYWORD_HASH_SEED 0x11e
+#define KEYWORD_TABLE_BITS 8
+
+/* the keyword table, indexed by hash */
+static KeywordEntry keywordTable[1 << KEYWORD_TABLE_BITS] =
+{
+    [6]   = { "format",           6,  KW_FORMAT,           0 },
+    [7]   = { "image",            5,  KW_IMAGE,            0 },
+    [8]   = { "values",           6,  KW_VALUES,           0 },
+    [14]  = { "form-data",        9,  KW_FORM_DATA,        0 },
+    [15]  = { "upce-short",       10, KW_UPCE_SHORT,       0 },
+    [18]  = { "value",            5,  KW_VALUE,            0 },
+    [19]  = { "sprite",           6,  KW_SPRITE,           0 },
+    [20]  = { "complete",         8,  KW_COMPLETE,         0 },
+    [21]  = { "metrics",          7,  KW_METRICS,          KEYWORD_VALUE },
+    [22]  = { "duration",         8,  KW_DURATION,         KEYWORD_NUMBER },
+    [25]  = { "isbn-short",       10, KW_ISBN_SHORT,       0 },
+    [35]  = { "connections",      11, KW_CONNECTIONS,      KEYWORD_NUMBER },
+    [39]  = { "bench",            5,  KW_BENCH,            0 },
+    [49]  = { "require-password", 16, KW_REQUIRE_PASSWORD, 0 },
+    [68]  = { "layout",           6,  KW_LAYOUT,           0 },
+    [70]  = { "isbn",             4,  KW_ISBN,             0 },
+    [85]  = { "upcean",           6,  KW_UPCEAN,           0 },
+    [99]  = { "multipart",        9,  KW_MULTIPART,        0 },
+    [101] = { "json",             4,  KW_JSON,             0 },
+    [102] = { "json-data",        9,  KW_JSON_DATA,        0 },
+    [106] = { "serve",            5,  KW_SERVE,            KEYWORD_VALUE },
+    [123] = { "cgi",              3,  KW_CGI,              0 },
+    [124] = { "modules",          7,  KW_MODULES,          0 },
+    [126] = { "rate",             4,  KW_RATE,             KEYWORD_NUMBER },
+    [137] = { "http-header",      11, KW_HTTP_HEADER,      0 },
+    [139] = { "ean8",             4,  KW_EAN8,             0 },
+    [146] = { "password",         8,  KW_PASSWORD,         0 },
+    [151] = { "verify",           6,  KW_VERIFY,           0 },
+    [154] = { "convert",          7,  KW_CONVERT,          0 },
+    [163] = { "ean8-short",       10, KW_EAN8_SHORT,       0 },
+    [164] = { "font",             4,  KW_FONT,             KEYWORD_VALUE },
+    [165] = { "trace-sample",     12, KW_TRACE_SAMPLE,     KEYWORD_NUMBER },
+    [166] = { "size",             4,  KW_SIZE,             0 },
+    [172] = { "check",            5,  KW_CHECK,            0 },
+    [177] = { "sign",             4,  KW_SIGN,             KEYWORD_NUMBER },
+    [183] = { "validate",         8,  KW_VALIDATE,         0 },
+    [186] = { "rate-limit",       10, KW_RATE_LIMIT,       KEYWORD_NUMBER },
+    [192] = { "exp",              3,  KW_EXP,              0 },
+    [199] = { "mode",             4,  KW_MODE,             KEYWORD_VALUE },
+    [205] = { "trace",            5,  KW_TRACE,            KEYWORD_NUMBER },
+    [214] = { "catalog",          7,  KW_CATALOG,          0 },
+    [216] = { "xbm",              3,  KW_XBM,              0 },
+    [218] = { "output",           6,  KW_OUTPUT,           KEYWORD_VALUE },
+    [220] = { "sig",              3,  KW_SIG,              0 },
+    [221] = { "upce",             4,  KW_UPCE,             0 },
+    [223] = { "upcean-short",     12, KW_UPCEAN_SHORT,     0 },
+    [232] = { "text",             4,  KW_TEXT,             0 },
+    [237] = { "print-password",   14, KW_PRINT_PASSWORD,   0 },
+    [243] = { "head",             4,  KW_HEAD,             0 },
+    [251] = { "load",             4,  KW_LOAD,             KEYWORD_VALUE }
+};
+
+/* hash the given string (FNV-1a, with a custom basis) into a keyword table
+ * index */
+unsigned int keywordHash (const char *str, int length)
+{
+    unsigned int hash = KEYWORD_HASH_SEED;
+
+    while (length > 0)
+    {
+        hash = (hash ^ (unsigned char) *str) * 0x01000193;
+        str++;
+        length--;
+    }
+
+    return hash >> (32 - KEYWORD_TABLE_BITS);
+}
+
+/* look up the given string (which need not be null-terminated), returning
+ * its entry in the keyword table, or NULL if it isn't a keyword */
+KeywordEntry *keywordEntry (const char *str, int length)
+{
+    KeywordEntry *entry = &keywordTable[keywordHash (str, length)];
+
+    if ((entry->name != NULL) && (entry->length == length)
+        && (memcmp (entry->name, str, length) == 0))
+    {
+        return entry;
+    }
+
+    return NULL;
+}
+
+/* look up the given string (which need not be null-terminated), returning
+ * its keyword, or KW_NONE if it isn't one */
+Keyword keywordLookup (const char *str, int length)
+{
+    KeywordEntry *entry = keywordEntry (str, length);
+
+    return (entry == NULL) ? KW_NONE : entry->keyword;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * benchmarks
+ */
+
+/* return a monotonic timestamp, in nanoseconds */
+long long nowNanos (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* append count copies of the given string to the given buffer, which must
+ * have enough room */
+void benchRepeat (char *buf, const char *str, int count)
+{
+    buf += strlen (buf);
+    while (count > 0)
+    {
+        strcpy (buf, str);
+        buf += strlen (str);
+        count--;
+    }
+}
+
+/* time formParse() over a set of realistic query strings, with and without
+ * the vectorized paths */
+void benchForm (void)
+{
+    static char longText[8000];
+    static char utf8Text[8000];
+    static char scratch[8000];
+
+    char *names[] = {
+        "upcean", "supplement", "text-long", "text-utf8"
+    };
+    char *forms[] = {
+        "value=63447948954%3F&mode=upcean",
+        "password=31337&value=9780201379624%2C51295%3Awww.milk.com"
+            "&mode=upcean-short",
+        longText,
+        utf8Text
+    };
+    int formCount = sizeof (forms) / sizeof (char *);
+    FormPair pairs[FORM_MAX_PAIRS];
+    int i;
+    int simd;
+
+    strcpy (longText, "mode=text&value=");
+    benchRepeat (longText,
+                 "Enjoy+milk%27s+many+splendors%0Aat+www.milk.com%21%0A"
+                 "The+quick+brown+fox+jumps+over+the+lazy+dog.%0A",
+                 60);
+    strcpy (utf8Text, "mode=text&value=");
+    benchRepeat (utf8Text, "%E7%89%9B%E4%B9%B3%E3%81%A7%E3%81%99+", 150);
+
+    for (simd = 1; simd >= 0; simd--)
+    {
+        formUseSimd = simd;
+        for (i = 0; i < formCount; i++)
+        {
+            int len = strlen (forms[i]);
+            int iters = 20000000 / (len + 16);
+            long long start;
+            long long elapsed;
+            int n;
+
+            start = nowNanos ();
+            for (n = 0; n < iters; n++)
+            {
+                memcpy (scratch, forms[i], len + 1);
+                formParse (scratch, pairs, FORM_MAX_PAIRS);
+            }
+            elapsed = nowNanos () - start;
+
+            printf ("form %-6s %-10s %6d bytes %10.1f ns/op %8.1f MB/s\n",
+                    simd ? "simd" : "scalar", names[i], len,
+                    (double) elapsed / iters,
+                    (double) len * iters * 1000.0 / elapsed);
+        }
+    }
+
+    formUseSimd = 1;
+}
+
+/* time gtinValidate() and gtinComplete() over a file's worth of
+ * newline-separated EAN-13 numbers, with and without the vectorized
+ * paths */
+void benchCheck (void)
+{
+    enum { COUNT = 1 << 20, STRIDE = 14 };
+    char *data = malloc ((long) COUNT * STRIDE);
+    int *invalid = malloc (COUNT * sizeof (int));
+    char *checks = malloc (COUNT);
+    unsigned int seed = 12345;
+    int i;
+    int simd;
+
+    for (i = 0; i < COUNT; i++)
+    {
+        char *str = data + (long) i * STRIDE;
+        int j;
+
+        for (j = 0; j < 12; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            str[j] = '0' + ((seed >> 16) % 10);
+        }
+        str[12] = upcEanCheckDigit (str, 12);
+        if ((i % 1000) == 999)
+        {
+            /* a sprinkling of bad ones */
+            str[12] = (str[12] == '9') ? '0' : (str[12] + 1);
+        }
+        str[13] = '\n';
+    }
+
+    for (simd = 1; simd >= 0; simd--)
+    {
+        int iters = simd ? 20 : 5;
+        long long start;
+        long long elapsed;
+        int found = 0;
+        int n;
+
+        gtinUseSimd = simd;
+
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            found = gtinValidate (data, 13, STRIDE, COUNT, invalid);
+        }
+        elapsed = nowNanos () - start;
+        printf ("check %-6s %-10s %8d found %8.2f ns/op %8.1f M/s\n",
+                simd ? "simd" : "scalar", "validate", found,
+                (double) elapsed / iters / COUNT,
+                (double) COUNT * iters * 1000.0 / elapsed);
+
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            found = gtinComplete (data, 12, STRIDE, COUNT, checks);
+        }
+        elapsed = nowNanos () - start;
+        printf ("check %-6s %-10s %8d bad   %8.2f ns/op %8.1f M/s\n",
+                simd ? "simd" : "scalar", "complete", found,
+                (double) elapsed / iters / COUNT,
+                (double) COUNT * iters * 1000.0 / elapsed);
+    }
+
+    gtinUseSimd = 1;
+    free (data);
+    free (invalid);
+    free (checks);
+}
+
+/* time upcECompressBulk() and upcEExpandBulk() over a file's worth of
+ * newline-separated numbers (half of them compressible), with and without
+ * the vectorized paths */
+void benchUpcE (void)
+{
+    enum { COUNT = 1 << 20 };
+    char *upcA = malloc ((long) COUNT * 13);
+    char *upcE = malloc ((long) COUNT * 9);
+    char *out = malloc ((long) COUNT * 12);
+    unsigned int seed = 54321;
+    int i;
+    int simd;
+
+    for (i = 0; i < COUNT; i++)
+    {
+        char *e = upcE + (long) i * 9;
+        char *a = upcA + (long) i * 13;
+        int j;
+
+        for (j = 0; j < 8; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            e[j] = '0' + ((seed >> 16) % 10);
+        }
+        e[0] = (e[0] < '5') ? '0' : '1';
+        e[8] = '\n';
+
+        expandToUpcADigits (e, a);
+        if (i & 1)
+        {
+            /* scramble the zeros, which mostly makes it incompressible */
+            a[5 + (i % 6)] = '1' + (i % 9);
+        }
+        a[12] = '\n';
+    }
+
+    for (simd = 1; simd >= 0; simd--)
+    {
+        int iters = simd ? 20 : 5;
+        long long start;
+        long long elapsed;
+        int bad = 0;
+        int n;
+
+        upcEUseSimd = simd;
+
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            bad = upcECompressBulk (upcA, 13, COUNT, out, 8);
+        }
+        elapsed = nowNanos () - start;
+        printf ("upce %-6s %-10s %8d bad %8.2f ns/op %8.1f M/s\n",
+                simd ? "simd" : "scalar", "compress", bad,
+                (double) elapsed / iters / COUNT,
+                (double) COUNT * iters * 1000.0 / elapsed);
+
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            bad = upcEExpandBulk (upcE, 9, COUNT, out, 12);
+        }
+        elapsed = nowNanos () - start;
+        printf ("upce %-6s %-10s %8d bad %8.2f ns/op %8.1f M/s\n",
+                simd ? "simd" : "scalar", "expand", bad,
+                (double) elapsed / iters / COUNT,
+                (double) COUNT * iters * 1000.0 / elapsed);
+    }
+
+    upcEUseSimd = 1;
+    free (upcA);
+    free (upcE);
+    free (out);
+}
+
+/* time decoding (see upcEanVerify()) of rendered barcodes in each of the
+ * symbologies, with and without supplements */
+void benchVerify (void)
+{
+    char *names[] = {
+        "upca", "upca-sup5", "upce", "ean13", "ean13-sup2", "ean8", "isbn"
+    };
+    char *values[] = {
+        "03600029145?", "03600029145?,51295", "0425261?", "4006381333931",
+        "4006381333931,12", "9638507?", "ISBN 0-306-40615-2,$12.95"
+    };
+    int count = sizeof (values) / sizeof (char *);
+    int iters = 200000;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        char value[40];
+        UpcEanCode code;
+        ErrorCode error;
+        Bitmap *b;
+        long long start;
+        long long elapsed;
+        int ok = 0;
+        int n;
+
+        strcpy (value, values[i]);
+        if (! ((i == (count - 1))
+               ? bookParse (value, &code, &error)
+               : upcEanParse (value, 0, &code, &error)))
+        {
+            fprintf (stderr, "can't encode %s\n", values[i]);
+            continue;
+        }
+
+        b = upcEanCodeToBitmap (&code, 0);
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            ok += upcEanVerify (&code, b);
+        }
+        elapsed = nowNanos () - start;
+
+        printf ("verify %-10s %-18s %8.1f ns/op (%d ok)\n",
+                names[i], code.digits, (double) elapsed / iters, ok);
+        bitmapFree (b);
+    }
+}
+
+/* time password verification, with the cached window of passwords, for
+ * valid and invalid passwords, against the cost of making a password
+ * from scratch */
+void benchPassword (void)
+{
+    char *names[] = { "valid", "invalid", "short" };
+    char passwords[3][PASSWORD_LENGTH + 1];
+    int iters = 10000000;
+    long long start;
+    long long elapsed;
+    int accepted;
+    int i;
+    int n;
+
+    memcpy (passwords[0], passwordWindow (time (NULL))->passwords[1],
+            PASSWORD_LENGTH);
+    passwords[0][PASSWORD_LENGTH] = '\0';
+    strcpy (passwords[1], passwords[0]);
+    passwords[1][PASSWORD_LENGTH - 1] ^= 1;
+    strcpy (passwords[2], "31337");
+
+    for (i = 0; i < 3; i++)
+    {
+        accepted = 0;
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            accepted += verifyPassword (passwords[i]);
+        }
+        elapsed = nowNanos () - start;
+
+        printf ("password verify %-8s %10.1f ns/op (%d accepted)\n",
+                names[i], (double) elapsed / iters, accepted);
+    }
+
+    iters /= 100;
+    start = nowNanos ();
+    for (n = 0; n < iters; n++)
+    {
+        passwordFor (n, passwords[1]);
+    }
+    elapsed = nowNanos () - start;
+
+    printf ("password make   %-8s %10.1f ns/op\n", "hmac",
+            (double) elapsed / iters);
+}
+
+/* time the XBM integrity check over a large batch of generated XBM text,
+ * with a trigger that is common ('x') and one that never appears ('~'),
+ * and time reading a large XBM back in, with and without the vectorized
+ * paths */
+void benchXbm (void)
+{
+    char value[] = "9780201379624,51295";
+    int masks[] = { 0x7800, 0x7e00 };
+    Buffer text;
+    Buffer report;
+    Bitmap *b = upcEanToBitmap (value, 0, 0, NULL);
+    int iters = 20;
+    int simd;
+    int i;
+
+    bufferInit (&text);
+    bufferInit (&report);
+    for (i = 0; i < 2000; i++)
+    {
+        bitmapWriteXbm (&text, b, barcodeComment, "milk_barcode");
+    }
+    bitmapFree (b);
+
+    /* replace the closing braces, so that the whole batch is scanned */
+    for (i = 0; i < text.length; i++)
+    {
+        if (text.buf[i] == '}')
+        {
+            text.buf[i] = ';';
+        }
+    }
+
+    for (simd = 1; simd >= 0; simd--)
+    {
+        xbmUseSimd = simd;
+        for (i = 0; i < 2; i++)
+        {
+            long long start;
+            long long elapsed;
+            int n;
+
+            start = nowNanos ();
+            for (n = 0; n < iters; n++)
+            {
+                report.length = 0;
+                xbmIntegrityCheck (text.buf, text.length, masks[i], &report);
+            }
+            elapsed = nowNanos () - start;
+
+            printf ("xbm %-6s trigger '%c' %8d bytes %8.2f ms/op %8.1f MB/s\n",
+                    simd ? "simd" : "scalar", masks[i] >> 8, text.length,
+                    (double) elapsed / iters / 1000000.0,
+                    (double) text.length * iters * 1000.0 / elapsed);
+        }
+    }
+
+    xbmUseSimd = 1;
+
+    /* one big image, to read back in */
+    b = makeBitmap (4096, 4096);
+    for (i = 0; i < (b->widthBytes * b->height); i++)
+    {
+        b->buf[i] = i * 2654435761U >> 24;
+    }
+    text.length = 0;
+    bitmapWriteXbm (&text, b, barcodeComment, "milk_barcode");
+    bitmapFree (b);
+
+    for (simd = 1; simd >= 0; simd--)
+    {
+        const char *reason = NULL;
+        long long start;
+        long long elapsed;
+        int n;
+
+        xbmReadUseSimd = simd;
+
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            b = xbmParse (text.buf, text.length, &reason);
+            if (b == NULL)
+            {
+                fprintf (stderr, "xbm read failed: %s\n", reason);
+                break;
+            }
+            bitmapFree (b);
+        }
+        elapsed = nowNanos () - start;
+
+        printf ("xbm %-6s read        %8d bytes %8.2f ms/op %8.1f MB/s\n",
+                simd ? "simd" : "scalar", text.length,
+                (double) elapsed / iters / 1000000.0,
+                (double) text.length * iters * 1000.0 / elapsed);
+    }
+
+    xbmReadUseSimd = 1;
+    bufferFree (&text);
+    bufferFree (&report);
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * request tracing
+ */
+
+/* the most stage events recorded in a trace; a request with more (e.g.
+ * a big batch) has the rest left out */
+#define TRACE_MAX_EVENTS 32
+
+/* the most bytes of request query kept in a trace */
+#define TRACE_MAX_QUERY 256
+
+/* the count of traces kept, most recent first; must be a power of two */
+#define TRACE_RING 256
+
+/* a stage of a traced request, with its start and end relative to the
+ * start of the request, in stage clock ticks */
+typedef struct
+{
+    int stage;           /* which stage (a MetricStage) */
+    long long start;
+    long long end;
+}
+TraceEvent;
+
+/* a trace of one request */
+typedef struct
+{
+    unsigned long long seq; /* for readers of the ring; see tracePublish() */
+    long long ticks;     /* how long the request took, in ticks */
+    int slow;            /* boolean whether it was kept for being slow (as
+                          * opposed to being sampled) */
+    int mode;            /* its Mode */
+    int header;          /* the HeaderId of its response */
+    int bytes;           /* the length of its response body */
+    int eventCount;      /* count of events */
+    int eventsLost;      /* count of events left out, for lack of room */
+    TraceEvent events[TRACE_MAX_EVENTS];
+    int queryLength;     /* length of its query, or 0 if it has none */
+    int queryTruncated;  /* boolean whether the query was cut short */
+    char query[TRACE_MAX_QUERY]; /* its query (see requestQuery()) */
+}
+Trace;
+
+/* whether requests are traced, and which ones get kept: those that take
+ * at least the threshold, and one in every traceSampleEvery of the rest
+ * (or none, if it is 0) */
+static int traceEnabled = 0;
+static long long traceThresholdNanos = 0;
+static long traceSampleEvery = 0;
+
+/* the nanoseconds per tick of the stage clock (see stageClock()) */
+static double stageNanosPerTick = 1.0;
+static pthread_once_t stageClockOnce = PTHREAD_ONCE_INIT;
+
+/* the calling thread's trace of the request it is handling, whether one
+ * is being recorded, and its state for sampling */
+static __thread Trace traceCurrent;
+static __thread int traceActive = 0;
+static __thread long long traceStart;
+static __thread unsigned int traceRandom = 0;
+
+/* the most recent traces kept, and the count of all traces ever kept */
+static Trace traceRing[TRACE_RING];
+static unsigned long long traceCount = 0;
+
+/* return a timestamp for timing the stages of requests; on x86, this is
+ * the time stamp counter, which costs a fraction of what clock_gettime()
+ * does, and elsewhere it is in nanoseconds */
+long long stageClock (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+    return __rdtsc ();
+#else
+    return nowNanos ();
+#endif
+}
+
+/* work out the rate of the stage clock, by timing it against the
+ * monotonic clock for 10ms */
+void stageClockCalibrate (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+    struct timespec pause;
+    long long nanos = nowNanos ();
+    long long ticks = stageClock ();
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = 10000000;
+    nanosleep (&pause, NULL);
+
+    stageNanosPerTick = (double) (nowNanos () - nanos)
+        / (double) (stageClock () - ticks);
+#endif
+}
+
+/* calibrate the stage clock (see stageClockCalibrate()), if it hasn't
+ * been already; this needs to happen before anything is timed with it */
+void stageClockSetup (void)
+{
+    pthread_once (&stageClockOnce, stageClockCalibrate);
+}
+
+/* start a trace of a request, which started at the given time */
+void traceBegin (long long start)
+{
+    if (! traceEnabled)
+    {
+        return;
+    }
+
+    traceCurrent.eventCount = 0;
+    traceCurrent.eventsLost = 0;
+    traceCurrent.queryLength = 0;
+    traceCurrent.queryTruncated = 0;
+    traceStart = start;
+    traceActive = 1;
+}
+
+/* add a stage to the calling thread's trace, if it has one */
+void traceStage (int stage, long long start, long long end)
+{
+    TraceEvent *event;
+
+    if (! traceActive)
+    {
+        return;
+    }
+
+    if (traceCurrent.eventCount == TRACE_MAX_EVENTS)
+    {
+        traceCurrent.eventsLost++;
+        return;
+    }
+
+    event = &traceCurrent.events[traceCurrent.eventCount];
+    event->stage = stage;
+    event->start = start - traceStart;
+    event->end = end - traceStart;
+    traceCurrent.eventCount++;
+}
+
+/* record the given request query (see requestQuery()) in the calling
+ * thread's trace, if it has one */
+void traceQuery (Buffer *query)
+{
+    int length = query->length;
+
+    if (! traceActive)
+    {
+        return;
+    }
+
+    if (length > TRACE_MAX_QUERY)
+    {
+        length = TRACE_MAX_QUERY;
+        traceCurrent.queryTruncated = 1;
+    }
+
+    memcpy (traceCurrent.query, query->buf, length);
+    traceCurrent.queryLength = length;
+}
+
+/* a word of a trace, as traces are copied into and out of the ring */
+typedef unsigned long long TraceWord __attribute__ ((may_alias));
+
+/* copy the bytes of one trace from the given start offset up to the given
+ * end offset (rounded up to a whole word) into another, a word at a time
+ * with atomic loads and stores; a reader of the ring can copy a slot while
+ * it is being written (see tracePublish()), and this way it just gets a
+ * torn copy, which the sequence number tells it to throw out, rather than
+ * a data race; the loads acquire, so that a reader checks the sequence
+ * number again only after copying, and the stores release, so that a
+ * writer's words are only seen after its claim on the slot (on x86, these
+ * are just plain moves) */
+void traceCopy (Trace *to, Trace *from, int start, int end)
+{
+    TraceWord *out = (TraceWord *) ((char *) to + start);
+    TraceWord *in = (TraceWord *) ((char *) from + start);
+    int count = (end - start + sizeof (TraceWord) - 1) / sizeof (TraceWord);
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        __atomic_store_n (&out[i], __atomic_load_n (&in[i], __ATOMIC_ACQUIRE),
+                          __ATOMIC_RELEASE);
+    }
+}
+
+/* add the given trace to the ring; each slot has a sequence number that
+ * is odd while the slot is being written, and otherwise tells which trace
+ * is in it, so that readers can take a copy without any locking, and
+ * tell if it changed while they did; a writer claims its slot by swapping
+ * in its own odd sequence number, so that if two writers whose traces are
+ * a whole lap of the ring apart get to the same slot at once, only one of
+ * them writes it (and the other trace, or an older one, is dropped) */
+void tracePublish (Trace *trace)
+{
+    unsigned long long n = __atomic_fetch_add (&traceCount, 1,
+                                               __ATOMIC_RELAXED);
+    Trace *slot = &traceRing[n & (TRACE_RING - 1)];
+    int length = offsetof (Trace, query) + trace->queryLength;
+    unsigned long long seq = __atomic_load_n (&slot->seq, __ATOMIC_RELAXED);
+
+    if (((seq & 1) != 0) || (seq > n * 2)
+        || ! __atomic_compare_exchange_n (&slot->seq, &seq, n * 2 + 1, 0,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED))
+    {
+        /* the slot is being written, or holds a later trace already */
+        return;
+    }
+
+    traceCopy (slot, trace, sizeof (trace->seq), length);
+    __atomic_store_n (&slot->seq, n * 2 + 2, __ATOMIC_RELEASE);
+}
+
+/* finish the calling thread's trace of a request of the given mode, whose
+ * response had the given header and body length, keeping it if it was
+ * slow or is sampled; a negative mode is for a request that isn't for an
+ * image, which isn't kept */
+void traceEnd (int mode, int header, int bytes)
+{
+    long long ticks;
+    int slow;
+
+    if (! traceActive)
+    {
+        return;
+    }
+
+    traceActive = 0;
+    if (mode < 0)
+    {
+        return;
+    }
+
+    ticks = stageClock () - traceStart;
+    slow = (ticks * stageNanosPerTick >= traceThresholdNanos);
+
+    if (! slow)
+    {
+        if (traceSampleEvery == 0)
+        {
+            return;
+        }
+
+        /* xorshift, seeded per thread */
+        if (traceRandom == 0)
+        {
+            traceRandom = (unsigned int) (size_t) &traceRandom
+                ^ (unsigned int) nowNanos () ^ 1;
+        }
+        traceRandom ^= traceRandom << 13;
+        traceRandom ^= traceRandom >> 17;
+        traceRandom ^= traceRandom << 5;
+
+        if ((traceRandom % traceSampleEvery) != 0)
+        {
+            return;
+        }
+    }
+
+    traceCurrent.ticks = ticks;
+    traceCurrent.slow = slow;
+    traceCurrent.mode = mode;
+    traceCurrent.header = header;
+    traceCurrent.bytes = bytes;
+    tracePublish (&traceCurrent);
+}
+
+/* copy the trace in the given slot of the ring into the given trace;
+ * returns 0 if the slot is empty, or changed while it was being read */
+int traceRead (int index, Trace *trace)
+{
+    Trace *slot = &traceRing[index];
+    unsigned long long seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+
+    if ((seq == 0) || ((seq & 1) != 0))
+    {
+        return 0;
+    }
+
+    traceCopy (trace, slot, 0, sizeof (Trace));
+
+    if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq)
+    {
+        return 0;
+    }
+
+    if (trace->queryLength > TRACE_MAX_QUERY)
+    {
+        trace->queryLength = TRACE_MAX_QUERY;
+    }
+
+    return 1;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * metrics
+ */
+
+/* the stages of handling a request that are timed */
+typedef enum
+{
+    METRIC_STAGE_PARSE,   /* parsing the request's form or JSON data */
+    METRIC_STAGE_CACHE,   /* looking the request up in the cache */
+    METRIC_STAGE_ENCODE,  /* parsing and normalizing a value */
+    METRIC_STAGE_RENDER,  /* rendering an image */
+    METRIC_STAGE_VERIFY,  /* decoding a rendered image (see --verify) */
+    METRIC_STAGE_OUTPUT,  /* writing an image out as XBM */
+    METRIC_STAGE_SEND,    /* sending a response to the server's client */
+    METRIC_STAGE_REQUEST, /* all of handling a request */
+    METRIC_STAGE_COUNT
+}
+MetricStage;
+
+/* the names of the stages, indexed by MetricStage */
+static const char *metricStageNames[METRIC_STAGE_COUNT] =
+{
+    "parse", "cache", "encode", "render", "verify", "output", "send",
+    "request"
+};
+
+/* room for counts by mode and by error; there are fewer of each than
+ * this */
+#define METRICS_MODES 32
+#define METRICS_ERRORS 32
+
+/* the range of the stage latency histograms: below 2^METRICS_MIN_BITS
+ * nanoseconds (about a microsecond) is one bucket, as is at or above
+ * 2^METRICS_MAX_BITS (about 17 seconds), and each power of two between is
+ * split into two buckets (so that the buckets are log-linear, and each is
+ * at most half again as wide as the values in it) */
+#define METRICS_MIN_BITS 10
+#define METRICS_MAX_BITS 34
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_MIN_BITS) * 2 + 2)
+
+/* a histogram of a stage's latencies, in nanoseconds */
+typedef struct
+{
+    unsigned long long counts[METRICS_BUCKETS];
+    unsigned long long sum;
+    unsigned long long count;
+}
+MetricsHistogram;
+
+/* a block of metrics; each thread records into a block of its own, with
+ * no locking or atomic read-modify-write operations (just untorn loads
+ * and stores), and the blocks are merged when the metrics are read; a
+ * block is handed on to a new thread when its thread exits, so that its
+ * counts are kept, and the count of blocks stays at the most threads
+ * there have ever been at once */
+typedef struct Metrics
+{
+    struct Metrics *next;                     /* next in list of all */
+    int inUse;                                /* boolean whether a thread
+                                               * owns this block */
+    unsigned long long requests[METRICS_MODES]; /* requests by Mode */
+    unsigned long long errors[METRICS_ERRORS];  /* errors by ErrorCode */
+    unsigned long long cacheHits;             /* requests found in cache */
+    unsigned long long cacheMisses;           /* requests not found */
+    unsigned long long responseBytes;         /* bytes of response bodies */
+    MetricsHistogram stages[METRIC_STAGE_COUNT]; /* latency by stage */
+}
+Metrics;
+
+/* whether metrics are recorded; they are in server mode, and with the
+ * --metrics option */
+static int metricsEnabled = 0;
+
+/* the file that --metrics dumps the metrics into at exit, if any */
+static const char *metricsFile = NULL;
+
+/* the list of all the blocks of metrics */
+static Metrics *metricsList = NULL;
+
+/* the calling thread's block of metrics, once it has one */
+static __thread Metrics *metricsOwn = NULL;
+
+/* key whose destructor gives up a thread's block when the thread exits */
+static pthread_key_t metricsKey;
+static pthread_once_t metricsOnce = PTHREAD_ONCE_INIT;
+
+/* give up the given block of metrics, for reuse by another thread */
+void metricsRelease (void *arg)
+{
+    Metrics *m = arg;
+
+    __atomic_store_n (&m->inUse, 0, __ATOMIC_RELEASE);
+}
+
+/* set up the key for giving up blocks of metrics */
+void metricsSetup (void)
+{
+    pthread_key_create (&metricsKey, metricsRelease);
+}
+
+/* return the calling thread's block of metrics, claiming one that has
+ * been given up or adding a new one if it doesn't have one yet */
+Metrics *metricsThread (void)
+{
+    Metrics *m = metricsOwn;
+
+    if (m != NULL)
+    {
+        return m;
+    }
+
+    pthread_once (&metricsOnce, metricsSetup);
+
+    for (m = __atomic_load_n (&metricsList, __ATOMIC_ACQUIRE);
+         m != NULL;
+         m = m->next)
+    {
+        int expected = 0;
+
+        if (__atomic_compare_exchange_n (&m->inUse, &expected, 1, 0,
+                                         __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (m == NULL)
+    {
+        m = calloc (1, sizeof (Metrics));
+        m->inUse = 1;
+        m->next = __atomic_load_n (&metricsList, __ATOMIC_RELAXED);
+        while (! __atomic_compare_exchange_n (&metricsList, &m->next, m, 1,
+                                              __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED))
+        {
+            /* m->next has been updated; try again */
+        }
+    }
+
+    pthread_setspecific (metricsKey, m);
+    metricsOwn = m;
+    return m;
+}
+
+/* add the given amount to the given counter of the calling thread's
+ * block; only the owning thread writes it, so there is no need for an
+ * atomic increment, only for the store not to be torn for readers */
+void metricAdd (unsigned long long *counter, unsigned long long amount)
+{
+    __atomic_store_n (counter,
+                      __atomic_load_n (counter, __ATOMIC_RELAXED) + amount,
+                      __ATOMIC_RELAXED);
+}
+
+/* return the index of the histogram bucket of the given latency */
+int metricsBucket (unsigned long long nanos)
+{
+    int bits;
+
+    if (nanos < (1ULL << METRICS_MIN_BITS))
+    {
+        return 0;
+    }
+
+    bits = 63 - __builtin_clzll (nanos);
+    if (bits >= METRICS_MAX_BITS)
+    {
+        return METRICS_BUCKETS - 1;
+    }
+
+    return (bits - METRICS_MIN_BITS) * 2 + 1
+        + (int) ((nanos >> (bits - 1)) & 1);
+}
+
+/* return the (exclusive) upper bound of the given histogram bucket, in
+ * nanoseconds; the last bucket has none, and gets 0 */
+unsigned long long metricsBucketBound (int index)
+{
+    int bits;
+
+    if (index == 0)
+    {
+        return 1ULL << METRICS_MIN_BITS;
+    }
+    else if (index == METRICS_BUCKETS - 1)
+    {
+        return 0;
+    }
+
+    bits = METRICS_MIN_BITS + (index - 1) / 2;
+    return (1ULL << bits) + ((unsigned long long) ((index - 1) % 2 + 1)
+                             << (bits - 1));
+}
+
+/* return a timestamp (see stageClock()) to pass to metricsStage() at the
+ * end of a stage, or 0 if stages aren't being timed */
+long long metricsStart (void)
+{
+    return (metricsEnabled || traceEnabled) ? stageClock () : 0;
+}
+
+/* record the latency of the given stage, which started at the given time
+ * (from metricsStart()), and add it to the request's trace, if it is
+ * being traced */
+void metricsStage (MetricStage stage, long long start)
+{
+    MetricsHistogram *h;
+    unsigned long long nanos;
+    long long end;
+
+    if (! (metricsEnabled || traceEnabled))
+    {
+        return;
+    }
+
+    end = stageClock ();
+    if (stage != METRIC_STAGE_REQUEST)
+    {
+        traceStage (stage, start, end);
+    }
+
+    if (! metricsEnabled)
+    {
+        return;
+    }
+
+    h = &metricsThread ()->stages[stage];
+    nanos = (unsigned long long) ((end - start) * stageNanosPerTick);
+    metricAdd (&h->counts[metricsBucket (nanos)], 1);
+    metricAdd (&h->sum, nanos);
+    metricAdd (&h->count, 1);
+}
+
+/* count a request of the given mode, whose response body had the given
+ * length */
+void metricsRequest (int mode, int bytes)
+{
+    Metrics *m;
+
+    if (! metricsEnabled)
+    {
+        return;
+    }
+
+    m = metricsThread ();
+    metricAdd (&m->requests[mode], 1);
+    metricAdd (&m->responseBytes, bytes);
+}
+
+/* count an error of the given kind (an ErrorCode) */
+void metricsError (int error)
+{
+    if (metricsEnabled)
+    {
+        metricAdd (&metricsThread ()->errors[error], 1);
+    }
+}
+
+/* count a cache lookup, which either hit or missed */
+void metricsCache (int hit)
+{
+    if (metricsEnabled)
+    {
+        Metrics *m = metricsThread ();
+        metricAdd (hit ? &m->cacheHits : &m->cacheMisses, 1);
+    }
+}
+
+/* add up all the blocks of metrics into the given one; as the blocks are
+ * still being written, the total is only consistent to within the
+ * requests in progress */
+void metricsMerge (Metrics *total)
+{
+    unsigned long long *sum = (unsigned long long *) &total->requests;
+    int words = (sizeof (Metrics) - offsetof (Metrics, requests))
+        / sizeof (unsigned long long);
+    Metrics *m;
+    int i;
+
+    memset (total, 0, sizeof (Metrics));
+
+    for (m = __atomic_load_n (&metricsList, __ATOMIC_ACQUIRE);
+         m != NULL;
+         m = m->next)
+    {
+        unsigned long long *part = (unsigned long long *) &m->requests;
+
+        for (i = 0; i < words; i++)
+        {
+            sum[i] += __atomic_load_n (&part[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * run the show
+ */
+
+/* different modes of operation */
+typedef enum
+{
+    MODE_UPCEAN, MODE_UPCEAN_SHORT, MODE_UPCE, MODE_UPCE_SHORT,
+    MODE_EAN8, MODE_EAN8_SHORT, MODE_BOOK, MODE_BOOK_SHORT,
+    MODE_TEXT, MODE_PONDER, MODE_CHECK, MODE_PRINT_PASSWORD, MODE_BENCH,
+    MODE_VALIDATE, MODE_COMPLETE, MODE_CONVERT, MODE_CATALOG
+}
+Mode;
+
+/* different kinds of output */
+typedef enum
+{
+    OUTPUT_IMAGE, OUTPUT_MODULES, OUTPUT_SIZE
+}
+Output;
+
+/* the maximum number of values that may be rendered in one batch */
+#define BATCH_MAX 64
+
+/* all the possible options to the program */
+typedef struct
+{
+    int requirePassword; /* boolean whether to require a password */
+    int httpHeader;      /* boolean whether to generate an HTTP reply header */
+    Mode mode;           /* mode of operation */
+    char *password;      /* password value */
+    char *signature;     /* signature of the request, if signed */
+    char *expires;       /* expiry time of the signature */
+    long signLifetime;   /* if nonzero, seconds to sign the request for */
+    char *value;         /* value to encode */
+    char **args;         /* arguments after the value (for --check, the
+                          * files to check) */
+    int argCount;        /* count of args */
+    char *values[BATCH_MAX]; /* all values to encode, when given as a form */
+    int valueCount;      /* count of values; more than one makes a batch */
+    int sprite;          /* boolean whether to make a batch a sprite sheet */
+    int json;            /* boolean whether to report errors as JSON */
+    Output output;       /* kind of output */
+    int head;            /* boolean whether to only output the header */
+    char *servePort;     /* port to serve HTTP on, if in server mode */
+    long rateLimit;      /* requests per second allowed to each client of
+                          * the server, or 0 for no limit */
+    char *font;          /* XBM file to load the 5x8 font from, if any */
+    char *loadPort;      /* port of the server to generate load against,
+                          * if generating load */
+    long loadRate;       /* requests per second to generate */
+    long loadConnections; /* connections to generate load over */
+    long loadSeconds;    /* how long to generate load for */
+    ErrorCode error;     /* error found while setting the options, if any */
+}
+Options;
+
+/* initialize an options struct */
+void initOptions (Options *opts)
+{
+    opts->requirePassword = 0;
+    opts->httpHeader = 0;
+    opts->mode = MODE_UPCEAN;
+    opts->password = NULL;
+    opts->signature = NULL;
+    opts->expires = NULL;
+    opts->signLifetime = 0;
+    opts->value = NULL;
+    opts->args = NULL;
+    opts->argCount = 0;
+    opts->valueCount = 0;
+    opts->sprite = 0;
+    opts->json = 0;
+    opts->output = OUTPUT_IMAGE;
+    opts->head = 0;
+    opts->servePort = NULL;
+    opts->rateLimit = 0;
+    opts->font = NULL;
+    opts->loadPort = NULL;
+    opts->loadRate = 1000;
+    opts->loadConnections = 64;
+    opts->loadSeconds = 10;
+    opts->error = ERROR_NONE;
+}
+
+/* interpret a mode string */
+int setMode (Options *opts, char *mode)
+{
+    switch (keywordLookup (mode, strlen (mode)))
+    {
+        case KW_UPCEAN:       opts->mode = MODE_UPCEAN;       break;
+        case KW_UPCEAN_SHORT: opts->mode = MODE_UPCEAN_SHORT; break;
+        case KW_UPCE:         opts->mode = MODE_UPCE;         break;
+        case KW_UPCE_SHORT:   opts->mode = MODE_UPCE_SHORT;   break;
+        case KW_EAN8:         opts->mode = MODE_EAN8;         break;
+        case KW_EAN8_SHORT:   opts->mode = MODE_EAN8_SHORT;   break;
+        case KW_ISBN:         opts->mode = MODE_BOOK;         break;
+        case KW_ISBN_SHORT:   opts->mode = MODE_BOOK_SHORT;   break;
+        case KW_TEXT:         opts->mode = MODE_TEXT;         break;
+        default:              return 0;
+    }
+
+    return 1;
+}
+
+/* set the option named by the given key from the given (null-terminated)
+ * value; returns 0 if the value can't be accepted */
+int setOption (Options *opts, Keyword key, char *value, int valueLength)
+{
+    switch (key)
+    {
+        case KW_PASSWORD:
+        {
+            opts->password = value;
+            break;
+        }
+        case KW_SIG:
+        {
+            opts->signature = value;
+            break;
+        }
+        case KW_EXP:
+        {
+            opts->expires = value;
+            break;
+        }
+        case KW_VALUE:
+        {
+            if (opts->valueCount == BATCH_MAX)
+            {
+                return 0;
+            }
+            opts->values[opts->valueCount] = value;
+            opts->valueCount++;
+            break;
+        }
+        case KW_VALUES:
+        {
+            /* a JSON array of values */
+            int amt = jsonParseStringArray (value,
+                                            opts->values + opts->valueCount,
+                                            BATCH_MAX - opts->valueCount);
+            if (amt < 0)
+            {
+                return 0;
+            }
+            opts->valueCount += amt;
+            break;
+        }
+        case KW_MODE:
+        {
+            setMode (opts, value);
+            break;
+        }
+        case KW_LAYOUT:
+        {
+            opts->sprite = (keywordLookup (value, valueLength) == KW_SPRITE);
+            break;
+        }
+        case KW_FORMAT:
+        {
+            opts->json = (keywordLookup (value, valueLength) == KW_JSON);
+            break;
+        }
+        case KW_OUTPUT:
+        {
+            switch (keywordLookup (value, valueLength))
+            {
+                case KW_MODULES: opts->output = OUTPUT_MODULES; break;
+                case KW_SIZE:    opts->output = OUTPUT_SIZE;    break;
+                default:         opts->output = OUTPUT_IMAGE;   break;
+            }
+            break;
+        }
+        default:
+        {
+            /* ignore unknown keys */
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/* set options from an http form submission string; the string is
+ * unescaped in place, and the option values point directly into it; this
+ * returns 0 if the form data could not be parsed */
+int setOptionsFromForm (Options *opts, char *form)
+{
+    FormPair pairs[FORM_MAX_PAIRS];
+    int count = formParse (form, pairs, FORM_MAX_PAIRS);
+    int i;
+
+    if (count < 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (! setOption (opts,
+                         keywordLookup (pairs[i].key, pairs[i].keyLength),
+                         pairs[i].value, pairs[i].valueLength))
+        {
+            return 0;
+        }
+    }
+
+    if (opts->valueCount != 0)
+    {
+        opts->value = opts->values[0];
+    }
+
+    return 1;
+}
+
+/* set options from a JSON request, which is an object with the same keys
+ * as form data, whose values are all strings, except that "values" is an
+ * array of strings; like form data, the JSON text is unescaped in place;
+ * this returns 0 if the JSON could not be parsed */
+int setOptionsFromJson (Options *opts, char *json)
+{
+    char *pos = jsonSkipSpace (json);
+
+    if (*pos != '{')
+    {
+        return 0;
+    }
+
+    pos = jsonSkipSpace (pos + 1);
+    if (*pos == '}')
+    {
+        pos++;
+    }
+    else
+    {
+        for (;;)
+        {
+            char *key = jsonParseString (&pos);
+            Keyword keyword;
+
+            if (key == NULL)
+            {
+                return 0;
+            }
+
+            pos = jsonSkipSpace (pos);
+            if (*pos != ':')
+            {
+                return 0;
+            }
+
+            pos = jsonSkipSpace (pos + 1);
+            keyword = keywordLookup (key, strlen (key));
+
+            if ((*pos == '[') && (keyword == KW_VALUES))
+            {
+                int amt = jsonParseStringArrayAt (
+                    &pos,
+                    opts->values + opts->valueCount,
+                    BATCH_MAX - opts->valueCount);
+                if (amt < 0)
+                {
+                    return 0;
+                }
+                opts->valueCount += amt;
+            }
+            else
+            {
+                char *value = jsonParseString (&pos);
+
+                if ((value == NULL)
+                    || ! setOption (opts, keyword, value, strlen (value)))
+                {
+                    return 0;
+                }
+            }
+
+            pos = jsonSkipSpace (pos);
+            if (*pos == '}')
+            {
+                pos++;
+                break;
+            }
+            else if (*pos != ',')
+            {
+                return 0;
+            }
+
+            pos = jsonSkipSpace (pos + 1);
+        }
+    }
+
+    if (*jsonSkipSpace (pos) != '\0')
+    {
+        return 0;
+    }
+
+    if (opts->valueCount != 0)
+    {
+        opts->value = opts->values[0];
+    }
+
+    return 1;
+}
+
+/* handle a mode given as a prefix of a single value, in the form
+ * ":mode:value" */
+void setModeFromValue (Options *opts)
+{
+    if ((opts->value != NULL) && (opts->valueCount <= 1))
+    {
+        char *value = opts->value;
+        if (*value == ':')
+        {
+            char *col2 = strchr (value + 1, ':');
+            if (col2 != NULL)
+            {
+                /* temporarily terminate the mode name in place */
+                *col2 = '\0';
+                if (setMode (opts, value + 1))
+                {
+                    opts->value = col2 + 1;
+                }
+                else
+                {
+                    *col2 = ':';
+                }
+            }
+        }
+    }
+}
+
+/* set options from the data of a request, which is either a JSON object
+ * (see setOptionsFromJson()) or form data (see setOptionsFromForm());
+ * data that can't be parsed is recorded as an error in the options */
+void setOptionsFromRequest (Options *opts, char *data, int isJson)
+{
+    long long start = metricsStart ();
+
+    PROBE1 (parse__start, isJson);
+    if (isJson)
+    {
+        /* errors in response to JSON requests are reported as JSON */
+        opts->json = 1;
+    }
+
+    if (isJson
+        ? setOptionsFromJson (opts, data)
+        : setOptionsFromForm (opts, data))
+    {
+        setModeFromValue (opts);
+    }
+    else
+    {
+        opts->error = ERROR_BAD_REQUEST;
+    }
+
+    PROBE3 (parse__done, opts->mode, opts->valueCount, opts->error);
+    metricsStage (METRIC_STAGE_PARSE, start);
+}
+
+/* parse the given value of a commandline option, which must be a positive
+ * decimal number, into *result; returns 0 if it isn't one */
+int parseOptionNumber (const char *str, long *result)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol (str, &end, 10);
+    if ((end == str) || (*end != '\0') || (errno != 0) || (value <= 0))
+    {
+        return 0;
+    }
+
+    *result = value;
+    return 1;
+}
+
+/* set options from argv */
+void setOptionsFromArgv (Options *opts, int argc, char *argv[])
+{
+    int parseForm = 0;
+    int parseJson = 0;
+    int cgi = 0;
+    char *form;
+
+    /* skip the name of the executable */
+    argv++;
+    argc--;
+
+    while (argc > 0)
+    {
+        char *name;
+        char *optValue;
+        int nameLength;
+        KeywordEntry *entry;
+        Keyword keyword;
+        long number = 0;
+
+        if (strncmp (*argv, "--", 2) != 0)
+        {
+            break;
+        }
+
+        name = (*argv) + 2;
+        optValue = strchr (name, '=');
+        if (optValue == NULL)
+        {
+            nameLength = strlen (name);
+        }
+        else
+        {
+            nameLength = optValue - name;
+            optValue++;
+        }
+
+        /* the options that take a value (and require one), and those
+         * whose value is a number, are flagged in the keyword table */
+        entry = keywordEntry (name, nameLength);
+        keyword = (entry == NULL) ? KW_NONE : entry->keyword;
+        if ((entry == NULL)
+            || ((optValue != NULL) != ((entry->flags & KEYWORD_VALUE) != 0))
+            || (((entry->flags & KEYWORD_NUMBER) == KEYWORD_NUMBER)
+                && ! parseOptionNumber (optValue, &number)))
+        {
+            keyword = KW_NONE;
+        }
+
+        switch (keyword)
+        {
+            case KW_REQUIRE_PASSWORD:
+            {
+                opts->requirePassword = 1;
+                break;
+            }
+            case KW_HTTP_HEADER:
+            {
+                opts->httpHeader = 1;
+                break;
+            }
+            case KW_MODE:
+            {
+                setMode (opts, optValue);
+                break;
+            }
+            case KW_OUTPUT:
+            {
+                setOption (opts, keyword, optValue, strlen (optValue));
+                break;
+            }
+            case KW_CHECK:
+            {
+                opts->mode = MODE_CHECK;
+                break;
+            }
+            case KW_PRINT_PASSWORD:
+            {
+                opts->mode = MODE_PRINT_PASSWORD;
+                break;
+            }
+            case KW_FORM_DATA:
+            {
+                parseForm = 1;
+                break;
+            }
+            case KW_JSON_DATA:
+            {
+                parseJson = 1;
+                break;
+            }
+            case KW_BENCH:
+            {
+                opts->mode = MODE_BENCH;
+                break;
+            }
+            case KW_VALIDATE:
+            {
+                opts->mode = MODE_VALIDATE;
+                break;
+            }
+            case KW_COMPLETE:
+            {
+                opts->mode = MODE_COMPLETE;
+                break;
+            }
+            case KW_CONVERT:
+            {
+                opts->mode = MODE_CONVERT;
+                break;
+            }
+            case KW_CATALOG:
+            {
+                opts->mode = MODE_CATALOG;
+                break;
+            }
+            case KW_CGI:
+            {
+                cgi = 1;
+                break;
+            }
+            case KW_SERVE:
+            {
+                opts->servePort = optValue;
+                break;
+            }
+            case KW_SIGN:
+            {
+                opts->signLifetime = number;
+                break;
+            }
+            case KW_RATE_LIMIT:
+            {
+                opts->rateLimit = number;
+                break;
+            }
+            case KW_FONT:
+            {
+                opts->font = optValue;
+                break;
+            }
+            case KW_VERIFY:
+            {
+                verifyRenders = 1;
+                break;
+            }
+            case KW_LOAD:
+            {
+                opts->loadPort = optValue;
+                break;
+            }
+            case KW_RATE:
+            {
+                opts->loadRate = number;
+                break;
+            }
+            case KW_CONNECTIONS:
+            {
+                opts->loadConnections = number;
+                break;
+            }
+            case KW_DURATION:
+            {
+                opts->loadSeconds = number;
+                break;
+            }
+            case KW_METRICS:
+            {
+                metricsEnabled = 1;
+                metricsFile = optValue;
+                break;
+            }
+            case KW_TRACE:
+            {
+                traceEnabled = 1;
+                traceThresholdNanos = number * 1000LL;
+                break;
+            }
+            case KW_TRACE_SAMPLE:
+            {
+                traceSampleEvery = number;
+                break;
+            }
+            case KW_HEAD:
+            {
+                opts->head = 1;
+                opts->httpHeader = 1;
+                break;
+            }
+            default:
+            {
+                fprintf (stderr, "unrecognized option: %s\n", *argv);
+                break;
+            }
+        }
+
+        argc--;
+        argv++;
+    }
+
+    if (cgi)
+    {
+        /* the form comes from the request, and the reply needs a header */
+        opts->httpHeader = 1;
+        opts->head = cgiIsHead ();
+        form = cgiReadRequest (&parseJson);
+        parseForm = ! parseJson;
+        argc = 1;
+        argv = &form;
+    }
+
+    if (argc == 0)
+    {
+        if (parseJson)
+        {
+            /* errors in response to JSON requests are reported as JSON */
+            opts->json = 1;
+        }
+    }
+    else if (parseJson || parseForm)
+    {
+        setOptionsFromRequest (opts, *argv, parseJson);
+    }
+    else
+    {
+        opts->value = *argv;
+        opts->args = argv + 1;
+        opts->argCount = argc - 1;
+        setModeFromValue (opts);
+    }
+}
+
+/* return boolean whether the given mode makes short-height barcodes */
+int modeIsShort (Mode mode)
+{
+    return (mode == MODE_UPCEAN_SHORT)
+        || (mode == MODE_UPCE_SHORT)
+        || (mode == MODE_EAN8_SHORT)
+        || (mode == MODE_BOOK_SHORT);
+}
+
+/* parse the given value according to the given mode, which must be one
+ * of the barcode modes; returns 0 (storing the reason in *error) if the
+ * value can't be encoded */
+int encodeValue (Mode mode, char *value, UpcEanCode *code, ErrorCode *error)
+{
+    long long start = metricsStart ();
+    int ok;
+
+    PROBE2 (encode__start, mode, value);
+    switch (mode)
+    {
+        case MODE_UPCEAN:
+        case MODE_UPCEAN_SHORT:
+        {
+            ok = upcEanParse (value, 0, code, error);
+            break;
         }
         case MODE_UPCE:
+        case MODE_UPCE_SHORT:
+        {
+            ok = upcEanParse (value, 6, code, error);
+            break;
+        }
+        case MODE_EAN8:
+        case MODE_EAN8_SHORT:
+        {
+            ok = upcEanParse (value, 8, code, error);
+            break;
+        }
+        case MODE_BOOK:
+        case MODE_BOOK_SHORT:
+        {
+            ok = bookParse (value, code, error);
+            break;
+        }
+        default:
+        {
+            *error = ERROR_NOT_BARCODE;
+            ok = 0;
+            break;
+        }
+    }
+
+    PROBE3 (encode__done, mode, ok, ok ? ERROR_NONE : *error);
+    metricsStage (METRIC_STAGE_ENCODE, start);
+    return ok;
+}
+
+/* the text rendered in text mode when no value is given */
+static char *defaultTextMsg = "Enjoy milk's many splendors\nat www.milk.com!";
+
+/* render the given value as an image according to the given mode, which
+ * must be one of the barcode modes or MODE_TEXT, and return it; *isBarcode
+ * is set to indicate whether the result is a barcode or a text image; if
+ * the value isn't supported, then if error is NULL, an image of the
+ * explanation is returned, or if not, NULL is returned (with nothing
+ * having been rendered) and the reason is stored in *error */
+Bitmap *renderValue (Mode mode, char *value, int *isBarcode,
+                     ErrorCode *error)
+{
+    UpcEanCode code;
+    ErrorCode localError;
+    Bitmap *result = NULL;
+
+    *isBarcode = 0;
+    if (error == NULL)
+    {
+        error = &localError;
+    }
+    *error = ERROR_NONE;
+    PROBE1 (render__start, mode);
+
+    if (mode == MODE_TEXT)
+    {
+        long long start = metricsStart ();
+
+        result = textToBitmap ((value == NULL) ? defaultTextMsg : value);
+        metricsStage (METRIC_STAGE_RENDER, start);
+        PROBE3 (render__done, mode, result->width, result->height);
+        return result;
+    }
+
+    if (encodeValue (mode, value, &code, error))
+    {
+        long long start = metricsStart ();
+
+        result = upcEanCodeToBitmap (&code, modeIsShort (mode));
+        metricsStage (METRIC_STAGE_RENDER, start);
+
+        if (verifyRenders)
+        {
+            start = metricsStart ();
+            if (! upcEanVerify (&code, result))
+            {
+                bitmapFree (result);
+                result = NULL;
+                *error = ERROR_VERIFY;
+            }
+            metricsStage (METRIC_STAGE_VERIFY, start);
+        }
+    }
+
+    if (result == NULL)
+    {
+        metricsError (*error);
+        PROBE3 (render__done, mode, 0, 0);
+        return (error == &localError)
+            ? textToBitmap (errorTable[*error].message)
+            : NULL;
+    }
+
+    PROBE3 (render__done, mode, result->width, result->height);
+    *isBarcode = 1;
+    return result;
+}
+
+/* compute the size of the image that renderValue() would render for the
+ * given value, without rendering it, storing it into *width and *height;
+ * the arguments and return value are otherwise as for renderValue(),
+ * except that this returns a boolean success value */
+int measureValue (Mode mode, char *value, int *width, int *height,
+                  int *isBarcode, ErrorCode *error)
+{
+    UpcEanCode code;
+    ErrorCode localError;
+
+    *isBarcode = 0;
+
+    if (mode == MODE_TEXT)
+    {
+        textMeasure ((value == NULL) ? defaultTextMsg : value, width, height);
+        return 1;
+    }
+
+    if (! encodeValue (mode, value, &code,
+                       (error == NULL) ? &localError : error))
+    {
+        if (error != NULL)
+        {
+            metricsError (*error);
+            return 0;
+        }
+        metricsError (localError);
+        textMeasure (errorTable[localError].message, width, height);
+        return 1;
+    }
+
+    upcEanCodeMeasure (&code, modeIsShort (mode), width, height);
+    *isBarcode = 1;
+    return 1;
+}
+
+/* set up the given response to report the given error, either as JSON
+ * or as an image of the explanation */
+void errorResponse (Response *r, ErrorCode error, int json)
+{
+    if (json)
+    {
+        jsonErrorResponse (r, error);
+    }
+    else
+    {
+        textResponse (r, errorTable[error].message);
+    }
+}
+
+/* set up the given response to be the rendering of the given value (see
+ * renderValue()), reporting errors as JSON if requested */
+void valueResponse (Response *r, Mode mode, char *value, int json)
+{
+    int isBarcode;
+    ErrorCode error;
+    Bitmap *b = renderValue (mode, value, &isBarcode, json ? &error : NULL);
+    long long start;
+
+    if (b == NULL)
+    {
+        jsonErrorResponse (r, error);
+        return;
+    }
+
+    start = metricsStart ();
+    bitmapXbmResponse (r, b,
+                       isBarcode ? barcodeComment : textComment,
+                       isBarcode ? "milk_barcode" : "milk_text");
+    metricsStage (METRIC_STAGE_OUTPUT, start);
+    PROBE1 (output__done, r->body.length);
+    bitmapFree (b);
+}
+
+/* the maximum number of threads used to render a batch */
+#define BATCH_MAX_THREADS 8
+
+/* the number of blank pixels between the images on a batch sprite sheet */
+#define BATCH_SPRITE_PADDING 2
+
+/* the state of a batch rendering job */
+typedef struct
+{
+    Mode mode;                    /* mode to render with */
+    char **values;                /* values to render */
+    int count;                    /* count of values */
+    int writeParts;               /* boolean whether to also write XBMs */
+    int json;                     /* boolean whether errors are JSON */
+    int next;                     /* index of the next value to claim */
+    Bitmap *bitmaps[BATCH_MAX];   /* rendered images (NULL for errors) */
+    int isBarcode[BATCH_MAX];     /* whether each image is a barcode */
+    ErrorCode errors[BATCH_MAX];  /* error for each value, if JSON */
+    Buffer parts[BATCH_MAX];      /* XBM for each image, if requested */
+}
+Batch;
+
+/* render values from the given batch until there are none left to claim;
+ * this is run in each of the batch's threads */
+void *batchWorker (void *arg)
+{
+    Batch *batch = arg;
+
+    for (;;)
+    {
+        int i = __atomic_fetch_add (&batch->next, 1, __ATOMIC_RELAXED);
+
+        if (i >= batch->count)
+        {
+            break;
+        }
+
+        batch->bitmaps[i] =
+            renderValue (batch->mode, batch->values[i], &batch->isBarcode[i],
+                         batch->json ? &batch->errors[i] : NULL);
+
+        if (batch->bitmaps[i] == NULL)
+        {
+            bufferAppendJsonError (&batch->parts[i], batch->errors[i]);
+        }
+        else if (batch->writeParts)
+        {
+            int isBarcode = batch->isBarcode[i];
+            long long start = metricsStart ();
+
+            bitmapWriteXbm (&batch->parts[i], batch->bitmaps[i],
+                            isBarcode ? barcodeComment : textComment,
+                            isBarcode ? "milk_barcode" : "milk_text");
+            metricsStage (METRIC_STAGE_OUTPUT, start);
+            PROBE1 (output__done, batch->parts[i].length);
+        }
+    }
+
+    return NULL;
+}
+
+/* render all the values of the given batch, spreading the work across as
+ * many threads as are useful */
+void batchRender (Batch *batch)
+{
+    pthread_t threads[BATCH_MAX_THREADS];
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    int threadCount = batch->count;
+    int started;
+    int i;
+
+    if (threadCount > cpus)
+    {
+        threadCount = cpus;
+    }
+
+    if (threadCount > BATCH_MAX_THREADS)
+    {
+        threadCount = BATCH_MAX_THREADS;
+    }
+
+    batch->next = 0;
+    for (i = 0; i < batch->count; i++)
+    {
+        bufferInit (&batch->parts[i]);
+    }
+
+    /* the calling thread does its share of the work too */
+    for (started = 0; started < (threadCount - 1); started++)
+    {
+        if (pthread_create (&threads[started], NULL, batchWorker, batch) != 0)
+        {
+            break;
+        }
+    }
+
+    batchWorker (batch);
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join (threads[i], NULL);
+    }
+}
+
+/* append the header of one part of a batch response to the given buffer */
+void batchAppendPartHeader (Buffer *out, const char *type, int index)
+{
+    bufferPrintf (out,
+                  "--" BATCH_BOUNDARY "\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-ID: <barcode-%d>\r\n"
+                  "\r\n",
+                  type, index);
+}
+
+/* append a JSON object describing the given value to the given buffer,
+ * according to the kind of output requested in the options, which is
+ * either the module pattern or the size (and XBM length) of the image
+ * that would be rendered; returns 0 (appending nothing, and storing the
+ * reason in *error) if the value can't be described */
+int describeValue (Options *opts, char *value, Buffer *out, ErrorCode *error)
+{
+    UpcEanCode code;
+    int width;
+    int height;
+    int isBarcode;
+
+    if (opts->output == OUTPUT_MODULES)
+    {
+        if (! encodeValue (opts->mode, value, &code, error))
+        {
+            metricsError (*error);
+            return 0;
+        }
+        bufferAppendUpcEanJson (out, &code);
+        return 1;
+    }
+
+    if (! measureValue (opts->mode, value, &width, &height, &isBarcode,
+                        opts->json ? error : NULL))
+    {
+        return 0;
+    }
+
+    bufferPrintf (out,
+                  "{\"width\":%d,\"height\":%d,\"barcode\":%s,"
+                  "\"length\":%d}",
+                  width, height, isBarcode ? "true" : "false",
+                  xbmLength (width, height,
+                             isBarcode ? barcodeComment : textComment,
+                             isBarcode ? "milk_barcode" : "milk_text"));
+    return 1;
+}
+
+/* set up the given response to be descriptions of the values given in
+ * the options (see describeValue()), without rendering any images; a
+ * single value is described as a JSON object (or a JSON error), and a
+ * batch as an array of objects, in which values that can't be described
+ * get a JSON error object */
+void descriptionResponse (Response *r, Options *opts)
+{
+    Buffer *out = &r->body;
+    ErrorCode error;
+    int i;
+
+    if (opts->valueCount <= 1)
+    {
+        if (! describeValue (opts, opts->value, out, &error))
+        {
+            jsonErrorResponse (r, error);
+            return;
+        }
+    }
+    else
+    {
+        for (i = 0; i < opts->valueCount; i++)
+        {
+            bufferAppendString (out, (i == 0) ? "[" : ",");
+            if (! describeValue (opts, opts->values[i], out, &error))
+            {
+                bufferAppendJsonError (out, error);
+            }
+        }
+        bufferAppendString (out, "]");
+    }
+
+    r->header = HEADER_JSON;
+    bufferAppendString (out, "\n");
+}
+
+/* set up the given response to be just the header of the response to a
+ * request for a single image, including its length and the size of the
+ * image, without rendering it */
+void headResponse (Response *r, Options *opts)
+{
+    int width;
+    int height;
+    int isBarcode;
+    ErrorCode error;
+
+    r->head = 1;
+
+    if (! measureValue (opts->mode, opts->value, &width, &height, &isBarcode,
+                        opts->json ? &error : NULL))
+    {
+        jsonErrorResponse (r, error);
+        return;
+    }
+
+    r->header = HEADER_XBM;
+    r->length = xbmLength (width, height,
+                           isBarcode ? barcodeComment : textComment,
+                           isBarcode ? "milk_barcode" : "milk_text");
+    r->imageWidth = width;
+    r->imageHeight = height;
+}
+
+/* set up the given response to be the rendering of all the values given
+ * in the options, as a multipart response with either one XBM part per value, or (for a
+ * sprite sheet) one XBM containing all the images followed by a JSON part
+ * mapping each value to its place in the image; if errors are to be
+ * reported as JSON, then values that can't be rendered get a JSON error
+ * part, or an error in the sprite sheet map, instead of an image */
+void batchResponse (Response *r, Options *opts)
+{
+    Batch batch;
+    Buffer *out = &r->body;
+    int i;
+
+    batch.mode = opts->mode;
+    batch.values = opts->values;
+    batch.count = opts->valueCount;
+    batch.writeParts = ! opts->sprite;
+    batch.json = opts->json;
+    batchRender (&batch);
+
+    r->header = HEADER_MULTIPART;
+
+    if (opts->sprite)
+    {
+        Bitmap *rendered[BATCH_MAX];
+        Rect renderedRects[BATCH_MAX];
+        Rect rects[BATCH_MAX];
+        int renderedCount = 0;
+        Bitmap *sheet;
+
+        /* only pack the values that rendered */
+        for (i = 0; i < batch.count; i++)
+        {
+            if (batch.bitmaps[i] != NULL)
+            {
+                rendered[renderedCount] = batch.bitmaps[i];
+                renderedCount++;
+            }
+        }
+
+        sheet = bitmapComposite (rendered, renderedCount, 0,
+                                 BATCH_SPRITE_PADDING, renderedRects);
+
+        renderedCount = 0;
+        for (i = 0; i < batch.count; i++)
+        {
+            if (batch.bitmaps[i] != NULL)
+            {
+                rects[i] = renderedRects[renderedCount];
+                renderedCount++;
+            }
+        }
+
+        batchAppendPartHeader (out, "image/x-xbitmap", 0);
+        bitmapWriteXbm (out, sheet, barcodeComment, "milk_sprites");
+        bufferAppendString (out, "\r\n");
+
+        batchAppendPartHeader (out, "application/json", 1);
+        bufferPrintf (out,
+                      "{\"width\":%d,\"height\":%d,\"images\":[",
+                      sheet->width, sheet->height);
+        for (i = 0; i < batch.count; i++)
+        {
+            bufferAppendString (out, (i == 0) ? "{" : ",{");
+            bufferAppendString (out, "\"value\":");
+            bufferAppendJsonString (out, batch.values[i]);
+
+            if (batch.bitmaps[i] == NULL)
+            {
+                bufferAppendString (out, ",");
+                /* splice in the error member, without its outer braces */
+                bufferAppend (out, batch.parts[i].buf + 1,
+                              batch.parts[i].length - 1);
+                continue;
+            }
+
+            bufferPrintf (out,
+                          ",\"barcode\":%s,\"x\":%d,\"y\":%d,"
+                          "\"width\":%d,\"height\":%d}",
+                          batch.isBarcode[i] ? "true" : "false",
+                          rects[i].x, rects[i].y,
+                          rects[i].width, rects[i].height);
+        }
+        bufferAppendString (out, "]}\r\n");
+        bitmapFree (sheet);
+    }
+    else
+    {
+        for (i = 0; i < batch.count; i++)
+        {
+            batchAppendPartHeader (out,
+                                   (batch.bitmaps[i] == NULL)
+                                   ? "application/json" : "image/x-xbitmap",
+                                   i);
+            bufferAppend (out, batch.parts[i].buf, batch.parts[i].length);
+            bufferAppendString (out, "\r\n");
+        }
+    }
+
+    bufferAppendString (out, "--" BATCH_BOUNDARY "--\r\n");
+
+    for (i = 0; i < batch.count; i++)
+    {
+        if (batch.bitmaps[i] != NULL)
+        {
+            bitmapFree (batch.bitmaps[i]);
+        }
+        bufferFree (&batch.parts[i]);
+    }
+}
+
+/* read a catalog of book numbers (see bookParse()) from stdin, one per
+ * line, and write them all to stdout as one multipart stream, as for a
+ * batch response (with JSON error parts for the lines that can't be
+ * rendered), with the parts numbered by line; the lines are rendered a
+ * batch at a time, in parallel; returns the count of lines that couldn't
+ * be rendered */
+unsigned long long catalogStream (Mode mode)
+{
+    Batch batch;
+    char *lines[BATCH_MAX];
+    size_t sizes[BATCH_MAX];
+    unsigned long long total = 0;
+    unsigned long long bad = 0;
+    Buffer out;
+    int eof = 0;
+    int i;
+
+    for (i = 0; i < BATCH_MAX; i++)
+    {
+        lines[i] = NULL;
+        sizes[i] = 0;
+    }
+
+    batch.mode = mode;
+    batch.values = lines;
+    batch.writeParts = 1;
+    batch.json = 1;
+    bufferInit (&out);
+
+    while (! eof)
+    {
+        batch.count = 0;
+        while (batch.count < BATCH_MAX)
+        {
+            char **line = &lines[batch.count];
+            ssize_t length = getline (line, &sizes[batch.count], stdin);
+
+            if (length < 0)
+            {
+                eof = 1;
+                break;
+            }
+
+            while ((length > 0)
+                   && (((*line)[length - 1] == '\n')
+                       || ((*line)[length - 1] == '\r')))
+            {
+                length--;
+            }
+            (*line)[length] = '\0';
+            batch.count++;
+        }
+
+        if (batch.count == 0)
+        {
+            break;
+        }
+
+        batchRender (&batch);
+
+        for (i = 0; i < batch.count; i++)
+        {
+            batchAppendPartHeader (&out,
+                                   (batch.bitmaps[i] == NULL)
+                                   ? "application/json" : "image/x-xbitmap",
+                                   (int) (total + i + 1));
+            bufferAppend (&out, batch.parts[i].buf, batch.parts[i].length);
+            bufferAppendString (&out, "\r\n");
+
+            if (batch.bitmaps[i] == NULL)
+            {
+                bad++;
+            }
+            else
+            {
+                bitmapFree (batch.bitmaps[i]);
+            }
+            bufferFree (&batch.parts[i]);
+        }
+
+        fwrite (out.buf, 1, out.length, stdout);
+        out.length = 0;
+        total += batch.count;
+    }
+
+    fputs ("--" BATCH_BOUNDARY "--\r\n", stdout);
+    fflush (stdout);
+    bufferFree (&out);
+
+    for (i = 0; i < BATCH_MAX; i++)
+    {
+        free (lines[i]);
+    }
+
+    fprintf (stderr, "%llu numbers, %llu not rendered\n", total, bad);
+    return bad;
+}
+
+/* set up the given response to the request described by the given
+ * options, which must be for one of the barcode modes, MODE_TEXT, or
+ * MODE_PONDER */
+void respond (Options *opts, Response *r)
+{
+    if (opts->error != ERROR_NONE)
+    {
+        metricsError (opts->error);
+        errorResponse (r, opts->error, opts->json);
+    }
+    else if (opts->mode == MODE_PONDER)
+    {
+        wordsToPonderResponse (r);
+    }
+    else if (opts->output != OUTPUT_IMAGE)
+    {
+        descriptionResponse (r, opts);
+    }
+    else if (opts->head && (opts->valueCount <= 1))
+    {
+        headResponse (r, opts);
+    }
+    else if (opts->valueCount > 1)
+    {
+        batchResponse (r, opts);
+    }
+    else
+    {
+        valueResponse (r, opts->mode, opts->value, opts->json);
+    }
+
+    if (opts->head)
+    {
+        r->head = 1;
+    }
+}
+
+/* the names of the modes in the metrics, indexed by Mode */
+static const char *metricsModeNames[METRICS_MODES] =
+{
+    [MODE_UPCEAN] = "upcean", [MODE_UPCEAN_SHORT] = "upcean-short",
+    [MODE_UPCE] = "upce", [MODE_UPCE_SHORT] = "upce-short",
+    [MODE_EAN8] = "ean8", [MODE_EAN8_SHORT] = "ean8-short",
+    [MODE_BOOK] = "isbn", [MODE_BOOK_SHORT] = "isbn-short",
+    [MODE_TEXT] = "text", [MODE_PONDER] = "ponder",
+    [MODE_CHECK] = "check", [MODE_PRINT_PASSWORD] = "print-password",
+    [MODE_BENCH] = "bench", [MODE_VALIDATE] = "validate",
+    [MODE_COMPLETE] = "complete", [MODE_CONVERT] = "convert",
+    [MODE_CATALOG] = "catalog"
+};
+
+/* append all the metrics to the given buffer, merged across threads, in
+ * the Prometheus text exposition format; counts that have never been
+ * anything but zero are left out, except for the stage histograms */
+void metricsWrite (Buffer *out)
+{
+    Metrics *total = malloc (sizeof (Metrics));
+    int errorCount = sizeof (errorTable) / sizeof (errorTable[0]);
+    int i;
+    int j;
+
+    metricsMerge (total);
+
+    bufferAppendString (out,
+                        "# HELP barcode_requests_total Requests handled, "
+                        "by mode.\n"
+                        "# TYPE barcode_requests_total counter\n");
+    for (i = 0; i < METRICS_MODES; i++)
+    {
+        if ((total->requests[i] != 0) && (metricsModeNames[i] != NULL))
+        {
+            bufferPrintf (out, "barcode_requests_total{mode=\"%s\"} %llu\n",
+                          metricsModeNames[i], total->requests[i]);
+        }
+    }
+
+    bufferAppendString (out,
+                        "# HELP barcode_errors_total Errors reported "
+                        "instead of images, by code.\n"
+                        "# TYPE barcode_errors_total counter\n");
+    for (i = 1; i < errorCount; i++)
+    {
+        if (total->errors[i] != 0)
+        {
+            bufferPrintf (out, "barcode_errors_total{code=\"%s\"} %llu\n",
+                          errorTable[i].code, total->errors[i]);
+        }
+    }
+
+    bufferPrintf (out,
+                  "# HELP barcode_cache_lookups_total Lookups in the "
+                  "response cache, by result.\n"
+                  "# TYPE barcode_cache_lookups_total counter\n"
+                  "barcode_cache_lookups_total{result=\"hit\"} %llu\n"
+                  "barcode_cache_lookups_total{result=\"miss\"} %llu\n"
+                  "# HELP barcode_response_bytes_total Bytes of response "
+                  "bodies.\n"
+                  "# TYPE barcode_response_bytes_total counter\n"
+                  "barcode_response_bytes_total %llu\n",
+                  total->cacheHits, total->cacheMisses,
+                  total->responseBytes);
+
+    bufferAppendString (out,
+                        "# HELP barcode_stage_seconds Time spent in each "
+                        "stage of handling requests.\n"
+                        "# TYPE barcode_stage_seconds histogram\n");
+    for (i = 0; i < METRIC_STAGE_COUNT; i++)
+    {
+        MetricsHistogram *h = &total->stages[i];
+        unsigned long long cumulative = 0;
+
+        for (j = 0; j < METRICS_BUCKETS - 1; j++)
+        {
+            cumulative += h->counts[j];
+            bufferPrintf (out,
+                          "barcode_stage_seconds_bucket{stage=\"%s\","
+                          "le=\"%.9g\"} %llu\n",
+                          metricStageNames[i],
+                          metricsBucketBound (j) / 1e9, cumulative);
+        }
+
+        /* the total count is read separately from the buckets, so it
+         * may be ahead of them, but the last bucket must match it */
+        bufferPrintf (out,
+                      "barcode_stage_seconds_bucket{stage=\"%s\","
+                      "le=\"+Inf\"} %llu\n"
+                      "barcode_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                      "barcode_stage_seconds_count{stage=\"%s\"} %llu\n",
+                      metricStageNames[i], h->count,
+                      metricStageNames[i], h->sum / 1e9,
+                      metricStageNames[i], h->count);
+    }
+
+    free (total);
+}
+
+/* set up the given response to be the metrics (for /metrics) */
+void metricsResponse (Response *r)
+{
+    r->header = HEADER_METRICS;
+    metricsWrite (&r->body);
+}
+
+/* write the metrics to the file given by --metrics (or to stderr, if it
+ * is "-"); this is run at exit */
+void metricsDump (void)
+{
+    Buffer out;
+    FILE *file = stderr;
+
+    if (strcmp (metricsFile, "-") != 0)
+    {
+        file = fopen (metricsFile, "w");
+        if (file == NULL)
+        {
+            perror (metricsFile);
+            return;
+        }
+    }
+
+    bufferInit (&out);
+    metricsWrite (&out);
+    fwrite (out.buf, 1, out.length, file);
+    bufferFree (&out);
+
+    if (file != stderr)
+    {
+        fclose (file);
+    }
+}
+
+/* append the traces in the ring to the given buffer as a JSON array,
+ * oldest first, with times in microseconds */
+void traceWrite (Buffer *out)
+{
+    Trace *trace = malloc (sizeof (Trace));
+    unsigned long long count = __atomic_load_n (&traceCount,
+                                                __ATOMIC_ACQUIRE);
+    unsigned long long n = (count > TRACE_RING) ? (count - TRACE_RING) : 0;
+    double microsPerTick = stageNanosPerTick / 1000.0;
+    const char *separator = "";
+    int i;
+
+    bufferAppendString (out, "[");
+
+    for (; n < count; n++)
+    {
+        if (! traceRead (n & (TRACE_RING - 1), trace)
+            || (trace->seq != n * 2 + 2))
+        {
+            /* it has since been replaced, or is still being written */
+            continue;
+        }
+
+        bufferPrintf (out,
+                      "%s\n{\"seq\":%llu,\"reason\":\"%s\",\"mode\":\"%s\","
+                      "\"status\":%d,\"bytes\":%d,\"micros\":%.3f,"
+                      "\"query\":\"",
+                      separator, n, trace->slow ? "slow" : "sampled",
+                      (metricsModeNames[trace->mode] == NULL)
+                      ? "" : metricsModeNames[trace->mode],
+                      atoi (headerBlocks[trace->header].http + 9),
+                      trace->bytes, trace->ticks * microsPerTick);
+
+        /* the query is form-encoded, so it needs no escaping */
+        bufferAppend (out, trace->query, trace->queryLength);
+        bufferPrintf (out, "\",\"queryTruncated\":%s,\"stages\":[",
+                      trace->queryTruncated ? "true" : "false");
+
+        for (i = 0; i < trace->eventCount; i++)
+        {
+            TraceEvent *event = &trace->events[i];
+
+            bufferPrintf (out,
+                          "%s{\"stage\":\"%s\",\"start\":%.3f,"
+                          "\"micros\":%.3f}",
+                          (i == 0) ? "" : ",",
+                          metricStageNames[event->stage],
+                          event->start * microsPerTick,
+                          (event->end - event->start) * microsPerTick);
+        }
+
+        bufferPrintf (out, "],\"stagesLost\":%d}", trace->eventsLost);
+        separator = ",";
+    }
+
+    bufferAppendString (out, "\n]\n");
+    free (trace);
+}
+
+/* set up the given response to be the traces (for /traces) */
+void traceResponse (Response *r)
+{
+    r->header = HEADER_JSON_LIVE;
+    traceWrite (&r->body);
+}
+
+/* write the traces to stderr; this is run at exit, when not in server
+ * mode */
+void traceDump (void)
+{
+    Buffer out;
+
+    bufferInit (&out);
+    traceWrite (&out);
+    fwrite (out.buf, 1, out.length, stderr);
+    bufferFree (&out);
+}
+
+/* write the traces to stderr each time SIGUSR1 arrives; this is run in
+ * a thread of its own in server mode, with the signal blocked in all the
+ * others */
+void *traceSignalWorker (void *arg)
+{
+    sigset_t *signals = arg;
+    int signal;
+
+    for (;;)
+    {
+        if (sigwait (signals, &signal) == 0)
+        {
+            traceDump ();
+        }
+    }
+
+    return NULL;
+}
+
+/* append the canonical key of the request described by the given options
+ * to the given buffer; it covers everything that determines the response,
+ * but with each UPC/EAN value reduced to its parsed and normalized code,
+ * so that (for example) "01234567890?" and "012345678905" have the same
+ * key (except in a sprite sheet, whose values are kept as written);
+ * returns 0 if the response to the request shouldn't be reused
+ * (because it is an error, or depends on the password) */
+int requestKey (Options *opts, Buffer *key)
+{
+    char **values = (opts->valueCount > 1) ? opts->values : &opts->value;
+    int count = (opts->valueCount > 1) ? opts->valueCount : 1;
+    char flags[4];
+    int i;
+
+    if ((opts->error != ERROR_NONE) || (opts->mode == MODE_PONDER))
+    {
+        return 0;
+    }
+
+    flags[0] = '0' + ((opts->mode == MODE_UPCEAN_SHORT)
+                      || (opts->mode == MODE_UPCE_SHORT)
+                      || (opts->mode == MODE_EAN8_SHORT)
+                      || (opts->mode == MODE_BOOK_SHORT));
+    flags[1] = '0' + opts->output;
+    flags[2] = '0' + opts->json;
+    flags[3] = '0' + opts->sprite;
+    bufferAppend (key, flags, 4);
+
+    for (i = 0; i < count; i++)
+    {
+        UpcEanCode code;
+        ErrorCode error;
+
+        if ((opts->mode == MODE_TEXT) || opts->sprite)
+        {
+            /* a sprite sheet's map gives each value as it was written,
+             * so its values can't be normalized */
+            bufferAppendString (key, "T");
+            bufferAppendString (key, (values[i] == NULL)
+                                ? defaultTextMsg : values[i]);
+        }
+        else if (encodeValue (opts->mode, values[i], &code, &error))
+        {
+            bufferPrintf (key, "U%d%s,%s", code.symbology, code.digits,
+                          code.supDigits);
+            if (code.banner != NULL)
+            {
+                bufferAppendString (key, ":");
+                bufferAppendString (key, code.banner);
+            }
+        }
+        else
+        {
+            /* error images depend only on the error */
+            bufferPrintf (key, "E%d", error);
+        }
+
+        /* a null separates the values */
+        bufferAppend (key, "", 1);
+    }
+
+    return 1;
+}
+
+/* append a query string (form data) that makes the request described by
+ * the given options to the given buffer, so that the request can be
+ * replayed (e.g. from a trace); the keys are always in the same order,
+ * each UPC/EAN value is given in its normalized form (as in requestKey(),
+ * with its check digit and banner filled in) unless the request is for a
+ * sprite sheet, and any password or signature is left out; nothing is
+ * appended for a request that is in error, or isn't for an image */
+void requestQuery (Options *opts, Buffer *query)
+{
+    char **values = (opts->valueCount > 1) ? opts->values : &opts->value;
+    int count = (opts->valueCount > 1) ? opts->valueCount : 1;
+    int digitCount;
+    int i;
+
+    if ((opts->error != ERROR_NONE) || (opts->mode > MODE_TEXT))
+    {
+        return;
+    }
+
+    /* the explicit digit count of the UPC/EAN modes (see encodeValue()),
+     * or -1 if the values aren't normalized: those of the other modes, and
+     * those of a sprite sheet, whose map gives the values as they were */
+    switch (opts->sprite ? MODE_TEXT : opts->mode)
+    {
+        case MODE_UPCEAN: case MODE_UPCEAN_SHORT: digitCount = 0;  break;
+        case MODE_UPCE:   case MODE_UPCE_SHORT:   digitCount = 6;  break;
+        case MODE_EAN8:   case MODE_EAN8_SHORT:   digitCount = 8;  break;
+        default:                                  digitCount = -1; break;
+    }
+
+    bufferAppendString (query, "mode=");
+    bufferAppendString (query, metricsModeNames[opts->mode]);
+
+    for (i = 0; i < count; i++)
+    {
+        UpcEanCode code;
+        ErrorCode error;
+
+        if (values[i] == NULL)
+        {
+            continue;
+        }
+
+        bufferAppendString (query, "&value=");
+        if ((digitCount >= 0)
+            && upcEanParse (values[i], digitCount, &code, &error)
+            && (code.mcheck == 0))
+        {
+            bufferAppendString (query, code.digits);
+            if (code.supDigits[0] != '\0')
+            {
+                bufferAppendString (query, "%2C");
+                bufferAppendString (query, code.supDigits);
+            }
+            bufferAppendString (query, "%3A");
+            if (code.banner != NULL)
+            {
+                bufferAppendFormString (query, code.banner);
+            }
+        }
+        else
+        {
+            bufferAppendFormString (query, values[i]);
+        }
+    }
+
+    if (opts->output != OUTPUT_IMAGE)
+    {
+        bufferAppendString (query, (opts->output == OUTPUT_MODULES)
+                            ? "&output=modules" : "&output=size");
+    }
+    if (opts->sprite)
+    {
+        bufferAppendString (query, "&layout=sprite");
+    }
+    if (opts->json)
+    {
+        bufferAppendString (query, "&format=json");
+    }
+}
+
+/* record the query that replays the request described by the given
+ * options in the calling thread's trace, if it has one */
+void traceRequest (Options *opts)
+{
+    Buffer query;
+
+    if (! traceActive)
+    {
+        return;
+    }
+
+    bufferInit (&query);
+    requestQuery (opts, &query);
+    traceQuery (&query);
+    bufferFree (&query);
+}
+
+/* count the errors of the values in the given request key (see
+ * requestKey()), for a response from the cache, whose errors aren't
+ * counted as it is made */
+void metricsKeyErrors (Buffer *key)
+{
+    char *pos = key->buf + 4;
+    char *end = key->buf + key->length;
+
+    if (! metricsEnabled)
+    {
+        return;
+    }
+
+    while (pos < end)
+    {
+        if (*pos == 'E')
+        {
+            metricsError (atoi (pos + 1));
+        }
+        pos += strlen (pos) + 1;
+    }
+}
+
+/* the granularity of signature expiry times, in seconds; requests signed
+ * within the same period with the same lifetime get the same expiry time,
+ * and so the same URL */
+#define SIGNATURE_PERIOD 3600
+
+/* the count of bytes of the tag that a signature keeps, and the length of
+ * the signature, which is those bytes in hex */
+#define SIGNATURE_TAG_BYTES 16
+#define SIGNATURE_LENGTH (SIGNATURE_TAG_BYTES * 2)
+
+/* store the signature of the request with the given key (see
+ * requestKey()) and expiry time into out (which must have room for
+ * SIGNATURE_LENGTH characters; it is not terminated); this is the leading
+ * bytes, in hex, of the HMAC tag of the expiry time (in decimal) and the
+ * key, joined by a null, keyed by the base password */
+void signatureFor (Buffer *key, long long expires, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char tag[32];
+    Sha256 s;
+    char buf[24];
+    int i;
+
+    pthread_once (&passwordKeyOnce, passwordKeySetup);
+
+    /* the same as hmacSha256(), but with the message in two pieces */
+    s = passwordKey.inner;
+    sha256Update (&s, buf, sprintf (buf, "%lld", expires) + 1);
+    sha256Update (&s, key->buf, key->length);
+    sha256Final (&s, tag);
+    s = passwordKey.outer;
+    sha256Update (&s, tag, 32);
+    sha256Final (&s, tag);
+
+    for (i = 0; i < SIGNATURE_TAG_BYTES; i++)
+    {
+        out[i * 2] = hex[tag[i] >> 4];
+        out[i * 2 + 1] = hex[tag[i] & 0xf];
+    }
+}
+
+/* verify that the signature given in the options is valid and hasn't
+ * expired; key is the key of the request (see requestKey()), or NULL to
+ * have it made here */
+int verifySignature (Options *opts, Buffer *key)
+{
+    char expected[SIGNATURE_LENGTH];
+    Buffer localKey;
+    char *end;
+    long long expires;
+    int ok;
+
+    if ((opts->signature == NULL) || (opts->expires == NULL)
+        || (strlen (opts->signature) != SIGNATURE_LENGTH))
+    {
+        return 0;
+    }
+
+    expires = strtoll (opts->expires, &end, 10);
+    if ((*end != '\0') || (end == opts->expires)
+        || (expires < (long long) time (NULL)))
+    {
+        return 0;
+    }
+
+    if (key == NULL)
+    {
+        key = &localKey;
+        bufferInit (key);
+        if (! requestKey (opts, key))
+        {
+            bufferFree (key);
+            return 0;
+        }
+    }
+
+    signatureFor (key, expires, expected);
+    ok = (secretDiff (opts->signature, expected, SIGNATURE_LENGTH) == 0);
+
+    if (key == &localKey)
+    {
+        bufferFree (key);
+    }
+
+    return ok;
+}
+
+/* print out the query parameters that sign the request described by the
+ * given options, to be valid for at least the requested lifetime (called
+ * from main for the --sign option); returns 0 if the request can't be
+ * signed */
+int printSignature (Options *opts)
+{
+    char signature[SIGNATURE_LENGTH];
+    Buffer key;
+    long long expires;
+
+    bufferInit (&key);
+    if (! requestKey (opts, &key))
+    {
+        bufferFree (&key);
+        return 0;
+    }
+
+    /* round up, so that the lifetime is at least as requested */
+    expires = (long long) time (NULL) + opts->signLifetime
+        + SIGNATURE_PERIOD - 1;
+    expires -= expires % SIGNATURE_PERIOD;
+
+    signatureFor (&key, expires, signature);
+    printf ("exp=%lld&sig=%.*s\n", expires, SIGNATURE_LENGTH, signature);
+    bufferFree (&key);
+    return 1;
+}
+
+/* check the password given in the options, if one is required; a signed
+ * request (see verifySignature(), to which key is passed) needs no
+ * password; a request without a valid password or signature gets an error
+ * (if errors are reported as JSON) or some words to ponder instead of
+ * what it asked for */
+void checkPassword (Options *opts, Buffer *key)
+{
+    if (opts->requirePassword && (opts->error == ERROR_NONE))
+    {
+        if (! verifySignature (opts, key)
+            && ((opts->password == NULL)
+                || ! verifyPassword (opts->password)))
+        {
+            if (opts->json)
+            {
+                opts->error = ERROR_PASSWORD;
+            }
+            else
+            {
+                opts->mode = MODE_PONDER;
+            }
+        }
+    }
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * stage benchmarks
+ */
+
+/* the minimum time to spend timing each stage, in nanoseconds */
+#define STAGE_BENCH_NANOS 20000000LL
+
+/* one case of the stage benchmarks: a mode and an input, prepared so that
+ * each stage can be run by itself */
+typedef struct
+{
+    const char *modeName;  /* name of the mode, as in a form */
+    Mode mode;             /* the mode */
+    const char *input;     /* short description of the input */
+    char form[8192];       /* form data of the request */
+    char value[4096];      /* value to render */
+    char scratch[8192];    /* room to parse things in place */
+    char parsed[4096];     /* the value, as parsed into code (whose banner
+                            * points into it) */
+    UpcEanCode code;       /* the parsed value, if a barcode */
+    int vstart;            /* top of the bars (below any banner) */
+    Bitmap *bitmap;        /* the rendered image */
+}
+StageCase;
+
+/* a stage to time; runs it once on the given case, and returns the count
+ * of bytes it output */
+typedef long (*StageFunction) (StageCase *c);
+
+/* set up options from the case's form data */
+long stageForm (StageCase *c)
+{
+    Options opts;
+
+    strcpy (c->scratch, c->form);
+    initOptions (&opts);
+    setOptionsFromForm (&opts, c->scratch);
+    return 0;
+}
+
+/* parse and normalize the case's value */
+long stageParse (StageCase *c)
+{
+    UpcEanCode code;
+    ErrorCode error;
+
+    strcpy (c->scratch, c->value);
+    encodeValue (c->mode, c->scratch, &code, &error);
+    return 0;
+}
+
+/* make the bars and digits of the case's barcode, with the make*()
+ * function for its symbology */
+long stageMake (StageCase *c)
+{
+    UpcEanCode *code = &c->code;
+    int supplement = upcEanSupplementWidth (code->supDigits);
+    int shortForm = modeIsShort (c->mode);
+    Bitmap *b;
+    long bytes;
+
+    switch (code->symbology)
+    {
+        case SYMBOL_UPCA:
+        {
+            b = makeUpcA (code->digits, shortForm, c->vstart, supplement);
+            break;
+        }
+        case SYMBOL_UPCE:
+        {
+            b = makeUpcE (code->digits, shortForm, c->vstart, supplement);
+            break;
+        }
+        case SYMBOL_EAN13:
+        {
+            b = makeEan13 (code->digits, shortForm, c->vstart, supplement);
+            break;
+        }
+        default:
+        {
+            b = makeEan8 (code->digits, shortForm, c->vstart, supplement);
+            break;
+        }
+    }
+
+    bytes = (long) b->widthBytes * b->height;
+    bitmapFree (b);
+    return bytes;
+}
+
+/* draw the case's supplement (over the one already there) */
+long stageSupplement (StageCase *c)
+{
+    Bitmap *b = c->bitmap;
+    int x = b->width - upcEanSupplementWidth (c->code.supDigits);
+
+    if (modeIsShort (c->mode))
+    {
+        drawUpcEanSupplementalBars (b, c->code.supDigits, x, c->vstart,
+                                    b->height - 1, 0);
+    }
+    else
+    {
+        drawUpcEanSupplementalBars (b, c->code.supDigits, x, c->vstart + 1,
+                                    b->height - 4, 1);
+    }
+
+    return 0;
+}
+
+/* draw the case's banner (over the one already there) */
+long stageBanner (StageCase *c)
+{
+    Bitmap *b = c->bitmap;
+
+    bitmapDrawString5x8 (b, (b->width + 1 - ((int) strlen (c->code.banner)
+                                             * 5)) / 2,
+                         0, c->code.banner);
+    return 0;
+}
+
+/* draw a single glyph */
+long stageGlyph (StageCase *c)
+{
+    bitmapDrawChar5x8 (c->bitmap, 1, 1, 'g');
+    return 0;
+}
+
+/* render the case's text */
+long stageText (StageCase *c)
+{
+    Bitmap *b = textToBitmap (c->value);
+    long bytes = (long) b->widthBytes * b->height;
+
+    bitmapFree (b);
+    return bytes;
+}
+
+/* render the case's value completely */
+long stageRender (StageCase *c)
+{
+    ErrorCode error;
+    int isBarcode;
+    Bitmap *b;
+    long bytes;
+
+    strcpy (c->scratch, c->value);
+    b = renderValue (c->mode, c->scratch, &isBarcode, &error);
+    bytes = (long) b->widthBytes * b->height;
+    bitmapFree (b);
+    return bytes;
+}
+
+/* write the case's image as XBM, into a new buffer */
+long stageXbm (StageCase *c)
+{
+    Buffer out;
+    long bytes;
+
+    bufferInit (&out);
+    bitmapWriteXbm (&out, c->bitmap, barcodeComment, "milk_barcode");
+    bytes = out.length;
+    bufferFree (&out);
+    return bytes;
+}
+
+/* handle the case's form data as a whole request, from parsing it to
+ * having the response ready to write */
+long stageRequest (StageCase *c)
+{
+    Options opts;
+    Response r;
+    long bytes;
+
+    strcpy (c->scratch, c->form);
+    initOptions (&opts);
+    setOptionsFromForm (&opts, c->scratch);
+    responseInit (&r);
+    respond (&opts, &r);
+    bytes = r.body.length;
+    responseFree (&r);
+    return bytes;
+}
+
+/* store the given value into out, form-encoded */
+void benchFormEscape (char *out, const char *value)
+{
+    for (; *value != '\0'; value++)
+    {
+        if (isalnum ((unsigned char) *value) || (*value == '.')
+            || (*value == '-'))
+        {
+            *out = *value;
+            out++;
+        }
+        else if (*value == ' ')
+        {
+            *out = '+';
+            out++;
+        }
+        else
+        {
+            out += sprintf (out, "%%%02X", (unsigned char) *value);
+        }
+    }
+
+    *out = '\0';
+}
+
+/* time the given stage on the given case, running it (twice as many times
+ * per round) until enough time has gone by, and print the results as a
+ * JSON object, preceded by a separator if this isn't the first one */
+void benchStage (const char *stage, StageFunction function, StageCase *c,
+                 int *first)
+{
+    long iters = 16;
+    long long elapsed;
+    unsigned long long allocs;
+    long bytes = 0;
+
+    for (;;)
+    {
+        long long start;
+        long n;
+
+        allocs = allocCount;
+        start = nowNanos ();
+        for (n = 0; n < iters; n++)
+        {
+            bytes = function (c);
+        }
+        elapsed = nowNanos () - start;
+        allocs = allocCount - allocs;
+
+        if (elapsed >= STAGE_BENCH_NANOS)
+        {
+            break;
+        }
+        iters *= 2;
+    }
+
+    printf ("%s  {\"stage\":\"%s\",\"mode\":\"%s\",\"input\":\"%s\","
+            "\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,"
+            "\"bytes_per_op\":%ld}",
+            *first ? "[\n" : ",\n", stage, c->modeName, c->input,
+            (double) elapsed / iters, (double) allocs / iters, bytes);
+    *first = 0;
+}
+
+/* time each stage of rendering separately, over a matrix of modes and
+ * inputs, printing the results as a JSON array */
+void benchStages (void)
+{
+    static const struct
+    {
+        const char *modeName;
+        Mode mode;
+        const char *input;
+        const char *value;
+    }
+    cases[] =
+    {
+        { "upcean",       MODE_UPCEAN,       "upca",        "03600029145?" },
+        { "upcean",       MODE_UPCEAN,       "ean13",       "400638133393?" },
+        { "upcean",       MODE_UPCEAN,       "ean13-sup5",
+          "978020137962?,51295" },
+        { "upcean",       MODE_UPCEAN,       "upca-banner",
+          "03600029145?:www.milk.com" },
+        { "upcean-short", MODE_UPCEAN_SHORT, "upca",        "03600029145?" },
+        { "upcean-short", MODE_UPCEAN_SHORT, "ean13-sup2",
+          "400638133393?,12" },
+        { "upce",         MODE_UPCE,         "upce",        "0425261?" },
+        { "upce",         MODE_UPCE,         "upca-sup2",   "04210000526?,76" },
+        { "ean8",         MODE_EAN8,         "ean8",        "9638507?" },
+        { "ean8",         MODE_EAN8,         "ean8-sup5",   "9638507?,12345" },
+        { "text",         MODE_TEXT,         "16-chars",    NULL },
+        { "text",         MODE_TEXT,         "256-chars",   NULL },
+        { "text",         MODE_TEXT,         "2048-chars",  NULL }
+    };
+    static const char line[] = "The quick brown fox jumps over the lazy dog.\n";
+    int caseCount = sizeof (cases) / sizeof (cases[0]);
+    StageCase *c = malloc (sizeof (StageCase));
+    int first = 1;
+    int i;
+
+    for (i = 0; i < caseCount; i++)
+    {
+        ErrorCode error;
+        int isBarcode;
+
+        c->modeName = cases[i].modeName;
+        c->mode = cases[i].mode;
+        c->input = cases[i].input;
+
+        if (cases[i].value != NULL)
+        {
+            strcpy (c->value, cases[i].value);
+        }
+        else
+        {
+            int length = atoi (cases[i].input);
+            int j;
+
+            for (j = 0; j < length; j++)
+            {
+                c->value[j] = line[j % (sizeof (line) - 1)];
+            }
+            c->value[length] = '\0';
+        }
+
+        /* the form data, with the value escaped */
+        benchFormEscape (c->form + sprintf (c->form, "mode=%s&value=",
+                                            c->modeName),
+                         c->value);
+
+        strcpy (c->scratch, c->value);
+        c->bitmap = renderValue (c->mode, c->scratch, &isBarcode, &error);
+        if (c->bitmap == NULL)
+        {
+            fprintf (stderr, "can't render %s\n", c->value);
+            continue;
+        }
+
+        benchStage ("form", stageForm, c, &first);
+        if (c->mode == MODE_TEXT)
+        {
+            benchStage ("text", stageText, c, &first);
+        }
+        else
+        {
+            strcpy (c->parsed, c->value);
+            encodeValue (c->mode, c->parsed, &c->code, &error);
+            c->vstart = (c->code.banner == NULL) ? 0 : 8;
+
+            benchStage ("parse", stageParse, c, &first);
+            benchStage ((c->code.symbology == SYMBOL_UPCA) ? "make-upca"
+                        : (c->code.symbology == SYMBOL_UPCE) ? "make-upce"
+                        : (c->code.symbology == SYMBOL_EAN13) ? "make-ean13"
+                        : "make-ean8",
+                        stageMake, c, &first);
+            if (c->code.supDigits[0] != '\0')
+            {
+                benchStage ("supplement", stageSupplement, c, &first);
+            }
+            if (c->code.banner != NULL)
+            {
+                benchStage ("banner", stageBanner, c, &first);
+            }
+            benchStage ("glyph", stageGlyph, c, &first);
+        }
+        benchStage ("render", stageRender, c, &first);
+        benchStage ("xbm", stageXbm, c, &first);
+        benchStage ("request", stageRequest, c, &first);
+
+        bitmapFree (c->bitmap);
+    }
+
+    printf ("\n]\n");
+    free (c);
+}
+
+
+/* run the named benchmark */
+void runBenchmark (char *name)
+{
+    if ((name == NULL) || (strcmp (name, "form") == 0))
+    {
+        benchForm ();
+    }
+    else if (strcmp (name, "check") == 0)
+    {
+        benchCheck ();
+    }
+    else if (strcmp (name, "upce") == 0)
+    {
+        benchUpcE ();
+    }
+    else if (strcmp (name, "password") == 0)
+    {
+        benchPassword ();
+    }
+    else if (strcmp (name, "xbm") == 0)
+    {
+        benchXbm ();
+    }
+    else if (strcmp (name, "verify") == 0)
+    {
+        benchVerify ();
+    }
+    else if (strcmp (name, "stages") == 0)
+    {
+        benchStages ();
+    }
+    else
+    {
+        fprintf (stderr, "unknown benchmark: %s\n", name);
+    }
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * server mode
+ */
+
+/* the maximum size of the header of a request to the server */
+#define SERVE_MAX_HEADER 8192
+
+/* the size of each connection's request buffer, which has room for a
+ * header, the largest acceptable body, and a terminating null */
+#define SERVE_BUFFER_BYTES (SERVE_MAX_HEADER + FORM_MAX_BYTES + 1)
+
+/* the number of threads serving requests; each one serves a single
+ * connection at a time, but only while it has a complete request header
+ * to serve (see servePoll()), so this is the limit on the number of
+ * requests being served at once, not on the number of connections */
+#define SERVE_THREADS 64
+
+/* the most connections kept open at once, and the most from any one
+ * client address; past the former, new connections wait to be accepted,
+ * and past the latter, they are closed as soon as they are accepted */
+#define SERVE_MAX_CONNECTIONS 4096
+#define SERVE_MAX_PER_ADDRESS 256
+
+/* the number of counts of open connections by client address, which
+ * are direct-mapped by a hash of the address (so that clients sharing a
+ * slot share a limit) */
+#define SERVE_ADDRESS_SLOTS 4096
+
+/* how long an idle connection is kept open, in seconds */
+#define SERVE_IDLE_SECONDS 30
+
+/* how long a client has to send the whole of a request (header and
+ * body), from its first byte, in seconds */
+#define SERVE_REQUEST_SECONDS 10
+
+/* the number of entries in the server's response cache, which are spread
+ * across a number of shards, each with its own lock */
+#define CACHE_ENTRIES 4096
+#define CACHE_SHARDS 16
+
+/* the largest response body, and the largest request key, that get
+ * cached */
+#define CACHE_MAX_BODY 16384
+#define CACHE_MAX_KEY 1024
+
+/* a cached response, along with the key of the request it answers (see
+ * requestKey()), in a single allocation; it is reference counted, with a
+ * reference held by the cache and one by each response being sent from
+ * it, so that a response's body can be written out straight from the
+ * entry, even after the entry has been displaced from the cache */
+typedef struct
+{
+    int refCount;            /* must be first (see Response.sharedBody) */
+    unsigned long long hash; /* hash of the key */
+    int keyLength;
+    int bodyLength;
+    HeaderId header;
+    int imageWidth;
+    int imageHeight;
+    char etag[19];           /* the entity tag of the body */
+    char data[];             /* the key, followed by the body */
+}
+CacheEntry;
+
+/* a shard of the response cache; entries are direct-mapped by hash, with
+ * a new response displacing whatever was in its slot */
+typedef struct
+{
+    pthread_mutex_t lock;
+    CacheEntry *entries[CACHE_ENTRIES / CACHE_SHARDS];
+}
+CacheShard;
+
+/* the response cache */
+static CacheShard responseCache[CACHE_SHARDS];
+
+/* initialize the (empty) response cache */
+void cacheInit (void)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init (&responseCache[i].lock, NULL);
+    }
+}
+
+/* return the cache entry slot for the given key hash, storing the shard it
+ * is in into *shard */
+CacheEntry **cacheSlot (unsigned long long hash, CacheShard **shard)
+{
+    *shard = &responseCache[hash % CACHE_SHARDS];
+    return &(*shard)->entries[(hash / CACHE_SHARDS)
+                              % (CACHE_ENTRIES / CACHE_SHARDS)];
+}
+
+/* release a reference to the given cache entry, freeing it if that was
+ * the last one */
+void cacheRelease (CacheEntry *entry)
+{
+    if ((entry != NULL)
+        && (__atomic_sub_fetch (&entry->refCount, 1, __ATOMIC_ACQ_REL) == 0))
+    {
+        free (entry);
+    }
+}
+
+/* look up the response to the request with the given key (and hash of the
+ * key), and if it is in the cache, fill in the given (empty) response
+ * with it, borrowing the entry's body (and its entity tag) rather than
+ * copying it; returns 0 if it isn't there */
+int cacheLookup (Buffer *key, unsigned long long hash, Response *r)
+{
+    CacheShard *shard;
+    CacheEntry **slot = cacheSlot (hash, &shard);
+    CacheEntry *entry;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = *slot;
+    if ((entry != NULL)
+        && (entry->hash == hash)
+        && (entry->keyLength == key->length)
+        && (memcmp (entry->data, key->buf, key->length) == 0))
+    {
+        __atomic_add_fetch (&entry->refCount, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        entry = NULL;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    if (entry == NULL)
+    {
+        return 0;
+    }
+
+    bufferFree (&r->body);
+    r->header = entry->header;
+    r->body.buf = entry->data + entry->keyLength;
+    r->body.length = entry->bodyLength;
+    r->imageWidth = entry->imageWidth;
+    r->imageHeight = entry->imageHeight;
+    memcpy (r->etag, entry->etag, sizeof (r->etag));
+    r->sharedBody = &entry->refCount;
+    return 1;
+}
+
+/* store the given response to the request with the given key (and hash of
+ * the key) in the cache, if it is a complete, cacheable response that
+ * isn't too large; this computes the response's entity tag, which is
+ * kept with the entry */
+void cacheStore (Buffer *key, unsigned long long hash, Response *r)
+{
+    CacheShard *shard;
+    CacheEntry **slot = cacheSlot (hash, &shard);
+    CacheEntry *old;
+    CacheEntry *entry;
+
+    if (! headerBlocks[r->header].cacheable
+        || (r->length >= 0)
+        || (r->body.length > CACHE_MAX_BODY)
+        || (key->length > CACHE_MAX_KEY))
+    {
+        return;
+    }
+
+    entry = malloc (sizeof (CacheEntry) + key->length + r->body.length);
+    entry->refCount = 1;
+    entry->hash = hash;
+    entry->keyLength = key->length;
+    entry->bodyLength = r->body.length;
+    entry->header = r->header;
+    entry->imageWidth = r->imageWidth;
+    entry->imageHeight = r->imageHeight;
+    memcpy (entry->etag, responseETag (r), sizeof (entry->etag));
+    memcpy (entry->data, key->buf, key->length);
+    memcpy (entry->data + key->length, r->body.buf, r->body.length);
+
+    pthread_mutex_lock (&shard->lock);
+    old = *slot;
+    *slot = entry;
+    pthread_mutex_unlock (&shard->lock);
+
+    cacheRelease (old);
+}
+
+/* the number of per-client token buckets of the rate limiter, which are
+ * spread across a number of shards, each with its own counters */
+#define RATE_BUCKETS 4096
+#define RATE_SHARDS 16
+
+/* how many seconds' worth of requests a client may make at once, after
+ * having been idle */
+#define RATE_BURST_SECONDS 2
+
+/* a shard of the rate limiter; each bucket is direct-mapped by client
+ * address, and is a single word, updated atomically, holding the address
+ * (in the high half) and the time at which its bucket will be full again
+ * (in the low half, in microseconds, wrapping around), which is how many
+ * tokens it lacks, in units of time */
+typedef struct
+{
+    unsigned long long buckets[RATE_BUCKETS / RATE_SHARDS];
+    unsigned long long allowed;   /* count of requests allowed */
+    unsigned long long limited;   /* count of requests refused */
+}
+__attribute__ ((aligned (64)))
+RateShard;
+
+/* the rate limiter: its shards, the time each token stands for, and the
+ * time that a full bucket's worth of tokens stands for (all 0 if there is
+ * no limit) */
+static RateShard rateShards[RATE_SHARDS];
+static int rateInterval = 0;
+static int rateWindow = 0;
+
+/* the complete response to a request over the limit, made in advance */
+static char rateLimitedResponse[256];
+static int rateLimitedLength = 0;
+
+/* set up the rate limiter to allow each client the given number of
+ * requests per second (with none meaning no limit) */
+void rateLimitInit (long perSecond)
+{
+    static const char *reason = "Too many requests; slow down.\n";
+    char *f = rateLimitedResponse;
+
+    if (perSecond <= 0)
+    {
+        return;
+    }
+
+    if (perSecond > 1000000)
+    {
+        perSecond = 1000000;
+    }
+    rateInterval = 1000000 / perSecond;
+    rateWindow = rateInterval * perSecond * RATE_BURST_SECONDS;
+
+    f = fragmentString (f, headerBlocks[HEADER_TEXT_429].http);
+    f = fragmentString (f, "Content-Length: ");
+    f = fragmentNumber (f, strlen (reason));
+    f = fragmentString (f, "\r\nRetry-After: 1\r\n"
+                        "Connection: close\r\n\r\n");
+    f = fragmentString (f, reason);
+    rateLimitedLength = f - rateLimitedResponse;
+}
+
+/* take a token from the bucket of the client with the given (IPv4)
+ * address, returning 0 if it has none left and so must be refused;
+ * another client that maps to the same bucket takes it over, with a full
+ * bucket */
+int rateLimitAllow (unsigned int address)
+{
+    unsigned long long hash = address * 0x9e3779b97f4a7c15ULL;
+    RateShard *shard = &rateShards[hash >> 60];
+    unsigned long long *bucket =
+        &shard->buckets[(hash >> 32) % (RATE_BUCKETS / RATE_SHARDS)];
+    unsigned int now = (unsigned int) (nowNanos () / 1000);
+    unsigned long long old = __atomic_load_n (bucket, __ATOMIC_RELAXED);
+    unsigned long long next;
+
+    do
+    {
+        /* how long until the bucket is full, which is never more than
+         * the window unless the time has wrapped around, or the bucket
+         * belongs to another client */
+        int lacking = (int) ((unsigned int) old - now);
+
+        if (((old >> 32) != address) || (lacking < 0)
+            || (lacking > rateWindow))
+        {
+            lacking = 0;
+        }
+
+        if ((lacking + rateInterval) > rateWindow)
+        {
+            __atomic_fetch_add (&shard->limited, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        next = ((unsigned long long) address << 32)
+            | (unsigned int) (now + lacking + rateInterval);
+    }
+    while (! __atomic_compare_exchange_n (bucket, &old, next, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    __atomic_fetch_add (&shard->allowed, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* set up the given response to report the rate limiter's counters, per
+ * shard, as JSON */
+void rateLimitResponse (Response *r)
+{
+    int i;
+
+    r->header = HEADER_JSON_LIVE;
+    bufferPrintf (&r->body, "{\"perSecond\":%d,\"burst\":%d,\"shards\":[",
+                  (rateInterval == 0) ? 0 : (1000000 / rateInterval),
+                  (rateInterval == 0) ? 0 : (rateWindow / rateInterval));
+    for (i = 0; i < RATE_SHARDS; i++)
+    {
+        bufferPrintf (&r->body, "%s{\"allowed\":%llu,\"limited\":%llu}",
+                      (i == 0) ? "" : ",",
+                      __atomic_load_n (&rateShards[i].allowed,
+                                       __ATOMIC_RELAXED),
+                      __atomic_load_n (&rateShards[i].limited,
+                                       __ATOMIC_RELAXED));
+    }
+    bufferAppendString (&r->body, "]}\n");
+}
+
+/* a connection to the server; while it is idle, or has only part of a
+ * request header, it is watched by the server's main thread, and once it
+ * has a complete header, it is handed to a worker thread (see
+ * servePoll()) */
+typedef struct ServeConnection
+{
+    int fd;
+    unsigned int address;         /* the client's (IPv4) address */
+    long long deadline;           /* when to give up on it (see nowNanos()) */
+    int have;                     /* count of bytes in buf */
+    char buf[SERVE_MAX_HEADER];   /* the start of the next request */
+    struct ServeConnection *next; /* the next one in a queue */
+}
+ServeConnection;
+
+/* a queue of connections passed between the server's threads */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;    /* signalled when a connection is added */
+    ServeConnection *head;
+    ServeConnection *tail;
+}
+ServeQueue;
+
+/* the state shared by all of the server's threads */
+typedef struct
+{
+    int listenFd;              /* the listening socket */
+    int wakeFds[2];            /* a pipe to wake up the main thread */
+    int maxConnections;        /* the most connections kept open at once */
+    int openCount;             /* the count of connections open */
+    ServeQueue requests;       /* connections with a request to serve */
+    ServeQueue returned;       /* connections handed back by the workers */
+    Options defaults;          /* the options that each request starts with */
+}
+Server;
+
+/* counts of open connections, by client address (see serveAddressSlot()) */
+static int serveAddressCounts[SERVE_ADDRESS_SLOTS];
+
+/* the parts of the header of a request to the server, all pointing into
+ * the connection's buffer */
+typedef struct
+{
+    char *method;
+    char *path;
+    char *query;         /* the query string, or "" if none */
+    char *contentType;   /* the values of the headers of interest, or */
+    char *contentLength; /* NULL for ones that are absent */
+    char *ifNoneMatch;
+    int chunked;         /* boolean whether there is a Transfer-Encoding */
+    int keepAlive;       /* boolean whether the connection persists */
+}
+HttpRequest;
+
+/* find the blank line at the end of the request header at the start of
+ * the given data, returning a pointer to its CRLFCRLF, or NULL if the
+ * header isn't complete */
+char *httpFindHeaderEnd (char *data, int length)
+{
+    char *p = data;
+    char *end = data + length;
+
+    while ((p = memchr (p, '\r', end - p)) != NULL)
+    {
+        if ((end - p) < 4)
+        {
+            return NULL;
+        }
+        if ((p[1] == '\n') && (p[2] == '\r') && (p[3] == '\n'))
+        {
+            return p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/* null-terminate the line at the given position (in place of its line
+ * ending), and return the position of the next line */
+char *httpSplitLine (char *line)
+{
+    char *end = strchr (line, '\n');
+    char *next;
+
+    if (end == NULL)
+    {
+        return line + strlen (line);
+    }
+
+    next = end + 1;
+    if ((end > line) && (end[-1] == '\r'))
+    {
+        end--;
+    }
+    *end = '\0';
+
+    return next;
+}
+
+/* parse the given request header, which must be null-terminated just
+ * after its last line, into the given request struct, in place; returns 0
+ * if it is malformed */
+int httpParseHeader (char *header, HttpRequest *req)
+{
+    char *line = header;
+    char *next = httpSplitLine (line);
+    char *version;
+    char *p;
+
+    req->contentType = NULL;
+    req->contentLength = NULL;
+    req->ifNoneMatch = NULL;
+    req->chunked = 0;
+
+    /* the request line: method, target, and version */
+    req->method = line;
+    req->path = strchr (line, ' ');
+    if (req->path == NULL)
+    {
+        return 0;
+    }
+    *req->path = '\0';
+    req->path++;
+
+    version = strchr (req->path, ' ');
+    if ((version == NULL) || (strncmp (version + 1, "HTTP/1.", 7) != 0))
+    {
+        return 0;
+    }
+    *version = '\0';
+    version++;
+    req->keepAlive = (strcmp (version, "HTTP/1.1") == 0);
+
+    req->query = strchr (req->path, '?');
+    if (req->query == NULL)
+    {
+        req->query = "";
+    }
+    else
+    {
+        *req->query = '\0';
+        req->query++;
+    }
+
+    /* the header fields */
+    for (line = next; *line != '\0'; line = next)
+    {
+        char *value;
+
+        next = httpSplitLine (line);
+        value = strchr (line, ':');
+        if (value == NULL)
+        {
+            return 0;
+        }
+        *value = '\0';
+        value++;
+
+        while ((*value == ' ') || (*value == '\t'))
+        {
+            value++;
+        }
+        for (p = value + strlen (value);
+             (p > value) && ((p[-1] == ' ') || (p[-1] == '\t'));
+             p--)
+        {
+            p[-1] = '\0';
+        }
+
+        if (strcasecmp (line, "Content-Type") == 0)
+        {
+            req->contentType = value;
+        }
+        else if (strcasecmp (line, "Content-Length") == 0)
+        {
+            req->contentLength = value;
+        }
+        else if (strcasecmp (line, "If-None-Match") == 0)
+        {
+            req->ifNoneMatch = value;
+        }
+        else if (strcasecmp (line, "Transfer-Encoding") == 0)
+        {
+            req->chunked = 1;
+        }
+        else if (strcasecmp (line, "Connection") == 0)
+        {
+            if (strcasecmp (value, "close") == 0)
+            {
+                req->keepAlive = 0;
+            }
+            else if (strcasecmp (value, "keep-alive") == 0)
+            {
+                req->keepAlive = 1;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* after rejecting a request on the given connection, stop sending, and
+ * discard (up to a limit) whatever else the client sends, so that closing
+ * the connection doesn't reset it before the client reads the rejection */
+void serveDrain (int fd, char *buf)
+{
+    struct timeval linger;
+    int total = 0;
+
+    linger.tv_sec = 1;
+    linger.tv_usec = 0;
+    shutdown (fd, SHUT_WR);
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &linger, sizeof (linger));
+
+    while (total < (SERVE_BUFFER_BYTES * 4))
+    {
+        ssize_t amt = read (fd, buf, SERVE_BUFFER_BYTES);
+
+        if (amt <= 0)
+        {
+            break;
+        }
+        total += amt;
+    }
+}
+
+/* add the given connection to the end of the given queue */
+void serveQueuePush (ServeQueue *queue, ServeConnection *conn)
+{
+    conn->next = NULL;
+    pthread_mutex_lock (&queue->lock);
+    if (queue->tail == NULL)
+    {
+        queue->head = conn;
+    }
+    else
+    {
+        queue->tail->next = conn;
+    }
+    queue->tail = conn;
+    pthread_cond_signal (&queue->ready);
+    pthread_mutex_unlock (&queue->lock);
+}
+
+/* take the first connection from the given queue, waiting for there to
+ * be one */
+ServeConnection *serveQueuePop (ServeQueue *queue)
+{
+    ServeConnection *conn;
+
+    pthread_mutex_lock (&queue->lock);
+    while (queue->head == NULL)
+    {
+        pthread_cond_wait (&queue->ready, &queue->lock);
+    }
+    conn = queue->head;
+    queue->head = conn->next;
+    if (queue->head == NULL)
+    {
+        queue->tail = NULL;
+    }
+    pthread_mutex_unlock (&queue->lock);
+
+    return conn;
+}
+
+/* take all of the connections from the given queue, without waiting;
+ * returns the first of them (linked by their next fields), or NULL if
+ * there are none */
+ServeConnection *serveQueueTake (ServeQueue *queue)
+{
+    ServeConnection *conn;
+
+    pthread_mutex_lock (&queue->lock);
+    conn = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    pthread_mutex_unlock (&queue->lock);
+
+    return conn;
+}
+
+/* get the count of open connections from the client with the given
+ * (IPv4) address */
+int *serveAddressSlot (unsigned int address)
+{
+    unsigned long long hash = address * 0x9e3779b97f4a7c15ULL;
+
+    return &serveAddressCounts[(hash >> 32) % SERVE_ADDRESS_SLOTS];
+}
+
+/* wake up the server's main thread, if it is waiting in poll() */
+void serveWake (Server *server)
+{
+    char c = 0;
+
+    /* if the pipe is full, the main thread is already due to wake up */
+    if (write (server->wakeFds[1], &c, 1) < 0)
+    {
+        return;
+    }
+}
+
+/* close the given connection and free its state */
+void serveClose (Server *server, ServeConnection *conn)
+{
+    close (conn->fd);
+    __atomic_fetch_sub (serveAddressSlot (conn->address), 1,
+                        __ATOMIC_RELAXED);
+    if (__atomic_fetch_sub (&server->openCount, 1, __ATOMIC_RELAXED)
+        == server->maxConnections)
+    {
+        /* the main thread stopped accepting connections at the limit */
+        serveWake (server);
+    }
+    free (conn);
+}
+
+/* read more of a request from the given connection into the given
+ * buffer, waiting until no later than the given deadline (see
+ * nowNanos()); returns the count of bytes read, or 0 if the connection
+ * was closed or failed, or the deadline passed */
+int serveRead (int fd, char *buf, int length, long long deadline)
+{
+    for (;;)
+    {
+        struct pollfd pfd;
+        long long left = deadline - nowNanos ();
+        ssize_t amt;
+
+        if (left <= 0)
+        {
+            return 0;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll (&pfd, 1, (int) ((left + 999999) / 1000000)) <= 0)
+        {
+            continue;
+        }
+
+        amt = read (fd, buf, length);
+        if (amt > 0)
+        {
+            return amt;
+        }
+        if ((amt == 0) || (errno != EINTR))
+        {
+            return 0;
+        }
+    }
+}
+
+/* serve requests from the given connection, which has a complete request
+ * header (or more than SERVE_MAX_HEADER bytes without one), using the
+ * given buffer (of SERVE_BUFFER_BYTES), for as long as it has complete
+ * requests to serve; requests may be pipelined; returns 1 if the
+ * connection is to be kept open, with whatever there is of its next
+ * request back in its own buffer, or 0 if it is to be closed */
+int serveConnection (Server *server, ServeConnection *conn, char *buf)
+{
+    int fd = conn->fd;
+    long long deadline = conn->deadline;
+    int have = conn->have;
+
+    memcpy (buf, conn->buf, have);
+
+    for (;;)
+    {
+        HttpRequest req;
+        Options opts;
+        Response r;
+        HeaderId header;
+        const char *reason = NULL;
+        char *headerEnd = httpFindHeaderEnd (buf, have);
+        char *data;
+        char saved = '\0';
+        long long start;
+        long long sendStart;
+        int headerLength;
+        int length = 0;
+        int rendering = 0;
+        int isJson;
+        int ok;
+
+        if ((headerEnd == NULL) || ((headerEnd + 4 - buf) > SERVE_MAX_HEADER))
+        {
+            if (have < SERVE_MAX_HEADER)
+            {
+                /* the rest of the header is waited for by the main
+                 * thread, not by a worker, unless it is already here */
+                ssize_t amt = recv (fd, buf + have, SERVE_MAX_HEADER - have,
+                                    MSG_DONTWAIT);
+
+                if (amt > 0)
+                {
+                    have += amt;
+                    continue;
+                }
+                memcpy (conn->buf, buf, have);
+                conn->have = have;
+                return 1;
+            }
+            header = HEADER_TEXT_431;
+            reason = "The request header is too large.";
+        }
+
+        start = metricsStart ();
+
+        if ((rateInterval != 0) && (reason == NULL)
+            && ! rateLimitAllow (conn->address))
+        {
+            /* a client over its limit gets nothing more than the canned
+             * refusal, and then the connection is closed */
+            struct iovec iov;
+
+            iov.iov_base = rateLimitedResponse;
+            iov.iov_len = rateLimitedLength;
+            writevFully (fd, &iov, 1);
+            return 0;
+        }
+
+        PROBE (request__start);
+        traceBegin (start);
+        responseInit (&r);
+
+        if (reason == NULL)
+        {
+            headerLength = headerEnd + 4 - buf;
+            headerEnd[2] = '\0';
+
+            if (! httpParseHeader (buf, &req))
+            {
+                header = HEADER_TEXT_400;
+                reason = "The request is malformed.";
+            }
+            else if (req.chunked)
+            {
+                header = HEADER_TEXT_411;
+                reason = "Request bodies must have a length.";
+            }
+            else if (requestCheck (req.method, req.contentType,
+                                   req.contentLength, &isJson, &length,
+                                   &header, &reason))
+            {
+                reason = NULL;
+            }
+        }
+
+        if (reason != NULL)
+        {
+            /* the rest of the request can't be trusted, so give up on the
+             * connection after rejecting it */
+            rejectResponse (&r, header, reason);
+            responseWrite (&r, fd, RESPONSE_HTTP, 0);
+            PROBE3 (request__done, -1, r.body.length, r.header);
+            responseFree (&r);
+            serveDrain (fd, buf);
+            return 0;
+        }
+
+        /* read the rest of the body, if any */
+        while (have < (headerLength + length))
+        {
+            int amt = serveRead (fd, buf + have,
+                                 SERVE_BUFFER_BYTES - 1 - have, deadline);
+
+            if (amt == 0)
+            {
+                responseFree (&r);
+                return 0;
+            }
+            have += amt;
+        }
+
+        if (strcmp (req.method, "POST") == 0)
+        {
+            /* terminate the body, saving the first byte of any pipelined
+             * request that follows it */
+            data = buf + headerLength;
+            saved = data[length];
+            data[length] = '\0';
+        }
+        else
+        {
+            data = req.query;
+        }
+
+        if (strcmp (req.path, "/rate-limit") == 0)
+        {
+            rateLimitResponse (&r);
+        }
+        else if (strcmp (req.path, "/metrics") == 0)
+        {
+            metricsResponse (&r);
+        }
+        else if (strcmp (req.path, "/traces") == 0)
+        {
+            traceResponse (&r);
+        }
+        else if (strcmp (req.path, "/") != 0)
+        {
+            rejectResponse (&r, HEADER_TEXT_404, "There is nothing here.");
+        }
+        else
+        {
+            Buffer key;
+            int keyed;
+
+            opts = server->defaults;
+            opts.head = (strcmp (req.method, "HEAD") == 0);
+            setOptionsFromRequest (&opts, data, isJson);
+            traceRequest (&opts);
+            rendering = 1;
+
+            /* the key is made first, since a signature covers it, but
+             * the request is only looked up once it has passed */
+            bufferInit (&key);
+            keyed = requestKey (&opts, &key);
+            checkPassword (&opts, keyed ? &key : NULL);
+
+            if (keyed && (opts.error == ERROR_NONE)
+                && (opts.mode != MODE_PONDER))
+            {
+                unsigned long long hash = hashBytes (key.buf, key.length);
+                long long lookupStart = metricsStart ();
+                int hit;
+
+                PROBE1 (cache__start, hash);
+                hit = cacheLookup (&key, hash, &r);
+                PROBE2 (cache__done, hit, key.length);
+                metricsStage (METRIC_STAGE_CACHE, lookupStart);
+                metricsCache (hit);
+                if (hit)
+                {
+                    metricsKeyErrors (&key);
+                }
+
+                if (hit)
+                {
+                    r.cacheStatus = "HIT";
+                    r.head = opts.head;
+                }
+                else
+                {
+                    respond (&opts, &r);
+                    cacheStore (&key, hash, &r);
+                    r.cacheStatus = "MISS";
+                }
+            }
+            else
+            {
+                respond (&opts, &r);
+            }
+            bufferFree (&key);
+
+            if ((req.ifNoneMatch != NULL)
+                && headerBlocks[r.header].cacheable
+                && (r.length < 0))
+            {
+                if (strcmp (req.ifNoneMatch, responseETag (&r)) == 0)
+                {
+                    r.header = HEADER_NOT_MODIFIED;
+                    r.head = 1;
+                }
+            }
+        }
+
+        sendStart = metricsStart ();
+        ok = responseWrite (&r, fd, RESPONSE_HTTP, req.keepAlive);
+        metricsStage (METRIC_STAGE_SEND, sendStart);
+        PROBE3 (request__done, rendering ? (int) opts.mode : -1,
+                r.head ? 0 : r.body.length, r.header);
+        if (rendering)
+        {
+            metricsRequest (opts.mode, r.head ? 0 : r.body.length);
+            metricsStage (METRIC_STAGE_REQUEST, start);
+        }
+        traceEnd (rendering ? (int) opts.mode : -1, r.header,
+                  r.head ? 0 : r.body.length);
+        responseFree (&r);
+
+        if (! ok || ! req.keepAlive)
+        {
+            return 0;
+        }
+
+        if (data != req.query)
+        {
+            data[length] = saved;
+        }
+
+        /* shift any pipelined data down to the start of the buffer; the
+         * next request gets its own time to arrive in full */
+        have -= headerLength + length;
+        memmove (buf, buf + headerLength + length, have);
+        deadline = nowNanos () + SERVE_REQUEST_SECONDS * 1000000000LL;
+    }
+}
+
+/* serve the requests handed over by the main thread, forever; this is run
+ * in each of the server's worker threads */
+void *serveWorker (void *arg)
+{
+    Server *server = arg;
+    char *buf = malloc (SERVE_BUFFER_BYTES);
+
+    for (;;)
+    {
+        ServeConnection *conn = serveQueuePop (&server->requests);
+
+        if (serveConnection (server, conn, buf))
+        {
+            serveQueuePush (&server->returned, conn);
+            serveWake (server);
+        }
+        else
+        {
+            serveClose (server, conn);
+        }
+    }
+
+    return NULL;
+}
+
+/* accept as many new connections as are waiting (up to the limits), and
+ * add them to the given array of the given count of idle connections;
+ * returns 0 if accepting failed for want of resources */
+int serveAccept (Server *server, ServeConnection **conns, int *count,
+                 long long now)
+{
+    struct timeval sendTimeout;
+    int one = 1;
+
+    sendTimeout.tv_sec = SERVE_REQUEST_SECONDS;
+    sendTimeout.tv_usec = 0;
+
+    while (__atomic_load_n (&server->openCount, __ATOMIC_RELAXED)
+           < server->maxConnections)
+    {
+        ServeConnection *conn;
+        struct sockaddr_in peer;
+        socklen_t peerLength = sizeof (peer);
+        unsigned int address;
+        int *slot;
+        int fd = accept (server->listenFd, (struct sockaddr *) &peer,
+                         &peerLength);
+
+        if (fd < 0)
+        {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK)
+                || (errno == EINTR) || (errno == ECONNABORTED);
+        }
+
+        address = ntohl (peer.sin_addr.s_addr);
+        slot = serveAddressSlot (address);
+        conn = NULL;
+        if (__atomic_load_n (slot, __ATOMIC_RELAXED) < SERVE_MAX_PER_ADDRESS)
+        {
+            conn = malloc (sizeof (ServeConnection));
+        }
+        if (conn == NULL)
+        {
+            close (fd);
+            continue;
+        }
+
+        /* a client that won't take its response doesn't get to hold on
+         * to a worker for longer than it would get to send a request */
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+        setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout,
+                    sizeof (sendTimeout));
+
+        __atomic_fetch_add (slot, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&server->openCount, 1, __ATOMIC_RELAXED);
+        conn->fd = fd;
+        conn->address = address;
+        conn->deadline = now + SERVE_IDLE_SECONDS * 1000000000LL;
+        conn->have = 0;
+        conns[(*count)++] = conn;
+    }
+
+    return 1;
+}
+
+/* read whatever has come in on the given connection; returns 1 if it now
+ * has a complete request header (or as much of one as is allowed), -1 if
+ * it is to be closed, or 0 if it is still waiting for more */
+int serveFill (ServeConnection *conn, long long now)
+{
+    ssize_t amt = recv (conn->fd, conn->buf + conn->have,
+                        SERVE_MAX_HEADER - conn->have, MSG_DONTWAIT);
+
+    if (amt <= 0)
+    {
+        if ((amt < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+                          || (errno == EINTR)))
+        {
+            return 0;
+        }
+        return -1;
+    }
+
+    if (conn->have == 0)
+    {
+        /* the clock for the whole request starts with its first byte */
+        conn->deadline = now + SERVE_REQUEST_SECONDS * 1000000000LL;
+    }
+    conn->have += amt;
+
+    return (conn->have == SERVE_MAX_HEADER)
+        || (httpFindHeaderEnd (conn->buf, conn->have) != NULL);
+}
+
+/* accept connections, and watch all of those without a complete request
+ * header to serve, handing each to the worker threads once it has one,
+ * and closing those that have been idle for too long, or that are taking
+ * too long to send a request; this never returns */
+void servePoll (Server *server)
+{
+    ServeConnection **conns =
+        malloc (server->maxConnections * sizeof (ServeConnection *));
+    struct pollfd *fds =
+        malloc ((server->maxConnections + 2) * sizeof (struct pollfd));
+    long long acceptPaused = 0;
+    int count = 0;
+
+    for (;;)
+    {
+        ServeConnection *conn;
+        ServeConnection *next;
+        long long now = nowNanos ();
+        int kept = 0;
+        int i;
+
+        /* take back the connections that the workers are done with for
+         * now; one with part of its next request already in has that
+         * request's whole time to send the rest */
+        for (conn = serveQueueTake (&server->returned); conn != NULL;
+             conn = next)
+        {
+            next = conn->next;
+            conn->deadline = now + ((conn->have == 0)
+                                    ? SERVE_IDLE_SECONDS
+                                    : SERVE_REQUEST_SECONDS) * 1000000000LL;
+            conns[count++] = conn;
+        }
+
+        fds[0].fd = server->wakeFds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = server->listenFd;
+        fds[1].events = (now >= acceptPaused) ? POLLIN : 0;
+        for (i = 0; i < count; i++)
+        {
+            fds[i + 2].fd = conns[i]->fd;
+            fds[i + 2].events = POLLIN;
+        }
+
+        if (poll (fds, count + 2, 1000) < 0)
+        {
+            continue;
+        }
+        now = nowNanos ();
+
+        if (fds[0].revents != 0)
+        {
+            char drain[64];
+
+            while (read (server->wakeFds[0], drain, sizeof (drain)) > 0)
+            {
+                continue;
+            }
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            int status = -1;
+
+            conn = conns[i];
+            if (fds[i + 2].revents != 0)
+            {
+                status = serveFill (conn, now);
+            }
+            else if (now < conn->deadline)
+            {
+                status = 0;
+            }
+
+            if (status == 0)
+            {
+                conns[kept++] = conn;
+            }
+            else if (status > 0)
+            {
+                serveQueuePush (&server->requests, conn);
+            }
+            else
+            {
+                serveClose (server, conn);
+            }
+        }
+        count = kept;
+
+        /* when out of file descriptors (or memory), the pending
+         * connections are left waiting for a little while, rather than
+         * being spun on */
+        if ((fds[1].revents != 0)
+            && ! serveAccept (server, conns, &count, now))
+        {
+            acceptPaused = now + 100000000LL;
+        }
+    }
+}
+
+/* run as an HTTP/1.1 server on the port given in the options, with each
+ * request starting out with the rest of the options; this never
+ * returns */
+void serve (Options *opts)
+{
+    static Server server;
+    pthread_t thread;
+    struct sockaddr_in addr;
+    struct rlimit files;
+    char *portEnd;
+    long port = strtol (opts->servePort, &portEnd, 10);
+    int one = 1;
+    int i;
+
+    if ((*portEnd != '\0') || (port <= 0) || (port > 65535))
+    {
+        fprintf (stderr, "invalid port: %s\n", opts->servePort);
+        exit (1);
+    }
+
+    server.defaults = *opts;
+    server.defaults.httpHeader = 1;
+    server.defaults.value = NULL;
+    server.defaults.valueCount = 0;
+    metricsEnabled = 1;
+    stageClockSetup ();
+    cacheInit ();
+    rateLimitInit (opts->rateLimit);
+
+    /* use as many file descriptors as allowed, keeping some back for
+     * everything other than connections */
+    server.maxConnections = SERVE_MAX_CONNECTIONS;
+    if (getrlimit (RLIMIT_NOFILE, &files) == 0)
+    {
+        if (files.rlim_cur < files.rlim_max)
+        {
+            files.rlim_cur = files.rlim_max;
+            setrlimit (RLIMIT_NOFILE, &files);
+            getrlimit (RLIMIT_NOFILE, &files);
+        }
+        if (files.rlim_cur < (rlim_t) (server.maxConnections + 64))
+        {
+            server.maxConnections = (int) files.rlim_cur - 64;
+        }
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_ANY);
+    addr.sin_port = htons (port);
+
+    server.listenFd = socket (AF_INET, SOCK_STREAM, 0);
+    if ((server.maxConnections < 1)
+        || (server.listenFd < 0)
+        || (setsockopt (server.listenFd, SOL_SOCKET, SO_REUSEADDR,
+                        &one, sizeof (one)) != 0)
+        || (bind (server.listenFd, (struct sockaddr *) &addr,
+                  sizeof (addr)) != 0)
+        || (listen (server.listenFd, SOMAXCONN) != 0)
+        || (fcntl (server.listenFd, F_SETFL, O_NONBLOCK) != 0)
+        || (pipe (server.wakeFds) != 0)
+        || (fcntl (server.wakeFds[0], F_SETFL, O_NONBLOCK) != 0)
+        || (fcntl (server.wakeFds[1], F_SETFL, O_NONBLOCK) != 0))
+    {
+        perror ("serve");
+        exit (1);
+    }
+
+    pthread_mutex_init (&server.requests.lock, NULL);
+    pthread_cond_init (&server.requests.ready, NULL);
+    pthread_mutex_init (&server.returned.lock, NULL);
+    pthread_cond_init (&server.returned.ready, NULL);
+
+    /* a client going away mid-response must not kill the server */
+    signal (SIGPIPE, SIG_IGN);
+
+    if (traceEnabled)
+    {
+        /* SIGUSR1 is left to a thread that dumps the traces */
+        static sigset_t signals;
+
+        sigemptyset (&signals);
+        sigaddset (&signals, SIGUSR1);
+        pthread_sigmask (SIG_BLOCK, &signals, NULL);
+        if (pthread_create (&thread, NULL, traceSignalWorker, &signals) == 0)
+        {
+            pthread_detach (thread);
+        }
+    }
+
+    for (i = 0; i < SERVE_THREADS; i++)
+    {
+        if (pthread_create (&thread, NULL, serveWorker, &server) != 0)
+        {
+            if (i == 0)
+            {
+                perror ("serve");
+                exit (1);
+            }
+            break;
+        }
+        pthread_detach (thread);
+    }
+
+    servePoll (&server);
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * load generator
+ */
+
+/* bits of precision of the latency histograms; each power of two is split
+ * into half this many powers of two of buckets, so that a value is
+ * recorded to within 1/128th of itself (an HDR histogram, in effect) */
+#define LATENCY_SUB_BITS 8
+#define LATENCY_HALF (1 << (LATENCY_SUB_BITS - 1))
+
+/* the largest latency recorded, in nanoseconds (about 18 minutes); longer
+ * ones are recorded as this */
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 3) \
+                         * LATENCY_HALF)
+
+/* the most connections the load generator will open */
+#define LOAD_MAX_CONNECTIONS 1024
+
+/* the most requests that may be waiting for a free connection; arrivals
+ * past this are dropped (and counted) */
+#define LOAD_QUEUE 65536
+
+/* how long to wait for the requests still in flight at the end of a run,
+ * in nanoseconds */
+#define LOAD_GRACE_NANOS 5000000000LL
+
+/* a histogram of latencies, in nanoseconds */
+typedef struct
+{
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long total;  /* count of values recorded */
+    long long max;             /* largest value recorded */
+}
+LatencyHistogram;
+
+/* return the index of the bucket of the given (non-negative) value: values
+ * below 2^LATENCY_SUB_BITS get a bucket each, and above that each power of
+ * two gets LATENCY_HALF buckets, indexed by the top bits of the value */
+int latencyBucket (long long value)
+{
+    int shift;
+
+    if (value < (1LL << LATENCY_SUB_BITS))
+    {
+        return value;
+    }
+
+    if (value >= (1LL << LATENCY_MAX_BITS))
+    {
+        value = (1LL << LATENCY_MAX_BITS) - 1;
+    }
+
+    shift = (63 - __builtin_clzll (value)) - (LATENCY_SUB_BITS - 1);
+    return shift * LATENCY_HALF + (int) (value >> shift);
+}
+
+/* return the largest value that falls in the given bucket */
+long long latencyBucketValue (int index)
+{
+    int shift = index / LATENCY_HALF - 1;
+
+    if (shift <= 0)
+    {
+        return index;
+    }
+
+    return (((long long) (index - shift * LATENCY_HALF) + 1) << shift) - 1;
+}
+
+/* record the given latency in the given histogram */
+void latencyRecord (LatencyHistogram *h, long long value)
+{
+    if (value < 0)
+    {
+        value = 0;
+    }
+
+    h->counts[latencyBucket (value)]++;
+    h->total++;
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+/* return the latency at the given percentile (0 to 100) of the given
+ * histogram, to within its precision */
+long long latencyPercentile (LatencyHistogram *h, double percentile)
+{
+    unsigned long long rank =
+        (unsigned long long) (percentile / 100.0 * h->total + 0.5);
+    unsigned long long seen = 0;
+    int i;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= rank)
         {
-            processUpcEan (opts.value, 6, 0, opts.httpHeader);
-            break;
+            long long value = latencyBucketValue (i);
+            return (value < h->max) ? value : h->max;
         }
-        case MODE_UPCE_SHORT:
+    }
+
+    return h->max;
+}
+
+/* print the given histogram as a JSON object, with the latencies in
+ * microseconds */
+void latencyPrint (const char *name, LatencyHistogram *h, int last)
+{
+    printf ("    \"%s\":{\"count\":%llu,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+            "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}%s\n",
+            name, h->total,
+            latencyPercentile (h, 50.0) / 1000.0,
+            latencyPercentile (h, 90.0) / 1000.0,
+            latencyPercentile (h, 99.0) / 1000.0,
+            latencyPercentile (h, 99.9) / 1000.0,
+            h->max / 1000.0,
+            last ? "" : ",");
+}
+
+/* a connection of the load generator */
+typedef struct
+{
+    int fd;              /* the socket, or -1 if not connected */
+    long long scheduled; /* when the request in flight was due to be sent,
+                          * or -1 if there is none */
+    Buffer in;           /* the response read so far */
+}
+LoadConnection;
+
+/* the state of a run of the load generator */
+typedef struct
+{
+    struct sockaddr_in addr;       /* where the server is */
+    char **requests;               /* the requests to send, formatted */
+    int *requestLengths;           /* length of each request */
+    int requestCount;              /* count of requests */
+    int nextRequest;               /* index of the next request to send */
+    LoadConnection *conns;         /* the connections */
+    int connCount;                 /* count of connections */
+    long long *queue;              /* scheduled times of the requests
+                                    * waiting for a connection */
+    int queueHead;                 /* index of the oldest waiting request */
+    int queueCount;                /* count of waiting requests */
+    unsigned long long sent;       /* count of requests sent */
+    unsigned long long completed;  /* count of responses received */
+    unsigned long long failed;     /* count of error responses and
+                                    * requests lost to closed connections */
+    unsigned long long dropped;    /* count of arrivals dropped for lack
+                                    * of room in the queue */
+    LatencyHistogram all;          /* latencies of all responses */
+    LatencyHistogram hit;          /* latencies of cache hits */
+    LatencyHistogram miss;         /* latencies of cache misses */
+}
+Load;
+
+/* read the request mix from the named file (or stdin, if it is NULL or
+ * "-"), one request target (e.g. "/?value=0123456789?") per line, skipping
+ * blank lines and lines starting with "#"; each is formatted as a
+ * complete GET request; returns 0 if no requests could be read */
+int loadReadMix (Load *load, const char *name)
+{
+    FILE *file = stdin;
+    char *line = NULL;
+    size_t size = 0;
+    int capacity = 0;
+    ssize_t length;
+
+    if ((name != NULL) && (strcmp (name, "-") != 0))
+    {
+        file = fopen (name, "r");
+        if (file == NULL)
         {
-            processUpcEan (opts.value, 6, 1, opts.httpHeader);
-            break;
+            perror (name);
+            return 0;
         }
-        case MODE_EAN8:
+    }
+
+    load->requests = NULL;
+    load->requestLengths = NULL;
+    load->requestCount = 0;
+
+    while ((length = getline (&line, &size, file)) >= 0)
+    {
+        Buffer request;
+
+        while ((length > 0)
+               && ((line[length - 1] == '\n') || (line[length - 1] == '\r')))
         {
-            processUpcEan (opts.value, 8, 0, opts.httpHeader);
-            break;
+            length--;
         }
-        case MODE_EAN8_SHORT:
+        line[length] = '\0';
+
+        if ((length == 0) || (line[0] == '#'))
         {
-            processUpcEan (opts.value, 8, 1, opts.httpHeader);
-            break;
+            continue;
+        }
+
+        if (load->requestCount == capacity)
+        {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            load->requests =
+                realloc (load->requests, capacity * sizeof (char *));
+            load->requestLengths =
+                realloc (load->requestLengths, capacity * sizeof (int));
+        }
+
+        bufferInit (&request);
+        bufferPrintf (&request,
+                      "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", line);
+        load->requests[load->requestCount] = request.buf;
+        load->requestLengths[load->requestCount] = request.length;
+        load->requestCount++;
+    }
+
+    free (line);
+    if (file != stdin)
+    {
+        fclose (file);
+    }
+
+    return (load->requestCount != 0);
+}
+
+/* (re)connect the given connection to the server; returns 0 if that
+ * could not be done */
+int loadConnect (Load *load, LoadConnection *conn)
+{
+    int one = 1;
+
+    if (conn->fd >= 0)
+    {
+        close (conn->fd);
+    }
+
+    conn->scheduled = -1;
+    conn->in.length = 0;
+    conn->fd = socket (AF_INET, SOCK_STREAM, 0);
+
+    if ((conn->fd < 0)
+        || (connect (conn->fd, (struct sockaddr *) &load->addr,
+                     sizeof (load->addr)) != 0))
+    {
+        if (conn->fd >= 0)
+        {
+            close (conn->fd);
+            conn->fd = -1;
+        }
+        return 0;
+    }
+
+    setsockopt (conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    return 1;
+}
+
+/* send the next request of the mix on the given (idle) connection,
+ * accounting it to the given scheduled time */
+void loadSend (Load *load, LoadConnection *conn, long long scheduled)
+{
+    struct iovec iov;
+
+    if ((conn->fd < 0) && ! loadConnect (load, conn))
+    {
+        load->failed++;
+        return;
+    }
+
+    iov.iov_base = load->requests[load->nextRequest];
+    iov.iov_len = load->requestLengths[load->nextRequest];
+    load->nextRequest = (load->nextRequest + 1) % load->requestCount;
+    load->sent++;
+
+    if (! writevFully (conn->fd, &iov, 1))
+    {
+        load->failed++;
+        close (conn->fd);
+        conn->fd = -1;
+        return;
+    }
+
+    conn->scheduled = scheduled;
+}
+
+/* find the value of the named header (whose name includes the colon) in
+ * the given response header, which ends at the given position; returns
+ * NULL if it isn't there */
+const char *loadFindHeader (const char *header, const char *end,
+                            const char *name)
+{
+    int length = strlen (name);
+    const char *pos = header;
+
+    for (;;)
+    {
+        pos = memchr (pos, '\n', end - pos);
+        if (pos == NULL)
+        {
+            return NULL;
         }
-        case MODE_TEXT:
+        pos++;
+
+        if ((end - pos > length) && (strncasecmp (pos, name, length) == 0))
         {
-            if (opts.value == NULL)
+            pos += length;
+            while (*pos == ' ')
             {
-                opts.value = "Enjoy milk's many splendors\nat www.milk.com!";
+                pos++;
+            }
+            return pos;
+        }
+    }
+}
+
+/* read what there is to read on the given connection, which has a request
+ * in flight, and if that completes its response, record its latency;
+ * the connection is closed if the server closes it (or asks to) */
+void loadReceive (Load *load, LoadConnection *conn, long long now)
+{
+    const char *headerEnd;
+    const char *value;
+    long bodyLength = 0;
+    int status;
+    ssize_t amt;
+
+    bufferReserve (&conn->in, 16384);
+    amt = read (conn->fd, conn->in.buf + conn->in.length,
+                conn->in.capacity - conn->in.length - 1);
+
+    if (amt <= 0)
+    {
+        if ((amt < 0) && (errno == EINTR))
+        {
+            return;
+        }
+
+        /* the server went away before responding */
+        load->failed++;
+        close (conn->fd);
+        conn->fd = -1;
+        conn->scheduled = -1;
+        return;
+    }
+
+    conn->in.length += amt;
+    conn->in.buf[conn->in.length] = '\0';
+
+    headerEnd = strstr (conn->in.buf, "\r\n\r\n");
+    if (headerEnd == NULL)
+    {
+        return;
+    }
+    headerEnd += 4;
+
+    status = (strncmp (conn->in.buf, "HTTP/1.", 7) == 0)
+        ? atoi (conn->in.buf + 9) : 0;
+    value = loadFindHeader (conn->in.buf, headerEnd, "Content-Length:");
+    if ((value != NULL) && (status != 304))
+    {
+        bodyLength = strtol (value, NULL, 10);
+    }
+
+    if (conn->in.buf + conn->in.length < headerEnd + bodyLength)
+    {
+        return;
+    }
+
+    load->completed++;
+    latencyRecord (&load->all, now - conn->scheduled);
+
+    value = loadFindHeader (conn->in.buf, headerEnd, "X-Cache:");
+    if (value != NULL)
+    {
+        latencyRecord ((strncmp (value, "HIT", 3) == 0)
+                       ? &load->hit : &load->miss,
+                       now - conn->scheduled);
+    }
+
+    if ((status < 200) || (status >= 400))
+    {
+        load->failed++;
+    }
+
+    value = loadFindHeader (conn->in.buf, headerEnd, "Connection:");
+    if ((value != NULL) && (strncasecmp (value, "close", 5) == 0))
+    {
+        close (conn->fd);
+        conn->fd = -1;
+    }
+
+    conn->scheduled = -1;
+    conn->in.length = 0;
+}
+
+/* replay the request mix read from the named file against the server on
+ * the given port of this host, over the given count of keep-alive
+ * connections, at the given (open-loop) arrival rate in requests per
+ * second, for the given count of seconds; then print the latencies (all
+ * told, and split by whether each response came from the cache) as a JSON
+ * object; latencies are measured from when each request was due to be
+ * sent, not from when a connection was free to send it, so that a server
+ * that falls behind isn't flattered by the wait for a connection (that
+ * is, there is no coordinated omission); returns 0 if the run couldn't
+ * be made */
+int loadRun (const char *port, const char *mixName, long rate,
+             long connCount, long seconds)
+{
+    Load *load;
+    struct pollfd *fds;
+    int *fdConns;
+    char *portEnd;
+    long portNumber = strtol (port, &portEnd, 10);
+    long long interval;
+    long long start;
+    long long end;
+    long long now;
+    long long arrivals = 0;
+    int connected = 0;
+    int i;
+
+    if ((*portEnd != '\0') || (portNumber <= 0) || (portNumber > 65535))
+    {
+        fprintf (stderr, "invalid port: %s\n", port);
+        return 0;
+    }
+
+    if ((rate <= 0) || (connCount <= 0) || (seconds <= 0))
+    {
+        fprintf (stderr, "the rate, connections, and duration must all "
+                 "be positive\n");
+        return 0;
+    }
+
+    load = calloc (1, sizeof (Load));
+    if (! loadReadMix (load, mixName))
+    {
+        fprintf (stderr, "no requests to send\n");
+        return 0;
+    }
+
+    if (connCount > LOAD_MAX_CONNECTIONS)
+    {
+        connCount = LOAD_MAX_CONNECTIONS;
+    }
+
+    load->addr.sin_family = AF_INET;
+    load->addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    load->addr.sin_port = htons (portNumber);
+    load->conns = calloc (connCount, sizeof (LoadConnection));
+    load->connCount = connCount;
+    load->queue = malloc (LOAD_QUEUE * sizeof (long long));
+    fds = malloc (connCount * sizeof (struct pollfd));
+    fdConns = malloc (connCount * sizeof (int));
+
+    /* a server that goes away mid-request must not kill the run */
+    signal (SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < connCount; i++)
+    {
+        load->conns[i].fd = -1;
+        bufferInit (&load->conns[i].in);
+        connected += loadConnect (load, &load->conns[i]);
+    }
+
+    if (connected == 0)
+    {
+        fprintf (stderr, "can't connect to port %ld\n", portNumber);
+        return 0;
+    }
+
+    interval = 1000000000LL / rate;
+    if (interval == 0)
+    {
+        interval = 1;
+    }
+
+    start = nowNanos ();
+    end = start + seconds * 1000000000LL;
+
+    for (;;)
+    {
+        long long nextArrival = start + arrivals * interval;
+        int inFlight = 0;
+        int timeout;
+        int count = 0;
+
+        now = nowNanos ();
+
+        /* the arrivals that are due, each at its own scheduled time */
+        while ((nextArrival <= now) && (nextArrival < end))
+        {
+            if (load->queueCount == LOAD_QUEUE)
+            {
+                load->dropped++;
+            }
+            else
+            {
+                load->queue[(load->queueHead + load->queueCount)
+                            % LOAD_QUEUE] = nextArrival;
+                load->queueCount++;
+            }
+            arrivals++;
+            nextArrival = start + arrivals * interval;
+        }
+
+        for (i = 0; i < connCount; i++)
+        {
+            LoadConnection *conn = &load->conns[i];
+
+            if ((conn->scheduled < 0) && (load->queueCount != 0))
+            {
+                loadSend (load, conn, load->queue[load->queueHead]);
+                load->queueHead = (load->queueHead + 1) % LOAD_QUEUE;
+                load->queueCount--;
+            }
+
+            if (conn->scheduled >= 0)
+            {
+                fds[count].fd = conn->fd;
+                fds[count].events = POLLIN;
+                fdConns[count] = i;
+                count++;
+                inFlight++;
             }
-            textToXbm (opts.value, opts.httpHeader);
-            break;
         }
-        case MODE_PONDER:
+
+        if ((nextArrival >= end) && (load->queueCount == 0)
+            && ((inFlight == 0) || (now >= end + LOAD_GRACE_NANOS)))
         {
-            wordsToPonderXbm (opts.httpHeader);
             break;
         }
+
+        /* wait for a response or the next arrival, spinning once that is
+         * less than a millisecond off, since poll() can't time any
+         * closer than that */
+        timeout = (nextArrival < end)
+            ? (int) ((nextArrival - now) / 1000000) : 10;
+        poll (fds, count, timeout);
+
+        now = nowNanos ();
+        for (i = 0; i < count; i++)
+        {
+            if (fds[i].revents != 0)
+            {
+                loadReceive (load, &load->conns[fdConns[i]], now);
+            }
+        }
+    }
+
+    now = nowNanos ();
+    printf ("{\n"
+            "  \"requests\":%d,\"connections\":%ld,\"rate\":%ld,"
+            "\"seconds\":%.2f,\n"
+            "  \"sent\":%llu,\"completed\":%llu,\"failed\":%llu,"
+            "\"dropped\":%llu,\"achieved_rate\":%.1f,\n"
+            "  \"latency\":{\n",
+            load->requestCount, connCount, rate,
+            (now - start) / 1e9,
+            load->sent, load->completed, load->failed, load->dropped,
+            load->completed / ((end - start) / 1e9));
+    latencyPrint ("all", &load->all, 0);
+    latencyPrint ("hit", &load->hit, 0);
+    latencyPrint ("miss", &load->miss, 1);
+    printf ("  }\n}\n");
+
+    for (i = 0; i < connCount; i++)
+    {
+        if (load->conns[i].fd >= 0)
+        {
+            close (load->conns[i].fd);
+        }
+        bufferFree (&load->conns[i].in);
+    }
+
+    for (i = 0; i < load->requestCount; i++)
+    {
+        free (load->requests[i]);
+    }
+
+    free (load->requests);
+    free (load->requestLengths);
+    free (load->conns);
+    free (load->queue);
+    free (load);
+    free (fds);
+    free (fdConns);
+    return 1;
+}
+
+
+
+/* ----------------------------------------------------------------------------
+ * main program
+ */
+
+int main (int argc, char *argv[])
+{
+    Options opts;
+
+    initOptions (&opts);
+    setOptionsFromArgv (&opts, argc, argv);
+
+    if (metricsEnabled || traceEnabled)
+    {
+        stageClockSetup ();
+    }
+
+    if (metricsFile != NULL)
+    {
+        atexit (metricsDump);
+    }
+
+    if (traceEnabled && (opts.servePort == NULL))
+    {
+        atexit (traceDump);
+    }
+
+    if (opts.font != NULL)
+    {
+        const char *reason;
+
+        if (! fontLoad (opts.font, &reason))
+        {
+            fprintf (stderr, "can't load font %s: %s\n", opts.font, reason);
+            exit (1);
+        }
+    }
+
+    if (opts.servePort != NULL)
+    {
+        serve (&opts);
+    }
+
+    if (opts.loadPort != NULL)
+    {
+        if (! loadRun (opts.loadPort, opts.value, opts.loadRate,
+                       opts.loadConnections, opts.loadSeconds))
+        {
+            exit (1);
+        }
+        exit (0);
+    }
+
+    if (opts.signLifetime != 0)
+    {
+        if (! printSignature (&opts))
+        {
+            fprintf (stderr, "request can't be signed\n");
+            exit (1);
+        }
+        exit (0);
+    }
+
+    checkPassword (&opts, NULL);
+
+    switch (opts.mode)
+    {
         case MODE_CHECK:
         {
             long mask = 0;
@@ -2209,7 +12111,14 @@ int main (int argc, char *argv[])
             {
                 mask = strtol (opts.value, NULL, 0);
             }
-            xbmIntegrity (mask);
+            if (opts.argCount == 0)
+            {
+                xbmIntegrity (mask);
+            }
+            else if (xbmIntegrityFiles (opts.args, opts.argCount, mask) != 0)
+            {
+                exit (1);
+            }
             break;
         }
         case MODE_PRINT_PASSWORD:
@@ -2217,6 +12126,57 @@ int main (int argc, char *argv[])
             printPassword ();
             break;
         }
+        case MODE_BENCH:
+        {
+            runBenchmark (opts.value);
+            break;
+        }
+        case MODE_VALIDATE:
+        case MODE_COMPLETE:
+        case MODE_CONVERT:
+        {
+            NumbersTask task = (opts.mode == MODE_VALIDATE) ? NUMBERS_VALIDATE
+                : (opts.mode == MODE_COMPLETE) ? NUMBERS_COMPLETE
+                : NUMBERS_CONVERT;
+
+            if (numberStream (task) != 0)
+            {
+                exit (1);
+            }
+            break;
+        }
+        case MODE_CATALOG:
+        {
+            if (catalogStream (MODE_BOOK) != 0)
+            {
+                exit (1);
+            }
+            break;
+        }
+        default:
+        {
+            Response response;
+            long long start;
+
+            start = metricsStart ();
+            PROBE (request__start);
+            traceBegin (start);
+            traceRequest (&opts);
+            responseInit (&response);
+            respond (&opts, &response);
+            responseWrite (&response, 1,
+                           opts.httpHeader ? RESPONSE_CGI : RESPONSE_BODY, 0);
+            PROBE3 (request__done, opts.mode,
+                    response.head ? 0 : response.body.length,
+                    response.header);
+            metricsRequest (opts.mode,
+                            response.head ? 0 : response.body.length);
+            metricsStage (METRIC_STAGE_REQUEST, start);
+            traceEnd (opts.mode, response.header,
+                      response.head ? 0 : response.body.length);
+            responseFree (&response);
+            break;
+        }
     }
 
     exit (0);